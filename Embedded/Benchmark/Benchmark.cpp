@@ -0,0 +1,400 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Benchmark.h"
+#include <algorithm>
+#include <chrono>
+
+#define SETUP_RETRIES 3
+#define SYNC_INTERVAL_US 1000000 /* As TrackerManager.SynchronizeClocks() recommends */
+#define STOP_RETRIES 10 /* Same as Tracker.StopStreaming() */
+#define SILENCE_US 20000
+#define MAX_SKIPPED_FRAMES_SHIFT 6U /* Same as Tracker.MaxSkippedPollsShift */
+
+Benchmark::Benchmark(uint8_t firstID, uint32_t timeoutUS, uint16_t streamPeriodUS)
+    : firstID(firstID), timeoutUS(timeoutUS), streamPeriodUS(streamPeriodUS), baud(0), byteUS(0), numNodes(0), slotLength(0),
+      lastSync(0), result(nullptr), readLength(0), readOffset(0)
+{
+    origin = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    quiks_parser_reset(&parser);
+}
+
+bool Benchmark::open(const char *path, uint32_t baud)
+{
+    this->baud = baud;
+    byteUS = (10 * 1000000 + baud - 1) / baud;
+    return serial.open(path, baud);
+}
+
+int64_t Benchmark::now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - origin;
+}
+
+size_t Benchmark::stage(size_t offset, uint8_t id, const uint8_t *data, size_t length)
+{
+    writeBuffer[offset] = PACKET_HEADER;
+    writeBuffer[offset + 1] = id;
+    return offset + 2 + quiks_encode(data, length, &writeBuffer[offset + 2]);
+}
+
+void Benchmark::flush(size_t length)
+{
+    serial.write(writeBuffer, length);
+    result->hostBytes += length;
+}
+
+void Benchmark::send(uint8_t id, const uint8_t *data, size_t length)
+{
+    flush(stage(0, id, data, length));
+}
+
+size_t Benchmark::receive(int64_t deadline)
+{
+    while (true) {
+        if (readOffset < readLength) {
+            size_t packetLength;
+            readOffset += quiks_parse(&parser, &readBuffer[readOffset], readLength - readOffset, &packetLength);
+            if (packetLength) {
+                return packetLength;
+            }
+            continue;
+        }
+        const int64_t current = now();
+        if (current >= deadline) {
+            return 0;
+        }
+        const long received = serial.read(readBuffer, sizeof(readBuffer), deadline - current);
+        if (received < 0) {
+            return 0;
+        }
+        result->nodeBytes += received;
+        readLength = received;
+        readOffset = 0;
+    }
+}
+
+/* Throws away bytes until the bus is silent, so late replies do not answer the next request */
+void Benchmark::drain(uint32_t silenceUS)
+{
+    while (serial.read(readBuffer, sizeof(readBuffer), silenceUS) > 0) ;
+    readLength = 0;
+    readOffset = 0;
+    quiks_parser_reset(&parser);
+}
+
+void Benchmark::synchronize()
+{
+    lastSync = now();
+    const uint32_t hostTime = lastSync;
+    const uint8_t packet[] = {Command_Sync, (uint8_t)hostTime, (uint8_t)(hostTime >> 8),
+                              (uint8_t)(hostTime >> 16), (uint8_t)(hostTime >> 24)};
+    send(BROADCAST_ID, packet, sizeof(packet));
+}
+
+bool Benchmark::setup(const BenchmarkCase &benchmarkCase)
+{
+    numNodes = benchmarkCase.numNodes;
+    lastSequences.assign(numNodes, -1);
+    missedReplies.assign(numNodes, 0);
+    pollsToSkip.assign(numNodes, 0);
+    const bool isCompact = benchmarkCase.format == Format_Compact
+                        || benchmarkCase.strategy == Strategy_Stamped || benchmarkCase.strategy == Strategy_Latched;
+    slotLength = isCompact ? COMPACT_QUATERNION_SLOT_LENGTH : NODE_QUATERNION_SLOT_LENGTH;
+    drain(SILENCE_US);
+
+    const uint8_t setFormat[] = {Command_Set_Format, (uint8_t)(isCompact ? Format_Compact : Format_Float)};
+    for (uint32_t index = 0; index < numNodes; ++index) {
+        bool isAcknowledged = false;
+        for (int retry = 0; retry < SETUP_RETRIES && ! isAcknowledged; ++retry) {
+            send(firstID + index, setFormat, sizeof(setFormat));
+            isAcknowledged = receive(now() + timeoutUS) == 2
+                          && parser.packet[0] == Command_Reply_Ack && parser.packet[1] == 1;
+        }
+        if (! isAcknowledged) {
+            message = "Node " + std::to_string(firstID + index) + " did not acknowledge Command_Set_Format";
+            return false;
+        }
+    }
+    if (benchmarkCase.strategy == Strategy_Stamped) {
+        synchronize();
+    }
+    return true;
+}
+
+/* One round of Command_Read_Quaternion or Command_Read_Stamped_Quaternion over the nodes */
+/* Timed out requests are sent again, as Tracker.ReadRotation() does */
+void Benchmark::poll(uint8_t command, int64_t end)
+{
+    for (uint32_t index = 0; index < numNodes; ++index) {
+        if (command == Command_Read_Stamped_Quaternion && now() - lastSync >= SYNC_INTERVAL_US) {
+            synchronize();
+        }
+        while (true) {
+            if (now() >= end) {
+                return;
+            }
+            const int64_t requested = now();
+            send(firstID + index, &command, 1);
+            ++result->attempts;
+            const size_t length = receive(requested + timeoutUS);
+            const uint8_t *packet = parser.packet;
+            if (command == Command_Read_Quaternion
+                && ((length == 17 && packet[0] == Command_Reply_Quaternion)
+                    || (length == 8 && packet[0] == Command_Reply_Compact_Quaternion))) {
+                ++result->rotations;
+                result->latencyUS.push_back(now() - requested);
+                break;
+            }
+            if (command == Command_Read_Stamped_Quaternion && length == 13 && packet[0] == Command_Reply_Stamped_Quaternion) {
+                const uint32_t received = now();
+                const int32_t sequence = packet[1] | (packet[2] << 8);
+                const uint32_t timestamp = packet[3] | (packet[4] << 8) | (packet[5] << 16) | ((uint32_t)packet[6] << 24);
+                ++result->rotations;
+                /* Same sample is read again if polled faster than DMP outputs */
+                if (sequence != lastSequences[index]) {
+                    lastSequences[index] = sequence;
+                    result->latencyUS.push_back(received - timestamp);
+                }
+                break;
+            }
+            ++result->timeouts;
+        }
+    }
+    ++result->frames;
+}
+
+/* Same as Tracker.PrepareLatchedRotations(), nodes missing replies are skipped for doubling frames */
+void Benchmark::latch(int64_t end)
+{
+    const uint8_t command = Command_Latch;
+    const uint8_t read = Command_Read_Latched_Quaternion;
+    /* Latch goes out with the first request */
+    size_t staged = stage(0, BROADCAST_ID, &command, 1);
+    const int64_t latched = now();
+    /* The previous reply is accounted after the next request goes out */
+    int replied = -1;
+    int64_t repliedAt = 0;
+    for (uint32_t index = 0; index < numNodes; ++index) {
+        if (now() >= end) {
+            if (replied >= 0) {
+                account(replied, latched, repliedAt);
+            }
+            return;
+        }
+        if (pollsToSkip[index]) {
+            --pollsToSkip[index];
+            continue;
+        }
+        const int64_t requested = now();
+        flush(stage(staged, firstID + index, &read, 1));
+        staged = 0;
+        ++result->attempts;
+        if (replied >= 0) {
+            account(replied, latched, repliedAt);
+            replied = -1;
+        }
+        /* Late replies of the nodes before are thrown away */
+        size_t length;
+        const uint8_t *packet = parser.packet;
+        do {
+            length = receive(requested + timeoutUS);
+        } while (length == 12 && packet[0] == Command_Reply_Latched_Quaternion && packet[1] != firstID + index);
+        if (length != 12 || packet[0] != Command_Reply_Latched_Quaternion) {
+            ++result->timeouts;
+            missedReplies[index] = std::min(missedReplies[index] + 1, MAX_SKIPPED_FRAMES_SHIFT);
+            pollsToSkip[index] = (1U << missedReplies[index]) - 1;
+            continue;
+        }
+        missedReplies[index] = 0;
+        replied = index;
+        repliedAt = now();
+    }
+    if (replied >= 0) {
+        account(replied, latched, repliedAt);
+    }
+    if (staged) {
+        flush(staged);
+    }
+    ++result->frames;
+}
+
+/* Counts the latched reply left in the parser */
+void Benchmark::account(uint32_t index, int64_t latched, int64_t repliedAt)
+{
+    const uint8_t *packet = parser.packet;
+    ++result->rotations;
+    const int32_t sequence = packet[2] | (packet[3] << 8);
+    const uint32_t age = packet[4] | (packet[5] << 8);
+    if (age != 0xFFFF && sequence != lastSequences[index]) {
+        lastSequences[index] = sequence;
+        result->latencyUS.push_back(repliedAt - latched + age);
+    }
+}
+
+/* Same as Tracker.PrepareRotations() */
+void Benchmark::broadcast()
+{
+    const uint64_t idBitmap = ((numNodes == 64 ? 0 : 1ULL << numNodes) - 1) << firstID;
+    uint8_t request[10] = {Command_Read_All_Quaternions};
+    for (int byte = 0; byte < 8; ++byte) {
+        request[1 + byte] = idBitmap >> (8 * byte);
+    }
+    request[9] = slotLength;
+    const int64_t requested = now();
+    send(BROADCAST_ID, request, sizeof(request));
+    const int64_t deadline = requested + (2 + sizeof(request) + 2) * byteUS
+                           + numNodes * (slotLength * byteUS + BROADCAST_GUARD_US) + timeoutUS;
+    uint32_t received = 0;
+    while (received < numNodes) {
+        const size_t length = receive(deadline);
+        if (length == 0) {
+            break;
+        }
+        const uint8_t *packet = parser.packet;
+        if ((length == 18 && packet[0] == Command_Reply_Node_Quaternion)
+            || (length == 8 && packet[0] == Command_Reply_Compact_Quaternion)) {
+            ++received;
+            ++result->rotations;
+            result->latencyUS.push_back(now() - requested);
+        }
+    }
+    result->attempts += numNodes;
+    result->timeouts += numNodes - received;
+    ++result->frames;
+}
+
+/* Nodes extend the period to fit their slots and the one for host */
+int64_t Benchmark::streamingPeriod() const
+{
+    const double slotUS = slotLength * 10e6 / baud + BROADCAST_GUARD_US;
+    return std::max<int64_t>(streamPeriodUS, (numNodes + 1) * slotUS);
+}
+
+/* Same as Tracker.StartStreaming() and Tracker.ReadStreamedRotations() */
+void Benchmark::stream(int64_t end)
+{
+    const uint64_t idBitmap = ((numNodes == 64 ? 0 : 1ULL << numNodes) - 1) << firstID;
+    uint8_t request[12] = {Command_Start_Streaming};
+    for (int byte = 0; byte < 8; ++byte) {
+        request[1 + byte] = idBitmap >> (8 * byte);
+    }
+    request[9] = slotLength;
+    request[10] = streamPeriodUS;
+    request[11] = streamPeriodUS >> 8;
+    const int64_t started = now();
+    send(BROADCAST_ID, request, sizeof(request));
+
+    const int64_t period = streamingPeriod();
+    int previousID = 64;
+    while (now() < end) {
+        const size_t length = receive(std::min<int64_t>(end, now() + period + timeoutUS));
+        const uint8_t *packet = parser.packet;
+        if (! ((length == 18 && packet[0] == Command_Reply_Node_Quaternion)
+               || (length == 8 && packet[0] == Command_Reply_Compact_Quaternion))) {
+            continue;
+        }
+        ++result->rotations;
+        /* Period starts with the node of the smallest ID */
+        if (packet[1] <= previousID) {
+            ++result->frames;
+        }
+        previousID = packet[1];
+    }
+    /* First period starts after one period */
+    const uint64_t periods = std::max<int64_t>(0, now() - started - period) / period;
+    result->attempts = periods * numNodes;
+    result->timeouts = result->attempts > result->rotations ? result->attempts - result->rotations : 0;
+}
+
+/* Same as Tracker.StopStreaming(), stop request goes in the host slot after the last node */
+bool Benchmark::stopStreaming()
+{
+    const uint8_t lastID = firstID + numNodes - 1;
+    const uint8_t command = Command_Stop_Streaming;
+    const int64_t period = streamingPeriod();
+    for (int retry = 0; retry < STOP_RETRIES; ++retry) {
+        const int64_t deadline = now() + period + timeoutUS;
+        size_t length;
+        while ((length = receive(deadline)) && ! (length >= 2 && parser.packet[1] == lastID)) ;
+        send(BROADCAST_ID, &command, 1);
+        if (receive(now() + period + timeoutUS) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Benchmark::run(const BenchmarkCase &benchmarkCase, double seconds, BenchmarkResult *result)
+{
+    *result = BenchmarkResult();
+    result->isLatencyFromSample = benchmarkCase.strategy == Strategy_Stamped || benchmarkCase.strategy == Strategy_Latched;
+    this->result = result;
+    if (! setup(benchmarkCase)) {
+        return false;
+    }
+    const uint64_t setupBytes[] = {result->hostBytes, result->nodeBytes};
+
+    const int64_t start = now();
+    const int64_t end = start + (int64_t)(seconds * 1000000);
+    switch (benchmarkCase.strategy) {
+        case Strategy_Poll:
+            while (now() < end) {
+                poll(Command_Read_Quaternion, end);
+            }
+            break;
+
+        case Strategy_Stamped:
+            while (now() < end) {
+                poll(Command_Read_Stamped_Quaternion, end);
+            }
+            break;
+
+        case Strategy_Latched:
+            while (now() < end) {
+                latch(end);
+            }
+            break;
+
+        case Strategy_Broadcast:
+            while (now() < end) {
+                broadcast();
+            }
+            break;
+
+        case Strategy_Stream:
+            stream(end);
+            break;
+    }
+    result->seconds = (now() - start) / 1e6;
+    result->hostBytes -= setupBytes[0];
+    result->nodeBytes -= setupBytes[1];
+
+    if (benchmarkCase.strategy == Strategy_Stream) {
+        const uint64_t measuredBytes[] = {result->hostBytes, result->nodeBytes};
+        const bool isStopped = stopStreaming();
+        result->hostBytes = measuredBytes[0];
+        result->nodeBytes = measuredBytes[1];
+        if (! isStopped) {
+            message = "Nodes did not stop streaming";
+            return false;
+        }
+    }
+    std::sort(result->latencyUS.begin(), result->latencyUS.end());
+    return true;
+}
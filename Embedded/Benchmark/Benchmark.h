@@ -0,0 +1,114 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Benchmark__
+#define __Benchmark__
+
+#include "quiks.h"
+#include "Serial.h"
+#include "Protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* How host reads rotations, named after the methods of Tracker and TrackerManager */
+typedef enum {
+    Strategy_Poll, /* Command_Read_Quaternion one by one, retried on timeout like Tracker.ReadRotation */
+    Strategy_Stamped, /* Command_Read_Stamped_Quaternion one by one after Command_Sync */
+    Strategy_Latched, /* Command_Latch and then Command_Read_Latched_Quaternion one by one */
+    Strategy_Broadcast, /* Command_Read_All_Quaternions */
+    Strategy_Stream, /* Command_Start_Streaming */
+} strategy_t;
+
+struct BenchmarkCase {
+    strategy_t strategy;
+    format_t format; /* Stamped and latched replies are always compact */
+    uint32_t numNodes;
+    uint32_t baud;
+};
+
+struct BenchmarkResult {
+    double seconds;
+    uint64_t frames; /* Rounds over all nodes (requests, latches or periods of streaming) */
+    uint64_t rotations;
+    uint64_t attempts; /* Replies waited for */
+    uint64_t timeouts; /* Replies not received, retried only by Strategy_Poll and Strategy_Stamped */
+    uint64_t hostBytes; /* Written by host */
+    uint64_t nodeBytes; /* Read by host */
+    /* From the sample in node to host, or from the request if the strategy does not tell it */
+    std::vector<uint32_t> latencyUS;
+    bool isLatencyFromSample;
+};
+
+/* Reads nodes of IDs from firstID through a serial port, and measures how fast rotations come */
+class Benchmark {
+public:
+    Benchmark(uint8_t firstID, uint32_t timeoutUS, uint16_t streamPeriodUS);
+
+    /* Returns false on failure, errno tells the reason */
+    bool open(const char *path, uint32_t baud);
+
+    /* Reads nodes for seconds, returns false if any node does not reply to setup */
+    bool run(const BenchmarkCase &benchmarkCase, double seconds, BenchmarkResult *result);
+
+    /* Why run() failed */
+    const std::string &error() const { return message; }
+
+private:
+    int64_t now() const;
+    /* Encodes a packet into writeBuffer from offset, returns the end of it */
+    size_t stage(size_t offset, uint8_t id, const uint8_t *data, size_t length);
+    void flush(size_t length);
+    void send(uint8_t id, const uint8_t *data, size_t length);
+    /* Returns decoded length of the next reply, or 0 on timeout */
+    size_t receive(int64_t deadline);
+    void drain(uint32_t silenceUS);
+    bool setup(const BenchmarkCase &benchmarkCase);
+    void synchronize();
+
+    void poll(uint8_t command, int64_t end);
+    void latch(int64_t end);
+    void account(uint32_t index, int64_t latched, int64_t repliedAt);
+    void broadcast();
+    int64_t streamingPeriod() const;
+    void stream(int64_t end);
+    bool stopStreaming();
+
+    Serial serial;
+    uint8_t firstID;
+    uint32_t timeoutUS;
+    uint16_t streamPeriodUS;
+    uint32_t baud;
+    uint32_t byteUS; /* 10 bits on the bus */
+    uint32_t numNodes;
+    uint8_t slotLength;
+    int64_t origin;
+    int64_t lastSync;
+    std::string message;
+    BenchmarkResult *result;
+    std::vector<int32_t> lastSequences; /* -1 until a sample is read */
+    std::vector<uint32_t> missedReplies; /* In a row, by Strategy_Latched */
+    std::vector<uint32_t> pollsToSkip;
+
+    quiks_parser_t parser;
+    uint8_t readBuffer[256];
+    size_t readLength;
+    size_t readOffset;
+    uint8_t writeBuffer[2 * (2 + QUIKS_MAX_REQUEST_LENGTH + QUIKS_MAX_REQUEST_LENGTH / 253 + 1)]; /* Two packets at once */
+};
+
+#endif
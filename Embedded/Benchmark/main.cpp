@@ -0,0 +1,253 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Benchmark.h"
+#include "Simulator.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+static const char * const strategyNames[] = {"poll", "stamped", "latched", "broadcast", "stream"};
+static const char * const formatNames[] = {"float", "compact"};
+
+static void usage(const char *command)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-i first id] [-n nodes] [-b baud] [-s strategies] [-f formats]\n"
+                    "       [-d seconds] [-T timeout us] [-P stream period us] [-t turnaround us]\n"
+                    "       [-a adapter latency us] [-l loss rate] [-o csv|json] [-L label]\n"
+                    "  -p  Serial port of terminal node, nodes are simulated in process without it\n"
+                    "  -n, -b, -s, -f  Comma separated values to sweep (e.g. -n 1,5,10 -s poll,broadcast)\n"
+                    "      Strategies: poll, stamped, latched, broadcast, stream (default: all)\n"
+                    "      Formats: float, compact (default: both)\n"
+                    "  -t, -a, -l  Bus of the simulator\n"
+                    "  -L  Label of every result (e.g. firmware and host versions)\n", command);
+}
+
+static bool parseList(const char *text, std::vector<uint32_t> *values)
+{
+    values->clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char *end;
+        const unsigned long value = strtoul(item.c_str(), &end, 10);
+        if (item.empty() || *end) {
+            return false;
+        }
+        values->push_back(value);
+    }
+    return ! values->empty();
+}
+
+static bool parseNames(const char *text, const char * const *names, size_t numNames, std::vector<uint32_t> *values)
+{
+    values->clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        size_t index = 0;
+        while (index < numNames && item != names[index]) {
+            ++index;
+        }
+        if (index == numNames) {
+            return false;
+        }
+        values->push_back(index);
+    }
+    return ! values->empty();
+}
+
+/* Nearest rank, latencies are sorted */
+static uint32_t percentile(const std::vector<uint32_t> &latencies, double rank)
+{
+    const size_t index = (size_t)(rank * latencies.size() + 0.999999);
+    return latencies[index ? index - 1 : 0];
+}
+
+static std::string escape(const std::string &text)
+{
+    std::string escaped;
+    for (char character : text) {
+        if (character == '"' || character == '\\') {
+            escaped += '\\';
+        }
+        escaped += character;
+    }
+    return escaped;
+}
+
+static void report(bool isJSON, bool isFirst, const std::string &label, const std::string &target,
+                   const BenchmarkCase &benchmarkCase, const BenchmarkResult &result)
+{
+    const bool isCompact = benchmarkCase.format == Format_Compact
+                        || benchmarkCase.strategy == Strategy_Stamped || benchmarkCase.strategy == Strategy_Latched;
+    const double byteSeconds = 10.0 / benchmarkCase.baud;
+    const double utilization = (result.hostBytes + result.nodeBytes) * byteSeconds / result.seconds;
+    const double retryRate = result.attempts ? (double)result.timeouts / result.attempts : 0;
+    const bool hasLatency = ! result.latencyUS.empty();
+    const char *latencyFrom = hasLatency ? (result.isLatencyFromSample ? "sample" : "request") : "";
+    char latencies[4][16] = {"", "", "", ""};
+    if (hasLatency) {
+        snprintf(latencies[0], sizeof(latencies[0]), "%u", percentile(result.latencyUS, 0.5));
+        snprintf(latencies[1], sizeof(latencies[1]), "%u", percentile(result.latencyUS, 0.9));
+        snprintf(latencies[2], sizeof(latencies[2]), "%u", percentile(result.latencyUS, 0.99));
+        snprintf(latencies[3], sizeof(latencies[3]), "%u", result.latencyUS.back());
+    }
+
+    if (! isJSON) {
+        if (isFirst) {
+            printf("label,target,strategy,format,nodes,baud,seconds,frames_per_s,rotations_per_s,latency_from,"
+                   "latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us,bus_utilization,retry_rate,attempts,timeouts\n");
+        }
+        printf("\"%s\",\"%s\",%s,%s,%u,%u,%.3f,%.2f,%.2f,%s,%s,%s,%s,%s,%.4f,%.4f,%llu,%llu\n",
+               escape(label).c_str(), escape(target).c_str(), strategyNames[benchmarkCase.strategy],
+               formatNames[isCompact], benchmarkCase.numNodes, benchmarkCase.baud, result.seconds,
+               result.frames / result.seconds, result.rotations / result.seconds, latencyFrom,
+               latencies[0], latencies[1], latencies[2], latencies[3], utilization, retryRate,
+               (unsigned long long)result.attempts, (unsigned long long)result.timeouts);
+    } else {
+        for (char *latency : latencies) {
+            if (! *latency) {
+                strcpy(latency, "null");
+            }
+        }
+        printf("%s\n  {\"label\": \"%s\", \"target\": \"%s\", \"strategy\": \"%s\", \"format\": \"%s\", "
+               "\"nodes\": %u, \"baud\": %u, \"seconds\": %.3f, \"frames_per_s\": %.2f, \"rotations_per_s\": %.2f, "
+               "\"latency_from\": %s%s%s, \"latency_p50_us\": %s, \"latency_p90_us\": %s, \"latency_p99_us\": %s, "
+               "\"latency_max_us\": %s, \"bus_utilization\": %.4f, \"retry_rate\": %.4f, \"attempts\": %llu, \"timeouts\": %llu}",
+               isFirst ? "[" : ",", escape(label).c_str(), escape(target).c_str(), strategyNames[benchmarkCase.strategy],
+               formatNames[isCompact], benchmarkCase.numNodes, benchmarkCase.baud, result.seconds,
+               result.frames / result.seconds, result.rotations / result.seconds,
+               hasLatency ? "\"" : "", hasLatency ? latencyFrom : "null", hasLatency ? "\"" : "",
+               latencies[0], latencies[1], latencies[2], latencies[3], utilization, retryRate,
+               (unsigned long long)result.attempts, (unsigned long long)result.timeouts);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char * const argv[])
+{
+    const char *port = nullptr;
+    uint32_t firstID = 1;
+    std::vector<uint32_t> nodeCounts = {1, 5, 10, 20};
+    std::vector<uint32_t> bauds = {460800};
+    std::vector<uint32_t> strategies = {Strategy_Poll, Strategy_Stamped, Strategy_Latched, Strategy_Broadcast, Strategy_Stream};
+    std::vector<uint32_t> formats = {Format_Float, Format_Compact};
+    double seconds = 2;
+    uint32_t timeoutUS = 100000; /* ReadTimeout of TrackerManager */
+    uint32_t streamPeriodUS = 0; /* As short as slots allow */
+    SimulatorConfig simulatorConfig;
+    bool isJSON = false;
+    std::string label;
+    int option;
+    bool isValid = true;
+    while ((option = getopt(argc, argv, "p:i:n:b:s:f:d:T:P:t:a:l:o:L:")) != -1) {
+        switch (option) {
+            case 'p': port = optarg; break;
+            case 'i': firstID = atoi(optarg); break;
+            case 'n': isValid = parseList(optarg, &nodeCounts); break;
+            case 'b': isValid = parseList(optarg, &bauds); break;
+            case 's': isValid = parseNames(optarg, strategyNames, 5, &strategies); break;
+            case 'f': isValid = parseNames(optarg, formatNames, 2, &formats); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'T': timeoutUS = atoi(optarg); break;
+            case 'P': streamPeriodUS = atoi(optarg); break;
+            case 't': simulatorConfig.turnaroundUS = atoi(optarg); break;
+            case 'a': simulatorConfig.adapterLatencyUS = atoi(optarg); break;
+            case 'l': simulatorConfig.lossRate = atof(optarg); break;
+            case 'o': isJSON = strcmp(optarg, "json") == 0; isValid = isJSON || strcmp(optarg, "csv") == 0; break;
+            case 'L': label = optarg; break;
+            default: isValid = false; break;
+        }
+        if (! isValid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (uint32_t numNodes : nodeCounts) {
+        if (numNodes < 1 || firstID < 1 || firstID + numNodes > 64) {
+            fprintf(stderr, "IDs of nodes must be in 1 - 63\n");
+            return 1;
+        }
+    }
+    if (seconds <= 0 || streamPeriodUS > 0xFFFF) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int failures = 0;
+    bool isFirst = true;
+    for (uint32_t numNodes : nodeCounts) {
+        for (uint32_t baud : bauds) {
+            for (uint32_t strategy : strategies) {
+                for (uint32_t format : formats) {
+                    const BenchmarkCase benchmarkCase = {(strategy_t)strategy, (format_t)format, numNodes, baud};
+                    /* Formats make no difference to them */
+                    if ((strategy == Strategy_Stamped || strategy == Strategy_Latched) && format != formats.front()) {
+                        continue;
+                    }
+
+                    std::unique_ptr<Simulator> simulator;
+                    std::atomic<bool> isRunning(true);
+                    std::thread thread;
+                    std::string target = port ? port : "simulator";
+                    if (port == nullptr) {
+                        SimulatorConfig config = simulatorConfig;
+                        config.numNodes = numNodes;
+                        config.firstID = firstID;
+                        config.baud = baud;
+                        simulator.reset(new Simulator(config));
+                        if (! simulator->open()) {
+                            fprintf(stderr, "Could not open pseudo terminal: %s\n", strerror(errno));
+                            return 1;
+                        }
+                        thread = std::thread([&]() {
+                            simulator->run(isRunning);
+                        });
+                    }
+
+                    Benchmark benchmark(firstID, timeoutUS, streamPeriodUS);
+                    BenchmarkResult result;
+                    if (! benchmark.open(port ? port : simulator->path().c_str(), baud)) {
+                        fprintf(stderr, "Could not open %s: %s\n", target.c_str(), strerror(errno));
+                        ++failures;
+                    } else if (! benchmark.run(benchmarkCase, seconds, &result)) {
+                        fprintf(stderr, "%s %s %u nodes at %u: %s\n", strategyNames[strategy], formatNames[format],
+                                numNodes, baud, benchmark.error().c_str());
+                        ++failures;
+                    } else {
+                        report(isJSON, isFirst, label, target, benchmarkCase, result);
+                        isFirst = false;
+                    }
+
+                    if (simulator) {
+                        isRunning = false;
+                        thread.join();
+                    }
+                }
+            }
+        }
+    }
+    if (isJSON) {
+        printf(isFirst ? "[]\n" : "\n]\n");
+    }
+    return failures ? 1 : 0;
+}
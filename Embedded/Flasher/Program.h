@@ -0,0 +1,17 @@
+#import <Foundation/Foundation.h>
+#import "Serial.h"
+
+/* Send pages to the node which replied to Command_Program, see Protocol.h */
+/* Returns NO after printing the reason if the node stopped responding */
+BOOL programPages(Serial *serial, NSData *programData, uint8_t numOfPages);
+
+/* Send pages to all nodes of ids at once, and then resend pages each node missed */
+BOOL programPagesToAll(Serial *serial, NSData *programData, uint8_t numOfPages, NSArray<NSNumber *> *ids);
+
+/* Returns pages of the node different from programData, or nil if the node did not respond */
+/* Page of retained settings is never reported as they are preserved by bootloader */
+NSIndexSet *readChangedPages(Serial *serial, NSData *programData, uint8_t numOfPages, uint8_t deviceID);
+
+/* Send only changedPages to all nodes of ids at once, and then resend pages each node missed */
+BOOL patchPagesToAll(Serial *serial, NSData *programData, uint8_t numOfPages, NSArray<NSNumber *> *ids,
+                     NSIndexSet *changedPages);
@@ -0,0 +1,237 @@
+#import "Program.h"
+#import "Protocol.h"
+#import <unistd.h>
+
+/* Node may take a while to erase and write a block */
+#define STATUS_RETRY_COUNT 50
+#define RESEND_ROUND_COUNT 10
+
+static uint16_t crc16(const uint8_t *data, NSUInteger length)
+{
+    /* CRC-16/CCITT-FALSE */
+    uint16_t crc = 0xFFFF;
+    for (NSUInteger byte = 0; byte < length; ++byte) {
+        crc ^= data[byte] << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static NSMutableData *pageData(NSData *programData, NSUInteger page)
+{
+    NSRange range = NSMakeRange(64 * page, 64);
+    if (NSMaxRange(range) > [programData length]) {
+        range.length = [programData length] - range.location;
+    }
+    NSMutableData *data = [[programData subdataWithRange:range] mutableCopy];
+    [data setLength:64];
+    return data;
+}
+
+/* Page with the settings which nodes keep across updates, or NSNotFound */
+static NSUInteger retainedPage(NSData *programData)
+{
+    /* Image starts with the address of the vector table, see __vectors_start__ */
+    const uint8_t *bytes = [programData bytes];
+    if ([programData length] < 4) {
+        return NSNotFound;
+    }
+    const uint32_t vectors = OSReadLittleInt32(bytes, 0);
+    const NSUInteger vector = vectors - PROGRAM_FLASH_ORIGIN + 4 * PROGRAM_RETAINED_VECTOR;
+    if (vectors < PROGRAM_FLASH_ORIGIN || vector + 4 > [programData length]) {
+        return NSNotFound;
+    }
+    const uint32_t retainedData = OSReadLittleInt32(bytes, vector);
+    if (retainedData < PROGRAM_FLASH_ORIGIN) {
+        return NSNotFound;
+    }
+    return (retainedData - PROGRAM_FLASH_ORIGIN) / 64;
+}
+
+static NSData *encodeUnit(NSData *programData, NSUInteger page)
+{
+    NSMutableData *unit = pageData(programData, page);
+    const uint16_t crc = crc16([unit bytes], 64);
+    const uint8_t rawCRC[] = {crc & 0xFF, crc >> 8};
+    [unit appendBytes:rawCRC length:sizeof(rawCRC)];
+    return [Serial encodeData:unit];
+}
+
+static int readStatus(Serial *serial)
+{
+    for (int retry = 0; retry < STATUS_RETRY_COUNT; ++retry) {
+        NSData *rxData = [serial readRawDataOfLength:1];
+        if ([rxData length] == 1) {
+            return ((const uint8_t *)[rxData bytes])[0];
+        }
+    }
+    return -1;
+}
+
+BOOL programPages(Serial *serial, NSData *programData, uint8_t numOfPages)
+{
+    NSMutableArray<NSData *> *units = [NSMutableArray arrayWithCapacity:numOfPages];
+    for (NSUInteger page = 0; page < numOfPages; ++page) {
+        [units addObject:encodeUnit(programData, page)];
+    }
+    
+    for (int blockStart = 0; blockStart < numOfPages; blockStart += PROGRAM_BLOCK_PAGES) {
+        const int pagesInBlock = MIN(PROGRAM_BLOCK_PAGES, numOfPages - blockStart);
+        int receivedPages = 0;
+        while (1) {
+            NSMutableData *txData = [NSMutableData data];
+            for (int page = receivedPages; page < pagesInBlock; ++page) {
+                [txData appendData:units[blockStart + page]];
+            }
+            [serial sendRawData:txData];
+            const int status = readStatus(serial);
+            if (status < 0) {
+                fprintf(stderr, "Device did not respond to block from page %d\n", blockStart);
+                return NO;
+            }
+            if (status == pagesInBlock) {
+                break;
+            }
+            if (status < receivedPages || status > pagesInBlock) {
+                fprintf(stderr, "Device sent invalid status %d on block from page %d\n", status, blockStart);
+                return NO;
+            }
+            receivedPages = status;
+        }
+    }
+    return YES;
+}
+
+static void sendBootloaderCommand(Serial *serial, uint8_t command, uint8_t parameter)
+{
+    /* Parameter is never 0xFF, so COBS code is always 3 */
+    const uint8_t rawPacket[] = {PACKET_HEADER, BROADCAST_ID, 3, command, parameter};
+    [serial sendRawData:[NSData dataWithBytes:rawPacket length:sizeof(rawPacket)]];
+}
+
+static NSIndexSet *readMissingPages(Serial *serial, uint8_t deviceID, uint8_t numOfPages)
+{
+    sendBootloaderCommand(serial, Command_Read_Program_Status, deviceID);
+    NSData *rxData = [serial readDataOfLengthWithTimeout:3 + PROGRAM_STATUS_LENGTH];
+    if (rxData == nil || ((const uint8_t *)[rxData bytes])[2] != Command_Reply_Program_Status) {
+        return nil;
+    }
+    const uint8_t *missingPages = (const uint8_t *)[rxData bytes] + 3;
+    NSMutableIndexSet *ret = [NSMutableIndexSet indexSet];
+    for (NSUInteger page = 0; page < numOfPages; ++page) {
+        if (missingPages[page / 7] & (1 << (page % 7))) {
+            [ret addIndex:page];
+        }
+    }
+    return ret;
+}
+
+static NSArray<NSData *> *startSession(Serial *serial, uint8_t command, NSData *programData, uint8_t numOfPages,
+                                       NSArray<NSNumber *> *ids)
+{
+    uint8_t rawStartPacket[] = {PACKET_HEADER, BROADCAST_ID, command, 0, 0, 0, 0, 0, 0, 0, 0, numOfPages};
+    for (NSNumber *anID in ids) {
+        rawStartPacket[3 + [anID unsignedCharValue] / 8] |= 1 << ([anID unsignedCharValue] % 8);
+    }
+    [serial sendData:[NSData dataWithBytes:rawStartPacket length:sizeof(rawStartPacket)]];
+    usleep(1000);
+    
+    NSMutableArray<NSData *> *units = [NSMutableArray arrayWithCapacity:numOfPages];
+    for (NSUInteger page = 0; page < numOfPages; ++page) {
+        [units addObject:encodeUnit(programData, page)];
+    }
+    return units;
+}
+
+static BOOL finishSession(Serial *serial, NSArray<NSData *> *units, uint8_t numOfPages, NSArray<NSNumber *> *ids)
+{
+    for (NSNumber *anID in ids) {
+        for (int round = 0; ; ++round) {
+            NSIndexSet *missingPages = readMissingPages(serial, [anID unsignedCharValue], numOfPages);
+            if (missingPages == nil) {
+                fprintf(stderr, "Device %d did not send status\n", [anID intValue]);
+                return NO;
+            }
+            if ([missingPages count] == 0) {
+                break;
+            }
+            if (round == RESEND_ROUND_COUNT) {
+                fprintf(stderr, "Device %d keeps missing %lu pages\n", [anID intValue], (unsigned long)[missingPages count]);
+                return NO;
+            }
+            /* Other nodes missing the same page also take it */
+            [missingPages enumerateIndexesUsingBlock:^(NSUInteger page, BOOL *stop) {
+                (void)stop;
+                sendBootloaderCommand(serial, Command_Resend_Page, page);
+                [serial sendRawData:units[page]];
+                usleep(PROGRAM_PAGE_WAIT_US);
+            }];
+        }
+    }
+    
+    sendBootloaderCommand(serial, Command_Finish_Program, 0);
+    return YES;
+}
+
+BOOL programPagesToAll(Serial *serial, NSData *programData, uint8_t numOfPages, NSArray<NSNumber *> *ids)
+{
+    NSArray<NSData *> *units = startSession(serial, Command_Program_All, programData, numOfPages, ids);
+    
+    for (int blockStart = 0; blockStart < numOfPages; blockStart += PROGRAM_BLOCK_PAGES) {
+        sendBootloaderCommand(serial, Command_Program_Block, blockStart / PROGRAM_BLOCK_PAGES);
+        NSMutableData *txData = [NSMutableData data];
+        for (int page = blockStart; page < MIN(blockStart + PROGRAM_BLOCK_PAGES, numOfPages); ++page) {
+            [txData appendData:units[page]];
+        }
+        [serial sendRawData:txData];
+        usleep(PROGRAM_BLOCK_WAIT_US);
+    }
+    
+    return finishSession(serial, units, numOfPages, ids);
+}
+
+NSIndexSet *readChangedPages(Serial *serial, NSData *programData, uint8_t numOfPages, uint8_t deviceID)
+{
+    /* Settings of the node always differ from the defaults, and bootloader writes them back anyway */
+    const NSUInteger skippedPage = retainedPage(programData);
+    NSMutableIndexSet *ret = [NSMutableIndexSet indexSet];
+    for (int firstPage = 0; firstPage < numOfPages; firstPage += PAGE_CRCS_PER_REPLY) {
+        const uint8_t rawReadPacket[] = {PACKET_HEADER, deviceID, Command_Read_Page_CRCs, firstPage};
+        [serial sendData:[NSData dataWithBytes:rawReadPacket length:sizeof(rawReadPacket)]];
+        NSData *rxData = [serial readDataOfLengthWithTimeout:4 + 2 * PAGE_CRCS_PER_REPLY];
+        if (rxData == nil || ((const uint8_t *)[rxData bytes])[2] != Command_Reply_Page_CRCs
+            || ((const uint8_t *)[rxData bytes])[3] != firstPage) {
+            return nil;
+        }
+        const uint8_t *rawCRCs = (const uint8_t *)[rxData bytes] + 4;
+        for (int page = firstPage; page < MIN(firstPage + PAGE_CRCS_PER_REPLY, numOfPages); ++page) {
+            if (page == skippedPage) {
+                continue;
+            }
+            const uint16_t crc = crc16([pageData(programData, page) bytes], 64);
+            const int index = page - firstPage;
+            if (rawCRCs[2 * index] != (crc & 0xFF) || rawCRCs[2 * index + 1] != (crc >> 8)) {
+                [ret addIndex:page];
+            }
+        }
+    }
+    return ret;
+}
+
+BOOL patchPagesToAll(Serial *serial, NSData *programData, uint8_t numOfPages, NSArray<NSNumber *> *ids,
+                     NSIndexSet *changedPages)
+{
+    NSArray<NSData *> *units = startSession(serial, Command_Patch_All, programData, numOfPages, ids);
+    
+    /* Each page is erased alone, which takes as long as a whole block */
+    [changedPages enumerateIndexesUsingBlock:^(NSUInteger page, BOOL *stop) {
+        (void)stop;
+        sendBootloaderCommand(serial, Command_Resend_Page, page);
+        [serial sendRawData:units[page]];
+        usleep(PROGRAM_PAGE_WAIT_US);
+    }];
+    
+    return finishSession(serial, units, numOfPages, ids);
+}
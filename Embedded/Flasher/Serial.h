@@ -6,6 +6,7 @@ extern NSString * const SerialException;
 @interface Serial : NSObject
 
 + (NSArray *)availableDevices;
++ (NSData *)encodeData:(NSData *)data;
 - (id)initWithBSDPath:(NSString *)path;
 - (void)openWithBaud:(speed_t)baud;
 - (void)sendRawData:(NSData *)data;
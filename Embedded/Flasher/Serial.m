@@ -24,6 +24,8 @@ NSString * const SerialException = @"SerialException";
 {
     NSFileHandle *handle;
     struct termios gOriginalTTYAttrs;
+    NSMutableData *received; /* Read from the port at once, and consumed from receivedOffset */
+    NSUInteger receivedOffset;
 }
 
 + (NSArray *)availableDevices
@@ -53,10 +55,39 @@ NSString * const SerialException = @"SerialException";
     return ports;
 }
 
++ (NSData *)encodeData:(NSData *)data
+{
+    /* COBS eliminating PACKET_HEADER, see Protocol.h */
+    const uint8_t *bytes = [data bytes];
+    NSMutableData *ret = [NSMutableData dataWithLength:1];
+    NSUInteger codeIndex = 0;
+    uint8_t code = 1;
+    for (NSUInteger index = 0; index < [data length]; ++index) {
+        if (bytes[index] == PACKET_HEADER) {
+            ((uint8_t *)[ret mutableBytes])[codeIndex] = code;
+            codeIndex = [ret length];
+            [ret increaseLengthBy:1];
+            code = 1;
+            continue;
+        }
+        [ret appendBytes:&bytes[index] length:1];
+        if (++code == 0xFE) {
+            ((uint8_t *)[ret mutableBytes])[codeIndex] = code;
+            codeIndex = [ret length];
+            [ret increaseLengthBy:1];
+            code = 1;
+        }
+    }
+    ((uint8_t *)[ret mutableBytes])[codeIndex] = code;
+    return ret;
+}
+
 - (id)initWithBSDPath:(NSString *)path
 {
     if (self = [super init]) {
         _path = path;
+        received = [NSMutableData new];
+        receivedOffset = 0;
     }
     return self;
 }
@@ -210,124 +241,111 @@ NSString * const SerialException = @"SerialException";
 
 - (void)sendData:(NSData *)data
 {
-    NSRange searchRange = NSMakeRange(1, [data length] - 1);
-    NSMutableData *paddedData = [data mutableCopy];
-    const uint8_t header = PACKET_HEADER;
-    NSData *headerData = [NSData dataWithBytes:&header length:1];
-    const uint8_t paddedHeader[] = {0xFF, 0x00};
-    while (1) {
-        NSRange ffRange = [paddedData rangeOfData:headerData options:0 range:searchRange];
-        if (ffRange.location == NSNotFound) {
-            break;
-        }
-        [paddedData replaceBytesInRange:ffRange withBytes:paddedHeader length:2];
-        searchRange.location = ffRange.location + 2;
-        searchRange.length = [paddedData length] - searchRange.location;
-    }
-    [handle writeData:paddedData];
+    NSMutableData *encodedData = [[data subdataWithRange:NSMakeRange(0, 2)] mutableCopy];
+    [encodedData appendData:[Serial encodeData:[data subdataWithRange:NSMakeRange(2, [data length] - 2)]]];
+    [handle writeData:encodedData];
 }
 
-- (NSData *)readDataOfLength:(NSUInteger)length
+/* Appends all bytes available, returns NO if nothing came within VTIME */
+- (BOOL)receive
 {
-    while (1) {
-        NSData *header = [handle readDataOfLength:1];
-        if ([header length] == 1 && ((const uint8_t *)[header bytes])[0] == PACKET_HEADER) {
-            break;
-        }
+    if (receivedOffset == [received length]) {
+        [received setLength:0];
+        receivedOffset = 0;
     }
-    while (1) {
-        NSData *masterID = [handle readDataOfLength:1];
-        if ([masterID length] == 1 && ((const uint8_t *)[masterID bytes])[0] == 0) {
-            break;
-        }
+    NSData *data = [handle availableData];
+    if ([data length] < 1) {
+        return NO;
     }
+    [received appendData:data];
+    return YES;
+}
+
+- (NSData *)readDataOfLength:(NSUInteger)length withTimeout:(BOOL)withTimeout
+{
     const uint8_t packetHead[] = {PACKET_HEADER, 0};
-    NSMutableData *ret = [NSMutableData dataWithBytes:packetHead length:sizeof(packetHead)];
-    NSUInteger dataLengthToRead = length - 2;
-    NSData *paddedFFData = [NSData dataWithBytes:packetHead length:2];
+    NSMutableData *ret = nil; /* Not nil while receiving a packet from the master */
+    BOOL isWaitingForID = NO;
+    NSUInteger bytesInChunk = 0;
+    BOOL chunkEndsWithHeader = NO;
     while (1) {
-        NSMutableData *data = [[handle readDataOfLength:dataLengthToRead] mutableCopy];
-        NSRange searchRange = NSMakeRange(0, [data length]);
-        while (1) {
-            NSRange paddedDataRange = [data rangeOfData:paddedFFData options:0 range:searchRange];
-            if (paddedDataRange.location == NSNotFound) {
-                break;
+        if (receivedOffset == [received length] && ! [self receive]) {
+            if (withTimeout) {
+                return nil;
             }
-            paddedDataRange.location += 1;
-            paddedDataRange.length = 1;
-            [data replaceBytesInRange:paddedDataRange withBytes:NULL length:0];
-            searchRange.location = paddedDataRange.location;
-            searchRange.length = [data length] - searchRange.location;
+            continue;
         }
-        [ret appendData:data];
-        dataLengthToRead -= [data length];
-        if (dataLengthToRead == 0) {
-            break;
+        /* A packet may continue to the next receive */
+        const uint8_t *bytes = [received bytes];
+        const NSUInteger end = [received length];
+        while (receivedOffset < end) {
+            const uint8_t byte = bytes[receivedOffset];
+            if (byte == PACKET_HEADER) {
+                /* Another packet started before this one completes, so start over from it */
+                ++receivedOffset;
+                isWaitingForID = YES;
+                ret = nil;
+                continue;
+            }
+            if (isWaitingForID) {
+                ++receivedOffset;
+                isWaitingForID = NO;
+                if (byte == 0) {
+                    ret = [NSMutableData dataWithBytes:packetHead length:sizeof(packetHead)];
+                    bytesInChunk = 0;
+                    chunkEndsWithHeader = NO;
+                }
+                continue;
+            }
+            if (ret == nil) {
+                ++receivedOffset;
+                continue;
+            }
+            if (bytesInChunk == 0) {
+                ++receivedOffset;
+                if (chunkEndsWithHeader) {
+                    [ret appendBytes:packetHead length:1];
+                }
+                bytesInChunk = byte - 1;
+                chunkEndsWithHeader = byte != 0xFE;
+            } else {
+                /* Data bytes of the chunk are appended at once */
+                NSUInteger run = MIN(MIN(bytesInChunk, end - receivedOffset), length - [ret length]);
+                const uint8_t *header = memchr(&bytes[receivedOffset], PACKET_HEADER, run);
+                if (header) {
+                    run = header - &bytes[receivedOffset];
+                }
+                [ret appendBytes:&bytes[receivedOffset] length:run];
+                receivedOffset += run;
+                bytesInChunk -= run;
+            }
+            if ([ret length] >= length) {
+                return ret;
+            }
         }
     }
-    return ret;
+}
+
+- (NSData *)readDataOfLength:(NSUInteger)length
+{
+    return [self readDataOfLength:length withTimeout:NO];
 }
 
 - (NSData *)readDataOfLengthWithTimeout:(NSUInteger)length
 {
-//    const uint8_t paddedHeaderRaw[] = {PACKET_HEADER, 0};
-//    NSData *paddedData = [NSData dataWithBytes:paddedHeaderRaw length:2];
-//    NSMutableData *rxData = [[handle availableData] mutableCopy];
-//    while (1) {
-//        NSRange ffRange = [rxData rangeOfData:paddedData options:0 range:NSMakeRange(2, [rxData length] - 2)];
-//        if (ffRange.location == NSNotFound) {
-//            break;
-//        }
-//        [rxData replaceBytesInRange:ffRange withBytes:paddedHeaderRaw length:1];
-//    }
-//    return rxData;
-    
-    while (1) {
-        NSData *header = [handle readDataOfLength:1];
-        if ([header length] < 1) {
-            return nil;
-        }
-        if (((const uint8_t *)[header bytes])[0] == PACKET_HEADER) {
-            break;
-        }
-    }
-    NSData *masterID = [handle readDataOfLength:1];
-    if ([masterID length] < 1 || ((const uint8_t *)[masterID bytes])[0] != 0) {
-        return nil;
-    }
-    const uint8_t packetHead[] = {PACKET_HEADER, 0};
-    NSMutableData *ret = [NSMutableData dataWithBytes:packetHead length:sizeof(packetHead)];
-    NSUInteger dataLengthToRead = length - 2;
-    NSData *paddedFFData = [NSData dataWithBytes:packetHead length:2];
-    while (1) {
-        NSMutableData *data = [[handle readDataOfLength:dataLengthToRead] mutableCopy];
-        if ([data length] < dataLengthToRead) {
-            return nil;
-        }
-        NSRange searchRange = NSMakeRange(0, [data length]);
-        while (1) {
-            NSRange paddedDataRange = [data rangeOfData:paddedFFData options:0 range:searchRange];
-            if (paddedDataRange.location == NSNotFound) {
-                break;
-            }
-            paddedDataRange.location += 1;
-            paddedDataRange.length = 1;
-            [data replaceBytesInRange:paddedDataRange withBytes:NULL length:0];
-            searchRange.location = paddedDataRange.location;
-            searchRange.length = [data length] - searchRange.location;
-        }
-        [ret appendData:data];
-        dataLengthToRead -= [data length];
-        if (dataLengthToRead == 0) {
-            break;
-        }
-    }
-    return ret;
+    return [self readDataOfLength:length withTimeout:YES];
 }
 
 - (NSData *)readRawDataOfLength:(NSUInteger)length
 {
-    return [handle readDataOfLength:length];
+    /* Bytes received while reading packets come first */
+    const NSUInteger buffered = MIN(length, [received length] - receivedOffset);
+    NSMutableData *ret = [[received subdataWithRange:NSMakeRange(receivedOffset, buffered)] mutableCopy];
+    receivedOffset += buffered;
+    if (buffered < length) {
+        [ret appendData:[handle readDataOfLength:length - buffered]];
+    }
+    return ret;
 }
 
 - (void)close
@@ -337,6 +355,8 @@ NSString * const SerialException = @"SerialException";
             [[NSNotificationCenter defaultCenter] removeObserver:self];
             [handle closeFile];
             handle = nil;
+            [received setLength:0];
+            receivedOffset = 0;
         }
     }
 }
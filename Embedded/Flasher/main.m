@@ -1,30 +1,23 @@
 #import <Foundation/Foundation.h>
 #import "Serial.h"
+#import "Program.h"
 #import "Protocol.h"
+#import <unistd.h>
 
-NSData *maskData(NSData *data)
-{
-    const uint8_t header = PACKET_HEADER;
-    const uint8_t paddedHeader[] = {PACKET_HEADER, 0x00};
-    NSData *headerData = [NSData dataWithBytes:&header length:1];
-    NSMutableData *ret = [data mutableCopy];
-    NSRange searchRange = NSMakeRange(0, [data length]);
-    while (1) {
-        NSRange headerRange = [ret rangeOfData:headerData options:0 range:searchRange];
-        if (headerRange.location == NSNotFound) {
-            break;
-        }
-        [ret replaceBytesInRange:headerRange withBytes:paddedHeader length:2];
-        searchRange.location = headerRange.location + 2;
-        searchRange.length = [ret length] - searchRange.location;
-    }
-    return ret;
-}
+/* Bootloader waits 2s before launching the application */
+#define REBOOT_WAIT_US 2500000
 
 int main(int argc, const char * argv[])
 {
+    const char *command = argv[0];
+    /* -d sends only pages changed from the firmware running on the devices */
+    const BOOL isPatch = argc > 1 && strcmp(argv[1], "-d") == 0;
+    if (isPatch) {
+        ++argv;
+        --argc;
+    }
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <bin> <id>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-d] <bin> <id> [<id> ...]\n", command);
         return 1;
     }
     
@@ -43,18 +36,63 @@ int main(int argc, const char * argv[])
     }
     
     const uint8_t numOfPages = ([programData length] - 1) / 64 + 1;
-    if (numOfPages > 240) {
+    if (numOfPages > PROGRAM_MAX_PAGES) {
         fprintf(stderr, "Binary is not fit in flash\n");
         return 1;
     }
 
+    if (argc > 3 || isPatch) {
+        /* Program all the devices at once */
+        NSMutableArray<NSNumber *> *ids = [NSMutableArray array];
+        for (int arg = 2; arg < argc; ++arg) {
+            const int anID = atoi(argv[arg]);
+            if (anID < 1 || anID > 63) {
+                fprintf(stderr, "ID must be in 1 - 63 to program at once\n");
+                return 1;
+            }
+            [ids addObject:@(anID)];
+        }
+        if (! isPatch) {
+            return programPagesToAll(serial, programData, numOfPages, ids) ? 0 : 1;
+        }
+        
+        NSMutableIndexSet *changedPages = [NSMutableIndexSet indexSet];
+        for (NSNumber *anID in ids) {
+            NSIndexSet *pages = readChangedPages(serial, programData, numOfPages, [anID unsignedCharValue]);
+            if (pages == nil) {
+                fprintf(stderr, "Device %d did not send page CRCs, program it without -d\n", [anID intValue]);
+                return 1;
+            }
+            [changedPages addIndexes:pages];
+        }
+        if ([changedPages count] == 0) {
+            printf("Devices are up to date\n");
+            return 0;
+        }
+        printf("Sending %lu of %d pages\n", (unsigned long)[changedPages count], numOfPages);
+        if (! patchPagesToAll(serial, programData, numOfPages, ids, changedPages)) {
+            return 1;
+        }
+        
+        /* Packets lost as a whole are not reported as missing, so check the result */
+        usleep(REBOOT_WAIT_US);
+        for (NSNumber *anID in ids) {
+            NSIndexSet *pages = readChangedPages(serial, programData, numOfPages, [anID unsignedCharValue]);
+            if (pages == nil || [pages count] != 0) {
+                fprintf(stderr, "Device %d is not updated, program it again\n", [anID intValue]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    
     uint8_t deviceID = atoi(argv[2]);
     if (deviceID == 0) {
         for (deviceID = 1; deviceID < 254; ++deviceID) {
             const uint8_t rawPingPacket[] = {PACKET_HEADER, deviceID, Command_Ping};
             NSData *pingPacket = [NSData dataWithBytes:rawPingPacket length:sizeof(rawPingPacket)];
-            [serial sendRawData:pingPacket];
-            if ([[serial readRawDataOfLength:4] length] == 4) {
+            [serial sendData:pingPacket];
+            if ([[serial readRawDataOfLength:5] length] == 5) {
                 break;
             }
         }
@@ -66,63 +104,14 @@ int main(int argc, const char * argv[])
     
     const uint8_t rawStartPacket[] = {PACKET_HEADER, deviceID, Command_Program, numOfPages};
     NSData *startPacket = [NSData dataWithBytes:rawStartPacket length:sizeof(rawStartPacket)];
-    [serial sendRawData:startPacket];
+    [serial sendData:startPacket];
     if ([[serial readRawDataOfLength:1] length] < 1) {
         fprintf(stderr, "Device did not respond to initial packet\n");
         return 1;
     }
     
-    const uint8_t rawAck = 1;
-    const uint8_t rawNack = 0;
-    NSData *ackData = [NSData dataWithBytes:&rawAck length:1];
-    NSData *nackData = [NSData dataWithBytes:&rawNack length:1];
-    for (int page = 0; page < (numOfPages - 1); ++page) {
-        NSData *partialData = [programData subdataWithRange:NSMakeRange(64 * page, 64)];
-        NSData *maskedData = maskData(partialData);
-        while (1) {
-            [serial sendRawData:maskedData];
-            NSData *rxData = [serial readRawDataOfLength:[maskedData length]];
-            if ([rxData length] != [maskedData length]) {
-                fprintf(stderr, "Device did not send verify data on page %d\n", page);
-                return 1;
-            }
-            if ([rxData isEqualToData:maskedData]) {
-                [serial sendRawData:ackData];
-                NSData *rxData = [serial readRawDataOfLength:1];
-                if ([rxData length] < 1) {
-                    fprintf(stderr, "Device did not send ack on page %d\n", page);
-                    return 1;
-                }
-                break;
-            }
-            [serial sendRawData:nackData];
-        }
-    }
-    
-    const NSUInteger finalDataLength = [programData length] - 64 * (numOfPages - 1);
-    const NSRange finalDataRange = NSMakeRange(64 * (numOfPages - 1), finalDataLength);
-    NSMutableData *finalData = [[programData subdataWithRange:finalDataRange] mutableCopy];
-    if ([finalData length] < 64) {
-        [finalData increaseLengthBy:64 - [finalData length]];
-    }
-    NSData *finalMaskedData = maskData(finalData);
-    while (1) {
-        [serial sendRawData:finalMaskedData];
-        NSData *rxData = [serial readRawDataOfLength:[finalMaskedData length]];
-        if ([rxData length] != [finalMaskedData length]) {
-            fprintf(stderr, "Device did not send verify data on page %d\n", (numOfPages - 1));
-            return 1;
-        }
-        if ([rxData isEqualToData:finalMaskedData]) {
-            [serial sendRawData:ackData];
-            NSData *rxData = [serial readRawDataOfLength:1];
-            if ([rxData length] == 0) {
-                fprintf(stderr, "Device did not send ack on page %d\n", (numOfPages - 1));
-                return 1;
-            }
-            break;
-        }
-        [serial sendRawData:nackData];
+    if (! programPages(serial, programData, numOfPages)) {
+        return 1;
     }
     
     return 0;
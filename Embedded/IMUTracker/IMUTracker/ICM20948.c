@@ -16,6 +16,7 @@
 
 #include <LPC8xx.h>
 #include "ICM20948.h"
+#include "Protocol.h"
 #include "spi.h"
 #include "rs485.h"
 #include "Q30.h"
@@ -31,20 +32,21 @@ static struct __attribute__((packed)) {
 } __attribute__((aligned(4))) spiRxBuffer;
 
 static volatile int isWaitingSPI;
-static volatile int isWaitingRS485;
+static spi_transaction_t syncTransaction;
+static const uint8_t *registerCommands;
+static void (*registersCallback)(void);
 static quaternion_t quaternion;
 
-typedef struct buffer_t {
-    struct buffer_t *next;
-    uint8_t buf[17];
-} buffer_t;
-
-static buffer_t rs485Buffers[2] = {
-    {.next = &rs485Buffers[1], .buf = {125}},
-    {.next = &rs485Buffers[0], .buf = {125}}
-};
-static buffer_t *currentReadBuffer = &rs485Buffers[0];
-static buffer_t *currentWriteBuffer = &rs485Buffers[0];
+/* Compressed DMP firmware is received in chunks of 16 bytes */
+/* A match expands to 17 bytes, so the ring absorbs bursts while SPI writes them */
+#define DMP_INPUT_CHUNKS 8
+static uint8_t dmpInput[DMP_INPUT_CHUNKS][16];
+static volatile uint32_t dmpReceivedChunks;
+static volatile uint32_t dmpDecodedChunks; /* Chunks whose slot in the ring may be received again */
+static volatile int isDMPInputOverrun;
+static uint32_t dmpInputPosition;
+static uint32_t dmpBitBuffer;
+static uint32_t dmpBitCount;
 
 static const uint8_t initializeCommand[] = {
     /* Length(0 indicates the end), Address, Datas */
@@ -136,7 +138,7 @@ static const uint8_t enableDMPCommand0[] = {
     3, 1, 0x07, 0x00, /* GYRO_CONFIG_{1,2} */
     2, 127, 0x00, /* select BANK 0 */
     
-    /* Sets the gyro_sf used by quaternions on the DMP. (undocumented) */
+    /* Reads PLL error for the gyro_sf used by quaternions on the DMP (see buildRateCommands). (undocumented) */
     2, 127, 0x10, /* select BANK 1 */
     2, (1 << 7) | 40, 0, /* TIMEBASE_CORRECTION_PLL */
     0
@@ -144,12 +146,7 @@ static const uint8_t enableDMPCommand0[] = {
 
 static const uint8_t enableDMPCommand1[] = {
     2, 127, 0x00, /* select BANK 0 */
-    2, 126, 0x01, /* select DMP bank #1 */
-    2, 124, 0x30, /* select DMP register address */
-    0
-};
-
-static const uint8_t enableDMPCommand2[] = {
+    
     /* Sets data output control register 1. (undocumented) */
     2, 126, 0x00, /* select DMP bank #0 */
     2, 124, 0x40, /* select DMP register address */
@@ -166,29 +163,11 @@ static const uint8_t enableDMPCommand2[] = {
     /* Sets motion event control register. (undocumented) */
     2, 124, 0x4E, /* select DMP register address */
     3, 125, 0x03, 0xC0,
-    
-    /* Sets accel quaternion gain according to accel engine rate. (undocumented) */
-    2, 126, 0x01, /* select DMP bank #1 */
-    2, 124, 0x0C, /* select DMP register address */
-    5, 125, 0x00, 0xE8, 0xBA, 0x2E,
-    
-    /* Sets accel cal parameters based on different accel engine rate/accel cal running rate (undocumented) */
-    2, 126, 0x05, /* select DMP bank #5 */
-    2, 124, 0xB0, /* select DMP register address */
-    5, 125, 0x3D, 0x27, 0xD2, 0x7D,
-    2, 124, 0xC0,
-    5, 125, 0x02, 0xD8, 0x2D, 0x83,
-    
-    2, 127, 0x20, /* select BANK 2 */
-    3, 16, 0x00, 0x04, /* ACCEL_SMPLRT_DIV_{1,2} */
-    2, 0, 0x04, /* GYRO_SMPLRT_DIV */
-    2, 127, 0x00, /* select BANK 0 */
-    
-    /* Sets sensor ODR. (undocumented) */
-    2, 126, 0x00, /* select DMP bank #0 */
-    2, 124, 0xA8, /* select DMP register address */
-    3, 125, 0x00, 0x02,
-    
+    0
+};
+
+/* enableDMPCommand1, rate (buildRateCommands) and then enableDMPCommand2 */
+static const uint8_t enableDMPCommand2[] = {
     2, 127, 0x30, /* select BANK 3 */
     2, 0, 0x04, /* I2C_MST_ODR_CONFIG */
     
@@ -214,6 +193,33 @@ static const uint8_t enableDMPCommand2[] = {
     0
 };
 
+static const uint8_t leaveLowPowerCommand[] = {
+    2, 127, 0x00, /* select BANK 0 */
+    2, 6, 0x01, /* PWR_MGMT_1, leave LP mode */
+    0
+};
+
+static const uint8_t enterLowPowerCommand[] = {
+    2, 6, 0x21, /* PWR_MGMT_1, enter LP mode */
+    0
+};
+
+/* Gains are the values InvenSense uses for each accel engine rate (undocumented) */
+static const struct {
+    uint8_t sampleRateDivider; /* Sensors run at 1125 / (1 + sampleRateDivider) Hz */
+    uint8_t outputDivider; /* DMP outputs every (1 + outputDivider) samples */
+    uint8_t accelOnlyGain[4];
+    uint8_t accelAlphaVar[4];
+    uint8_t accelAVar[4];
+} rateConfigs[] = {
+    [Rate_75Hz]  = {4,  2, {0x00, 0xE8, 0xBA, 0x2E}, {0x3D, 0x27, 0xD2, 0x7D}, {0x02, 0xD8, 0x2D, 0x83}},
+    [Rate_56Hz]  = {19, 0, {0x03, 0xA4, 0x92, 0x49}, {0x34, 0x92, 0x49, 0x25}, {0x0B, 0x6D, 0xB6, 0xDB}},
+    [Rate_112Hz] = {9,  0, {0x01, 0xD1, 0x74, 0x5D}, {0x3A, 0x49, 0x24, 0x92}, {0x05, 0xB6, 0xDB, 0x6E}},
+    [Rate_225Hz] = {4,  0, {0x00, 0xE8, 0xBA, 0x2E}, {0x3D, 0x27, 0xD2, 0x7D}, {0x02, 0xD8, 0x2D, 0x83}},
+};
+
+static uint8_t pllError;
+
 static const uint8_t readIntStatusCommand[] = {
     (1 << 7) | 24, 0, 0
 };
@@ -222,43 +228,199 @@ static const uint8_t readFifoCountCommand[] = {
     (1 << 7) | 112, 0, 0
 };
 
-static const uint8_t readFifoDataCommand[17] = {
+/* FIFO is read in a burst after the bytes left from the last burst (a part of the packet) */
+#define FIFO_MAX_PACKET_LENGTH 22 /* header1, header2, quaternion (16 bytes) and compass accuracy */
+#define FIFO_BURST_LENGTH 128
+static uint8_t fifoBuffer[FIFO_MAX_PACKET_LENGTH + FIFO_BURST_LENGTH];
+static uint32_t fifoPendingLength;
+
+/* FIFO is read by a chain of transactions from PININT, while the core sleeps */
+static spi_transaction_t fifoTransaction;
+static uint8_t fifoRegisters[3];
+static uint32_t fifoCount;
+static uint8_t fifoLastPendingByte;
+static volatile int isFifoEnabled;
+static volatile int isFifoInterruptPending;
+static volatile enum {
+    fifo_idle,
+    fifo_reading,
+    fifo_ready, /* Waiting for ICM20948_process_fifo() */
+} fifoState = fifo_idle;
+
+/* DMP firmware is written while the next chunk is decoded */
+static volatile uint32_t dmpWritesDone;
+
+/* Rate is written by a chain of register writes from SPI interrupt, while FIFO reading pauses */
+static uint8_t rateCommands[69];
+static volatile enum {
+    rate_idle,
+    rate_waiting_for_fifo, /* Started when the FIFO transactions in progress end */
+    rate_writing,
+} rateState = rate_idle;
+
+static const uint8_t readFifoDataCommand[1 + FIFO_BURST_LENGTH] = {
     (1 << 7) | 114
 };
 
+static const uint8_t readDMPMemoryCommand[17] = {
+    (1 << 7) | 125
+};
+
 INLINE void ICM20948_rs485_callback()
 {
-    isWaitingRS485 = 0;
-    currentReadBuffer = currentReadBuffer->next;
-    rs485_continous_receive(&currentReadBuffer->buf[1], 16);
+    const uint32_t chunk = dmpReceivedChunks + 1;
+    dmpReceivedChunks = chunk;
+    if (chunk - dmpDecodedChunks >= DMP_INPUT_CHUNKS) {
+        /* Decoder fell behind, and the next chunk overwrites one not decoded yet */
+        isDMPInputOverrun = 1;
+    }
+    rs485_receive(dmpInput[chunk % DMP_INPUT_CHUNKS], 16);
 }
 
-INLINE void spi_transfer_callback()
+/* Sleeps until the interrupt which makes condition true */
+/* WFI wakes on a pending interrupt even while masked, so it cannot slip in between the test and WFI */
+#define SLEEP_UNTIL(condition) \
+    do { \
+        __disable_irq(); \
+        while (! (condition)) { \
+            __WFI(); \
+            __enable_irq(); \
+            __disable_irq(); \
+        } \
+        __enable_irq(); \
+    } while (0)
+
+static void sync_transaction_done(void)
 {
     isWaitingSPI = 0;
 }
 
-STATIC INLINE void do_spi(const void *data, uint32_t length)
+static void __attribute__((noinline)) do_spi(const void *data, uint32_t length)
 {
+    syncTransaction.txBuffer = data;
+    syncTransaction.rxBuffer = &spiRxBuffer.entry;
+    syncTransaction.length = length;
+    syncTransaction.callback = sync_transaction_done;
     isWaitingSPI = 1;
-    spi_transfer(data, &spiRxBuffer.entry, length);
-    while (isWaitingSPI) ;
+    spi_transfer(&syncTransaction);
+    SLEEP_UNTIL(isWaitingSPI == 0);
 }
 
-STATIC INLINE void writeRegisters(const uint8_t *commands)
+static void register_written(void)
 {
-    while (1) {
-        const uint8_t length = *commands;
-        if (length == 0) {
-            break;
-        }
-        ++commands;
-        do_spi(commands, length);
-        commands += length;
+    const uint8_t length = *registerCommands;
+    if (length == 0) {
+        registersCallback();
+        return;
+    }
+    syncTransaction.txBuffer = registerCommands + 1;
+    syncTransaction.rxBuffer = &spiRxBuffer.entry;
+    syncTransaction.length = length;
+    syncTransaction.callback = register_written;
+    registerCommands += 1 + length;
+    spi_transfer(&syncTransaction);
+}
+
+/* Next command is sent from SPI interrupt, which calls callback after the last one */
+static void queueRegisters(const uint8_t *commands, void (*callback)(void))
+{
+    registerCommands = commands;
+    registersCallback = callback;
+    register_written();
+}
+
+static void __attribute__((noinline)) writeRegisters(const uint8_t *commands)
+{
+    isWaitingSPI = 1;
+    queueRegisters(commands, sync_transaction_done);
+    SLEEP_UNTIL(isWaitingSPI == 0);
+}
+
+static void low_power_left(void);
+
+STATIC INLINE void startPendingRate(void)
+{
+    /* Called with interrupts disabled */
+    if (rateState == rate_waiting_for_fifo) {
+        rateState = rate_writing;
+        queueRegisters(leaveLowPowerCommand, low_power_left);
+    }
+}
+
+static void __attribute__((noinline)) fifo_transfer(const void *txBuffer, void *rxBuffer, uint32_t length, void (*callback)(void))
+{
+    fifoTransaction.txBuffer = txBuffer;
+    fifoTransaction.rxBuffer = rxBuffer;
+    fifoTransaction.length = length;
+    fifoTransaction.callback = callback;
+    spi_transfer(&fifoTransaction);
+}
+
+static void fifo_status_read(void);
+
+static void __attribute__((noinline)) fifo_read_done(void)
+{
+    __disable_irq();
+    if (isFifoInterruptPending && isFifoEnabled) {
+        isFifoInterruptPending = 0;
+        fifoState = fifo_reading;
+        fifo_transfer(readIntStatusCommand, fifoRegisters, 3, fifo_status_read);
+    } else {
+        fifoState = fifo_idle;
+        startPendingRate();
+    }
+    __enable_irq();
+}
+
+static void fifo_data_read(void)
+{
+    /* First byte received while sending the address overwrote the last pending byte */
+    fifoBuffer[FIFO_MAX_PACKET_LENGTH - 1] = fifoLastPendingByte;
+    __disable_irq();
+    fifoState = fifo_ready;
+    startPendingRate();
+    __enable_irq();
+    ICM20948_fifo_read_callback();
+}
+
+static void fifo_count_read(void)
+{
+    fifoCount = (fifoRegisters[1] << 8) | fifoRegisters[2];
+    if (fifoCount == 0) {
+        fifo_read_done();
+        return;
+    }
+    if (fifoCount > FIFO_BURST_LENGTH) {
+        /* Rest is read on next interrupts, which come faster than packets */
+        fifoCount = FIFO_BURST_LENGTH;
     }
+    fifoLastPendingByte = fifoBuffer[FIFO_MAX_PACKET_LENGTH - 1];
+    fifo_transfer(readFifoDataCommand, &fifoBuffer[FIFO_MAX_PACKET_LENGTH - 1], fifoCount + 1, fifo_data_read);
 }
 
-STATIC INLINE void writeDMPBank(uint8_t bank)
+static void fifo_status_read(void)
+{
+    if ((fifoRegisters[1] & (1 << 0)) == 0 && (fifoRegisters[2] & (1 << 1)) == 0) {
+        fifo_read_done();
+        return;
+    }
+    fifo_transfer(readFifoCountCommand, fifoRegisters, 3, fifo_count_read);
+}
+
+INLINE void ICM20948_read_fifo(void)
+{
+    if (isFifoEnabled == 0) {
+        return;
+    }
+    if (fifoState != fifo_idle) {
+        isFifoInterruptPending = 1;
+        return;
+    }
+    fifoState = fifo_reading;
+    fifo_transfer(readIntStatusCommand, fifoRegisters, 3, fifo_status_read);
+}
+
+static void __attribute__((noinline)) writeDMPBank(uint8_t bank)
 {
     const uint8_t command[] = {126, bank};
     do_spi(command, 2);
@@ -275,67 +437,244 @@ INLINE void ICM20948_init()
     writeRegisters(initializeCommand);
 }
 
-STATIC INLINE void do_write(uint16_t *address)
+static uint32_t __attribute__((noinline)) readDMPBits(uint32_t count)
 {
-    writeDMPAddress(*address);
-    while (isWaitingRS485) ;
-    isWaitingRS485 = 1;
-    do_spi(currentWriteBuffer->buf, 17);
-    currentWriteBuffer = currentWriteBuffer->next;
-    *address += 16;
+    while (dmpBitCount < count) {
+        if (dmpInputPosition % 16 == 0) {
+            dmpDecodedChunks = dmpInputPosition / 16;
+            /* Bits are garbage after an overrun, and ICM20948_download() stops at the chunk */
+            SLEEP_UNTIL(dmpReceivedChunks > dmpInputPosition / 16 || isDMPInputOverrun);
+        }
+        dmpBitBuffer = (dmpBitBuffer << 8) | dmpInput[(dmpInputPosition / 16) % DMP_INPUT_CHUNKS][dmpInputPosition % 16];
+        ++dmpInputPosition;
+        dmpBitCount += 8;
+    }
+    dmpBitCount -= count;
+    return (dmpBitBuffer >> dmpBitCount) & ((1U << count) - 1);
 }
 
-INLINE void ICM20948_download(void)
+typedef struct {
+    uint8_t address[2];
+    uint8_t data[17];
+    spi_transaction_t addressTransaction;
+    spi_transaction_t dataTransaction;
+} dmp_write_t;
+
+static void dmp_written(void)
 {
-    isWaitingRS485 = 1;
-    rs485_receive(&currentReadBuffer->buf[1], 16);
+    dmpWritesDone = dmpWritesDone + 1;
+}
+
+INLINE int ICM20948_download(void)
+{
+    /* Returns 0 when the stream overran the input ring, then DMP memory is left broken */
+    /* Decoded bytes stay in the window until they are written to DMP memory */
+    uint8_t window[DMP_WINDOW_LENGTH];
+    dmp_write_t writes[2];
+    uint32_t queuedWrites = 0;
+    uint32_t decoded = 0;
+    uint32_t written = 0;
     uint8_t dmpBank = 0;
-    uint16_t dmpAddress = 0x90;
-    while (dmpBank < 0x38) {
-        writeDMPBank(dmpBank);
-        while (dmpAddress < 0x100) {
-            do_write(&dmpAddress);
+    uint8_t dmpAddress = 0x90;
+    
+    dmpWritesDone = 0;
+    dmpReceivedChunks = 0;
+    dmpDecodedChunks = 0;
+    isDMPInputOverrun = 0;
+    dmpInputPosition = 0;
+    dmpBitCount = 0;
+    rs485_receive(dmpInput[0], 16);
+    
+    writeDMPBank(dmpBank);
+    while (written < DMP_FIRMWARE_LENGTH) {
+        uint32_t length = DMP_FIRMWARE_LENGTH - written;
+        if (length > 16) {
+            length = 16;
+        }
+        while (decoded < written + length) {
+            if (readDMPBits(1)) {
+                window[decoded++ % DMP_WINDOW_LENGTH] = readDMPBits(8);
+            } else {
+                const uint32_t distance = readDMPBits(8) + 1;
+                uint32_t count = readDMPBits(4) + 2;
+                do {
+                    window[decoded % DMP_WINDOW_LENGTH] = window[(decoded - distance) % DMP_WINDOW_LENGTH];
+                    ++decoded;
+                } while (--count);
+            }
+        }
+        if (isDMPInputOverrun) {
+            break;
+        }
+        /* Wait for the write two chunks before, which used the same buffer */
+        SLEEP_UNTIL(queuedWrites - dmpWritesDone < 2);
+        dmp_write_t * const write = &writes[queuedWrites % 2];
+        write->address[0] = 124;
+        write->address[1] = dmpAddress;
+        write->data[0] = 125;
+        for (uint32_t byte = 0; byte < length; ++byte) {
+            write->data[byte + 1] = window[(written + byte) % DMP_WINDOW_LENGTH];
+        }
+        write->addressTransaction.txBuffer = write->address;
+        write->addressTransaction.rxBuffer = &spiRxBuffer.entry;
+        write->addressTransaction.length = 2;
+        write->addressTransaction.callback = 0;
+        write->dataTransaction.txBuffer = write->data;
+        write->dataTransaction.rxBuffer = &spiRxBuffer.entry;
+        write->dataTransaction.length = length + 1;
+        write->dataTransaction.callback = dmp_written;
+        spi_transfer(&write->addressTransaction);
+        spi_transfer(&write->dataTransaction);
+        ++queuedWrites;
+        written += length;
+        dmpAddress += length;
+        if (dmpAddress == 0) {
+            writeDMPBank(++dmpBank);
         }
-        dmpBank += 1;
-        dmpAddress = 0;
     }
+    SLEEP_UNTIL(dmpWritesDone == queuedWrites);
+    return isDMPInputOverrun == 0;
+}
+
+INLINE uint32_t ICM20948_dmp_crc(void)
+{
+    /* Read back in the same order as ICM20948_download() */
+    static const uint8_t volatileChunks[] = DMP_VOLATILE_CHUNKS;
+    uint32_t volatileIndex = 0;
+    uint32_t crc = 0xFFFF;
+    uint32_t read = 0;
+    uint8_t dmpBank = 0;
+    uint8_t dmpAddress = 0x90;
     writeDMPBank(dmpBank);
-    while (dmpAddress < 0x60) {
-        do_write(&dmpAddress);
+    while (read < DMP_FIRMWARE_LENGTH) {
+        uint32_t length = DMP_FIRMWARE_LENGTH - read;
+        if (length > 16) {
+            length = 16;
+        }
+        if (volatileIndex < sizeof(volatileChunks) && volatileChunks[volatileIndex] == read / 16) {
+            ++volatileIndex;
+        } else {
+            writeDMPAddress(dmpAddress);
+            do_spi(readDMPMemoryCommand, length + 1);
+            crc = bootloader_crc16(crc, spiRxBuffer.byte, length);
+        }
+        read += length;
+        dmpAddress += length;
+        if (dmpAddress == 0) {
+            writeDMPBank(++dmpBank);
+        }
     }
-    writeDMPAddress(dmpAddress);
-    while (isWaitingRS485) ;
-    do_spi(currentWriteBuffer->buf, 3);
+    return crc;
 }
 
-INLINE void ICM20948_enable_dmp(void)
+/* Builds the commands in rateCommands */
+static void __attribute__((noinline)) buildRateCommands(uint8_t rate)
 {
-    writeRegisters(enableDMPCommand0);
-    
-    const uint8_t pllError = spiRxBuffer.byte[0];
     const uint64_t MagicConstant = 264446880937391;
     const uint64_t MagicConstantScale = 100000;
+    const uint32_t divider = rateConfigs[rate].sampleRateDivider;
     uint64_t resultLL;
-    int32_t gyroSf;
+    uint32_t gyroSf;
     if (pllError & 0x80) {
-        resultLL = (MagicConstant * (int64_t)(1ULL << 3) * (1 + 4) / (1270 - (pllError & 0x7F)) / MagicConstantScale);
+        resultLL = (MagicConstant * (int64_t)(1ULL << 3) * (1 + divider) / (1270 - (pllError & 0x7F)) / MagicConstantScale);
     } else {
-        resultLL = (MagicConstant * (int64_t)(1ULL << 3) * (1 + 4) / (1270 + pllError) / MagicConstantScale);
+        resultLL = (MagicConstant * (int64_t)(1ULL << 3) * (1 + divider) / (1270 + pllError) / MagicConstantScale);
     }
     if (resultLL > 0x7FFFFFFF) {
         gyroSf = 0x7FFFFFFF;
     } else {
-        gyroSf = (int32_t)resultLL;
+        gyroSf = (uint32_t)resultLL;
     }
-    gyroSf = __REV(gyroSf);
     
-    writeRegisters(enableDMPCommand1);
-    uint8_t gyroSfCommand[5];
-    gyroSfCommand[0] = 125;
-    *(uint32_t *)&gyroSfCommand[1] = gyroSf;
-    do_spi(gyroSfCommand, 5);
+    const uint8_t * const accelOnlyGain = rateConfigs[rate].accelOnlyGain;
+    const uint8_t * const accelAlphaVar = rateConfigs[rate].accelAlphaVar;
+    const uint8_t * const accelAVar = rateConfigs[rate].accelAVar;
+    const uint8_t commands[] = {
+        2, 127, 0x00, /* select BANK 0 */
+        
+        /* Sets gyro scale factor according to sample rate and PLL error (undocumented) */
+        2, 126, 0x01, /* select DMP bank #1 */
+        2, 124, 0x30, /* select DMP register address */
+        5, 125, gyroSf >> 24, gyroSf >> 16, gyroSf >> 8, gyroSf,
+        
+        /* Sets accel quaternion gain according to accel engine rate. (undocumented) */
+        2, 124, 0x0C, /* select DMP register address */
+        5, 125, accelOnlyGain[0], accelOnlyGain[1], accelOnlyGain[2], accelOnlyGain[3],
+        
+        /* Sets accel cal parameters based on different accel engine rate/accel cal running rate (undocumented) */
+        2, 126, 0x05, /* select DMP bank #5 */
+        2, 124, 0xB0, /* select DMP register address */
+        5, 125, accelAlphaVar[0], accelAlphaVar[1], accelAlphaVar[2], accelAlphaVar[3],
+        2, 124, 0xC0,
+        5, 125, accelAVar[0], accelAVar[1], accelAVar[2], accelAVar[3],
+        
+        2, 127, 0x20, /* select BANK 2 */
+        3, 16, 0x00, divider, /* ACCEL_SMPLRT_DIV_{1,2} */
+        2, 0, divider, /* GYRO_SMPLRT_DIV */
+        2, 127, 0x00, /* select BANK 0 */
+        
+        /* Sets sensor ODR. (undocumented) */
+        2, 126, 0x00, /* select DMP bank #0 */
+        2, 124, 0xA8, /* select DMP register address */
+        3, 125, 0x00, rateConfigs[rate].outputDivider,
+        0
+    };
+    _Static_assert(sizeof(commands) == sizeof(rateCommands), "rateCommands does not fit the rate commands");
+    for (uint32_t byte = 0; byte < sizeof(commands); ++byte) {
+        rateCommands[byte] = commands[byte];
+    }
+}
+
+INLINE void ICM20948_enable_dmp(uint8_t rate)
+{
+    writeRegisters(enableDMPCommand0);
+    pllError = spiRxBuffer.byte[0];
     
+    writeRegisters(enableDMPCommand1);
+    buildRateCommands(rate);
+    writeRegisters(rateCommands);
     writeRegisters(enableDMPCommand2);
+    isFifoEnabled = 1;
+}
+
+static void low_power_entered(void)
+{
+    /* Interrupts may have been dropped meanwhile */
+    __disable_irq();
+    rateState = rate_idle;
+    isFifoEnabled = 1;
+    ICM20948_read_fifo();
+    __enable_irq();
+    ICM20948_rate_set_callback();
+}
+
+static void rate_written(void)
+{
+    queueRegisters(enterLowPowerCommand, low_power_entered);
+}
+
+static void low_power_left(void)
+{
+    queueRegisters(rateCommands, rate_written);
+}
+
+INLINE int ICM20948_set_rate(uint8_t rate)
+{
+    /* Returns 0 while the last rate is still being written */
+    if (rateState != rate_idle) {
+        return 0;
+    }
+    buildRateCommands(rate);
+    
+    /* FIFO must not be read while other register banks are selected */
+    __disable_irq();
+    isFifoEnabled = 0;
+    rateState = rate_waiting_for_fifo;
+    if (fifoState != fifo_reading) {
+        startPendingRate();
+    }
+    __enable_irq();
+    return 1;
 }
 
 #ifndef INLINE_ALL
@@ -349,44 +688,79 @@ INLINE void ICM20948_enable_dmp(void)
  */
 #endif
 
+STATIC INLINE int32_t readBigEndian(const uint8_t *bytes)
+{
+    return (int32_t)(((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3]);
+}
+
 INLINE void ICM20948_process_fifo(void)
 {
-    do_spi(readIntStatusCommand, 3);
-    if ((spiRxBuffer.halfword[0] & ((1 << 0) | (1 << (1 + 8)))) == 0) {
-        return;
-    }
-    do_spi(readFifoCountCommand, 3);
-    const uint32_t fifoCount = __REV16(spiRxBuffer.halfword[0]);
-    if (fifoCount < 2) {
+    if (fifoState != fifo_ready) {
         return;
     }
-    do_spi(readFifoDataCommand, 3);
-    int isCompassAccuracyAvailable = 0;
-    const uint16_t header1 = spiRxBuffer.halfword[0];
-    if (header1 & (1 << 11)) {
-        /* header2 available */
-        do_spi(readFifoDataCommand, 3);
-        const uint16_t header2 = spiRxBuffer.halfword[0];
-        if (header2 & (1 << 4)) {
-            isCompassAccuracyAvailable = 1;
+    
+    const uint8_t *quaternionData = 0;
+    const uint8_t *compassAccuracyData = 0;
+    uint32_t position = FIFO_MAX_PACKET_LENGTH - fifoPendingLength;
+    const uint32_t end = FIFO_MAX_PACKET_LENGTH + fifoCount;
+    while (end - position >= 2) {
+        const uint8_t *packet = &fifoBuffer[position];
+        const uint16_t header1 = packet[0] | (packet[1] << 8);
+        uint32_t length = 2;
+        int isCompassAccuracyAvailable = 0;
+        if (header1 & (1 << 11)) {
+            /* header2 available */
+            if (end - position < 4) {
+                break;
+            }
+            const uint16_t header2 = packet[2] | (packet[3] << 8);
+            if (header2 & (1 << 4)) {
+                isCompassAccuracyAvailable = 1;
+            }
+            length += 2;
         }
+        const uint32_t quaternionOffset = length;
+        if (header1 & (1 << 2)) {
+            /* quaternion available */
+            length += 16;
+        }
+        const uint32_t compassAccuracyOffset = length;
+        if (isCompassAccuracyAvailable) {
+            length += 2;
+        }
+        if (end - position < length) {
+            break;
+        }
+        /* Only the latest ones are reported */
+        if (header1 & (1 << 2)) {
+            quaternionData = &packet[quaternionOffset];
+        }
+        if (isCompassAccuracyAvailable) {
+            compassAccuracyData = &packet[compassAccuracyOffset];
+        }
+        position += length;
     }
-    if (header1 & (1 << 2)) {
-        /* quaternion available */
-        do_spi(readFifoDataCommand, 17);
-        const int32_t x = __REV(spiRxBuffer.word[0]);
-        const int32_t y = __REV(spiRxBuffer.word[1]);
-        const int32_t z = __REV(spiRxBuffer.word[2]);
+    
+    if (quaternionData) {
+        const int32_t x = readBigEndian(&quaternionData[0]);
+        const int32_t y = readBigEndian(&quaternionData[4]);
+        const int32_t z = readBigEndian(&quaternionData[8]);
         quaternion.x.value = x;
         quaternion.y.value = y;
         quaternion.z.value = z;
         quaternion.w.value = sqrtQ30((1 << 30) - squareQ30(x) - squareQ30(y) - squareQ30(z));
         ICM20948_quaternion_callback(&quaternion);
     }
-    if (isCompassAccuracyAvailable) {
-        do_spi(readFifoDataCommand, 3);
-        ICM20948_compass_accuracy_callback(spiRxBuffer.byte[1]);
+    if (compassAccuracyData) {
+        ICM20948_compass_accuracy_callback(compassAccuracyData[1]);
+    }
+    
+    /* Move the incomplete packet just before the next burst */
+    fifoPendingLength = end - position;
+    for (uint32_t byte = 0; byte < fifoPendingLength; ++byte) {
+        fifoBuffer[FIFO_MAX_PACKET_LENGTH - fifoPendingLength + byte] = fifoBuffer[position + byte];
     }
+    fifo_read_done();
 }
 
 #ifndef INLINE_ALL
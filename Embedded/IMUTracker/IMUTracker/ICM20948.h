@@ -22,13 +22,18 @@
 
 #ifndef INLINE_ALL
 void ICM20948_init(void);
-void ICM20948_download(void);
+int ICM20948_download(void);
+uint32_t ICM20948_dmp_crc(void);
 void ICM20948_rs485_callback(void);
-void ICM20948_enable_dmp(void);
+void ICM20948_enable_dmp(uint8_t rate);
+int ICM20948_set_rate(uint8_t rate);
+void ICM20948_read_fifo(void);
 void ICM20948_process_fifo(void);
 
 extern void ICM20948_quaternion_callback(const quaternion_t *quaternion);
 extern void ICM20948_compass_accuracy_callback(uint8_t accuracy);
+extern void ICM20948_fifo_read_callback(void);
+extern void ICM20948_rate_set_callback(void);
 #endif
 
 #endif
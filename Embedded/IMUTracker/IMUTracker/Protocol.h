@@ -19,6 +19,46 @@
 
 #define PACKET_HEADER 0xFF
 #define DMP_UPLOAD_ID 0xFE
+#define BROADCAST_ID 0xFD
+
+/* Packet format: <Header> <ID> <COBS encoded command and parameters> */
+/* COBS here eliminates 0xFF instead of 0x00, so the header is unique on the bus */
+/* Code n (1 - 0xFE) is followed by (n - 1) data bytes and an omitted 0xFF, */
+/* except for the last chunk and n = 0xFE (253 bytes without 0xFF) */
+/* Encoding adds 1 byte to the packets below, which are shown before encoding */
+/* Pages of Command_Program and the DMP firmware are encoded in the same way */
+
+/* DMP firmware upload: <Header> <DMP_UPLOAD_ID> <COBS encoded LZSS stream> */
+/* Tokens are read MSB first, 1 <Literal (8bit)> or 0 <Distance - 1 (8bit)> <Length - 2 (4bit)> */
+/* Stream is padded to a multiple of 16 bytes and decoded into DMP_FIRMWARE_LENGTH bytes */
+/* Host must wait until nodes decoded the stream, and upload again while any stays in DMP_Status_Waiting */
+/* A node whose decoder fell behind the bus drops the stream and keeps waiting */
+#define DMP_FIRMWARE_LENGTH 14290 /* Bank 0 from 0x90 to bank 0x38 at 0x62 */
+#define DMP_WINDOW_LENGTH 256
+/* 16 byte chunks of the firmware (in upload order) which nodes overwrite to enable DMP, or DMP updates by itself */
+/* e.g. chunk 14 - 16 has compass matrix at bank 1 0x70 - 0x93, see ICM20948_enable_dmp() */
+#define DMP_VOLATILE_CHUNKS {1, 5, 7, 10, 14, 15, 16, 22, 39, 70, 82, 83}
+
+/* Time slot of broadcast replies */
+/* Slot length is given by host in bytes, which should fit the longest reply of selected nodes */
+/* Reply of slot k starts (BROADCAST_GUARD_US + k * slot) after the end of request */
+/* Each slot also has BROADCAST_GUARD_US of spare time for turnaround */
+#define BROADCAST_GUARD_US 50
+#define NODE_QUATERNION_SLOT_LENGTH 21 /* Encoded Command_Reply_Node_Quaternion */
+#define COMPACT_QUATERNION_SLOT_LENGTH 11 /* Encoded Command_Reply_Compact_Quaternion */
+
+/* Firmware update (see Command_Program and Command_Program_All) */
+#define PROGRAM_FLASH_ORIGIN 0xC00 /* First byte of the image, which has vector table of application */
+#define PROGRAM_MAX_PAGES 206 /* PROGRAM_FLASH_ORIGIN - 0x3F80 */
+#define PROGRAM_RETAINED_VECTOR 8 /* Vector with the address of retained settings, which nodes keep across updates */
+#define PROGRAM_BLOCK_PAGES 16
+#define PROGRAM_UNIT_LENGTH 67 /* Encoded page and CRC16 (CRC-16/CCITT-FALSE) */
+#define PROGRAM_STATUS_LENGTH 35 /* 7 pages in each byte */
+#define PROGRAM_BLOCK_WAIT_US 150000 /* Erasing pages takes 100ms and writing each takes 1ms */
+#define PROGRAM_PAGE_WAIT_US 110000
+#define PAGE_CRCS_PER_REPLY 12 /* Command_Reply_Page_CRCs fits in RS485_MAX_PACKET_LENGTH */
+#define HISTORY_LENGTH 16 /* Samples kept by each node for Command_Read_History */
+#define TIMESTAMP_CLOCK_HZ 15000000 /* Local clock of nodes counts up at this rate and wraps around at 2^31 */
 
 typedef enum {
     Command_Ping, /* <Header> <ID> <Command_Ping> (Ack required) */
@@ -38,8 +78,104 @@ typedef enum {
     Command_Set_ID, /* <Header> <ID> <Command_Set_ID> <New ID> (Ack required) */
     Command_Flash, /* <Header> <ID> <Command_Flash> (Ack required) */
     Command_Program, /* <Header> <ID> <Command_Program> <Number of pages> */
+    /* Node replies 1 (not encoded) and then pages are sent in blocks of PROGRAM_BLOCK_PAGES */
+    /* Each page is sent as a unit: <Page (64 bytes)> <CRC16 little endian> encoded in 67 bytes */
+    /* After the units of a block, node replies (not encoded) the number of pages */
+    /* - equals to pages in the block: all pages are written, continue to next block */
+    /* - less than that: the page at the number is broken, resend units from that page */
     Command_Read_Compass_Accuracy, /* <Header> <ID> <Command_Read_Compass_Accuracy> */
     Command_Reply_Compass_Accuracy, /* <Header> <ID = 0> <Command_Reply_Quaternion> <Accuracy> */
+    Command_Read_All_Quaternions, /* <Header> <BROADCAST_ID> <Command_Read_All_Quaternions> <ID bitmap> <Slot length> */
+    /* ID bitmap is 64bit little endian, bit n selects the node of ID n */
+    /* Selected node replies in slot k where k is the number of selected nodes with smaller ID */
+    Command_Reply_Node_Quaternion, /* <Header> <ID = 0> <Command_Reply_Node_Quaternion> <Node ID> <w> <x> <y> <z> (In IEEE754) */
+    Command_Start_Streaming, /* <Header> <BROADCAST_ID> <Command_Start_Streaming> <ID bitmap> <Slot length> <Period> */
+    /* Period is 16bit little endian in us, extended to fit (number of selected nodes + 1) slots */
+    /* Selected nodes send their quaternion every period without request */
+    /* The node of the smallest ID sends by its own timer, the others send in their slots after it */
+    /* The last slot of each period is left for host (e.g. Command_Stop_Streaming) */
+    Command_Stop_Streaming, /* <Header> <BROADCAST_ID> <Command_Stop_Streaming> */
+    Command_Set_Format, /* <Header> <ID> <Command_Set_Format> <Format> (Ack required) */
+    /* Nodes in Format_Compact reply Command_Reply_Compact_Quaternion instead of */
+    /* Command_Reply_Quaternion and Command_Reply_Node_Quaternion */
+    Command_Reply_Compact_Quaternion, /* <Header> <ID = 0> <Command_Reply_Compact_Quaternion> <Node ID> <Data (48bit)> */
+    /* specification of data (little endian) */
+    /* ___________________________________________________________________ */
+    /* Bit  |       0, 1       |    2 - 16    |    17 - 31   |   32 - 46   | */
+    /* Data | Index of largest | 1st smaller  | 2nd smaller  | 3rd smaller | */
+    /* ------------------------------------------------------------------- */
+    /* index: 0, 1, 2, 3 stands for w, x, y, z (smaller ones keep this order) */
+    /* smaller: n in [0, 32767] stands for n / 32767 * sqrt(2) - 1 / sqrt(2) */
+    /* largest: sqrt(1 - (sum of smaller^2)), always positive */
+    /* Error of each smaller component is less than 2.2e-5 (rotation error < 0.01 degree) */
+    Command_Program_All, /* <Header> <BROADCAST_ID> <Command_Program_All> <ID bitmap> <Number of pages> */
+    /* Selected nodes enter bootloader and silently follow the commands below until Command_Finish_Program */
+    /* Parameter of them never be 0xFF, so these packets are always encoded as <Code = 3> <Command> <Parameter> */
+    Command_Program_Block, /* <Header> <BROADCAST_ID> <Command_Program_Block> <Block index> <Units> */
+    /* Units are the same as Command_Program, host waits PROGRAM_BLOCK_WAIT_US after them */
+    Command_Resend_Page, /* <Header> <BROADCAST_ID> <Command_Resend_Page> <Page> <Unit> */
+    /* Only nodes missing the page write it, host waits PROGRAM_PAGE_WAIT_US after it */
+    Command_Read_Program_Status, /* <Header> <BROADCAST_ID> <Command_Read_Program_Status> <ID> */
+    Command_Reply_Program_Status, /* <Header> <ID = 0> <Command_Reply_Program_Status> <Missing pages> */
+    /* Bit k of byte n stands for page (7 * n + k), bit 7 is always 0 */
+    Command_Finish_Program, /* <Header> <BROADCAST_ID> <Command_Finish_Program> <0> */
+    /* Nodes write their settings back over the retained page of the new firmware, and reboot into it */
+    Command_Read_Page_CRCs, /* <Header> <ID> <Command_Read_Page_CRCs> <First page> */
+    Command_Reply_Page_CRCs, /* <Header> <ID = 0> <Command_Reply_Page_CRCs> <First page> <CRC16 x PAGE_CRCS_PER_REPLY> */
+    /* CRCs of the current pages from __vectors_start__ in the same way as units, 0 for pages out of flash */
+    Command_Patch_All, /* <Header> <BROADCAST_ID> <Command_Patch_All> <ID bitmap> <Number of pages> */
+    /* Same as Command_Program_All, but no pages are missing at first and nodes write every Command_Resend_Page */
+    /* Host reads Command_Read_Page_CRCs and only sends the pages changed, except for the retained page */
+    Command_Set_Fast_Boot, /* <Header> <ID> <Command_Set_Fast_Boot> <1(Enable)/0(Disable)> (Ack required) */
+    /* Saved by Command_Flash, then bootloader only waits for ICM20948 (100ms) on next boots */
+    /* Programming a new image disables it, so nodes running untested firmware are still rescued */
+    Command_Read_DMP_Status, /* <Header> <ID> <Command_Read_DMP_Status> */
+    Command_Reply_DMP_Status, /* <Header> <ID = 0> <Command_Reply_DMP_Status> <DMP status> <CRC16> */
+    /* CRC16 is of DMP_FIRMWARE_LENGTH bytes read back from DMP memory, in the same way as units */
+    /* DMP_VOLATILE_CHUNKS are left out, as they never match the firmware once DMP has run */
+    /* Reading back takes about 100ms, and CRC16 is 0 in DMP_Status_Running */
+    Command_Resume_DMP, /* <Header> <ID> <Command_Resume_DMP> (Ack required) */
+    /* Node enables DMP with the firmware in DMP memory, host should check it by Command_Read_DMP_Status */
+    Command_Set_Rate, /* <Header> <ID> <Command_Set_Rate> <Rate> (Ack required) */
+    /* Takes effect immediately (or when DMP is enabled), and is saved by Command_Flash */
+    /* Nodes reply failure for rates not in rate_t */
+    Command_Read_History, /* <Header> <ID> <Command_Read_History> <Sequence (16bit)> */
+    Command_Reply_History, /* <Header> <ID = 0> <Command_Reply_History> <Sequence (16bit)> <Count> <Data (48bit) * Count> */
+    /* Nodes number every quaternion from DMP and keep the last HISTORY_LENGTH ones */
+    /* Reply has the samples from Sequence to the latest, in the same format as Command_Reply_Compact_Quaternion */
+    /* Sequence in reply is of the first sample, which is later than requested if older ones are already lost */
+    Command_Read_Stamped_Quaternion, /* <Header> <ID> <Command_Read_Stamped_Quaternion> */
+    Command_Reply_Stamped_Quaternion, /* <Header> <ID = 0> <Command_Reply_Stamped_Quaternion> <Sequence (16bit)> <Timestamp (32bit)> <Data (48bit)> */
+    /* Sequence is the same as Command_Read_History, and data is in the format of Command_Reply_Compact_Quaternion */
+    /* Timestamp is taken when ICM20948 raised the interrupt for the sample */
+    /* It is in us of the clock synchronized by Command_Sync (or of the local clock until the first one) */
+    Command_Latch, /* <Header> <BROADCAST_ID> <Command_Latch> */
+    /* Every node keeps its latest sample at the moment, so the latched ones make a coherent pose */
+    Command_Read_Latched_Quaternion, /* <Header> <ID> <Command_Read_Latched_Quaternion> */
+    Command_Reply_Latched_Quaternion, /* <Header> <ID = 0> <Command_Reply_Latched_Quaternion> <Node ID> <Sequence (16bit)> <Age (16bit)> <Data (48bit)> */
+    /* Node ID tells a late reply from the one of the node requested next */
+    /* Age is in us from the sample to Command_Latch (saturated at 65535), for host to extrapolate */
+    /* Sequence and data are the same as Command_Reply_Stamped_Quaternion */
+    Command_Sync, /* <Header> <BROADCAST_ID> <Command_Sync> <Host time (32bit)> */
+    /* Host time is in us when the header is sent, nodes take their local clock when they receive it */
+    /* Nodes follow the offset and drift from host clock, so host should send this periodically (e.g. every second) */
 } command_id_t;
 
+typedef enum {
+    Format_Float, /* Four IEEE754 floats (16 bytes) */
+    Format_Compact, /* Smallest three in 15 bits each (6 bytes) */
+} format_t;
+
+typedef enum {
+    DMP_Status_Waiting, /* Waiting for DMP firmware upload or Command_Resume_DMP */
+    DMP_Status_Running,
+} dmp_status_t;
+
+typedef enum {
+    Rate_75Hz, /* Sensors at 225 Hz, DMP outputs every 3 samples (default) */
+    Rate_56Hz,
+    Rate_112Hz,
+    Rate_225Hz,
+} rate_t;
+
 #endif
@@ -67,3 +67,49 @@ INLINE void quaternion_right_mutable_multiply(const quaternion_t *left, quaterni
     quaternion_copy(right, &rightCopy);
     quaternion_multiply(left, &rightCopy, right);
 }
+
+/*
+ * Encode into QUATERNION_COMPACT_LENGTH bytes (little endian) by the smallest three method.
+ * Bit 0-1 is the index of the largest component (w, x, y, z),
+ * and the others follow in 15 bits each, which maps [-1/sqrt(2), 1/sqrt(2)] into [0, 32767].
+ * The largest component is always positive so the decoder recovers it by sqrt(1 - others^2).
+ */
+INLINE void quaternion_compact(const quaternion_t *quat, uint8_t *data)
+{
+    const int32_t halfSqrt2 = 759250125; /* 1 / sqrt(2) */
+    const quaternion_component_t *components = &quat->w;
+    uint32_t largest = 0;
+    uint32_t largestAbs = 0;
+    for (uint32_t index = 0; index < 4; ++index) {
+        const int32_t value = components[index].value;
+        const uint32_t absValue = value < 0 ? -value : value;
+        if (absValue > largestAbs) {
+            largest = index;
+            largestAbs = absValue;
+        }
+    }
+    const int32_t sign = components[largest].value < 0 ? -1 : 1;
+    uint64_t packed = largest;
+    uint32_t shift = 2;
+    for (uint32_t index = 0; index < 4; ++index) {
+        if (index == largest) {
+            continue;
+        }
+        const int32_t value = sign * components[index].value + halfSqrt2;
+        uint32_t quantized;
+        if (value <= 0) {
+            quantized = 0;
+        } else {
+            /* value * 32767 / (2 / sqrt(2)) with rounding */
+            quantized = ((uint64_t)value * 92679 + (1U << 31)) >> 32;
+            if (quantized > 32767) {
+                quantized = 32767;
+            }
+        }
+        packed |= (uint64_t)quantized << shift;
+        shift += 15;
+    }
+    for (uint32_t byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+        data[byte] = packed >> (8 * byte);
+    }
+}
@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #define QUATERNION_INITIALIZER {.w.value = 1 << 30, .x.value = 0, .y.value = 0, .z.value = 0}
+#define QUATERNION_COMPACT_LENGTH 6
 #define QUATERNION_INIT_COPY(src) {.w.value = (src).w.value, .x.value = (src).x.value, .y.value = (src).y.value, .z.value = (src).z.value}
 
 typedef union {
@@ -48,6 +49,7 @@ void quaternion_inverse(const quaternion_t *quat, quaternion_t *inverse);
 void quaternion_multiply(const quaternion_t *left, const quaternion_t *right, quaternion_t *ans);
 void quaternion_left_mutable_multiply(quaternion_t *left, const quaternion_t *right);
 void quaternion_right_mutable_multiply(const quaternion_t *left, quaternion_t *right);
+void quaternion_compact(const quaternion_t *quat, uint8_t *data);
 #endif
 
 #endif
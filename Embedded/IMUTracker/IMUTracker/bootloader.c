@@ -18,12 +18,17 @@
 #include <rom_api.h>
 #include <iap.h>
 #include "Protocol.h"
+#include "flash.h"
+
+/* Bootloader has to fit below the application, so optimize it for size */
+#pragma GCC optimize ("Os")
 
 #define US_TO_CLOCK(us) ((us) * 15)
 
 typedef void (*isr_t)(void);
 extern void (* const g_pfnVectors[])(void);
 extern const uint32_t __vectors_start__;
+extern const uint8_t __top_MFlash16;
 
 void __attribute__((section(".bootloader2"), noreturn, noinline)) bootloader_reboot()
 {
@@ -48,6 +53,31 @@ STATIC INLINE void __attribute__((section(".bootloader1"))) rs485_init()
     LPC_USART0->ADDR = 0; /* Use address register for counter variable */
 }
 
+STATIC INLINE int __attribute__((section(".bootloader2"))) is_user_flash(uint32_t address)
+{
+    return address >= (uintptr_t)&__vectors_start__ && address < (uintptr_t)&__top_MFlash16;
+}
+
+/* Application exports its retained data in the reserved vector, NULL if there is no application */
+static const flash_data_t * __attribute__((section(".bootloader2"), noinline)) retained_data()
+{
+    /* Erased flash (0xFFFFFFFF) is out of range */
+    if (! is_user_flash(__vectors_start__)) {
+        return 0;
+    }
+    const uint32_t retainedData = ((const uint32_t *)__vectors_start__)[PROGRAM_RETAINED_VECTOR];
+    if (! is_user_flash(retainedData) || retainedData % 64 != 0) {
+        return 0;
+    }
+    return (const flash_data_t *)retainedData;
+}
+
+static int __attribute__((section(".bootloader2"), noinline)) is_fast_boot()
+{
+    const flash_data_t *retainedData = retained_data();
+    return retainedData && retainedData->fastBoot == 1;
+}
+
 void __attribute__((section(".bootloader1"), noreturn)) bootloader_reset_handler()
 {
     LPC_PWRD_API->set_fro_frequency(30000); /* Set core clock 15 MHz */
@@ -70,11 +100,11 @@ void __attribute__((section(".bootloader1"), noreturn)) bootloader_reset_handler
     
     /* Wait 2s for firmware update packet */
     /* Format: 0x46 0x93 <Number of pages> */
-    /* This also waits ICM20948 to launch (100ms) */
+    /* This also waits ICM20948 to launch (100ms), which is all to wait in fast boot */
     NVIC_EnableIRQ(MRT_IRQn);
     LPC_MRT->Channel[0].CTRL = (1 << 1)  /* One-shot mode */
                              | (1 << 0); /* Enable interrupt */
-    LPC_MRT->Channel[0].INTVAL = US_TO_CLOCK(2000000); /* Set interval to 2s */
+    LPC_MRT->Channel[0].INTVAL = US_TO_CLOCK(is_fast_boot() ? 100000 : 2000000); /* Set interval */
     while (LPC_MRT->Channel[0].STAT & (1 << 1)) __WFI();
     
     /* Disable peripheral clocks */
@@ -102,75 +132,271 @@ void __attribute__((section(".bootloader1"), noreturn)) bootloader_reset_handler
 #define ACTIVATE_TRANSMITTER LPC_GPIO_PORT->SET[0] = 1 << 1
 #define ACTIVATE_RECEIVER LPC_GPIO_PORT->CLR[0] = 1 << 1
 
-void __attribute__((section(".bootloader1"))) rs485_program_flash_impl(uint8_t numUsedPage)
+STATIC INLINE uint32_t __attribute__((section(".bootloader2"))) receive_byte()
+{
+    WAIT_RECEIVE;
+    return LPC_USART0->RXDAT;
+}
+
+STATIC INLINE void __attribute__((section(".bootloader2"))) send_byte(uint32_t byte)
+{
+    LPC_USART0->TXDAT = byte;
+    WAIT_SEND;
+}
+
+/* CRC-16/CCITT-FALSE starts with crc = 0xFFFF, and continues with the last result */
+static uint32_t __attribute__((section(".bootloader2"), noinline)) crc16(uint32_t crc, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t byte = 0; byte < length; ++byte) {
+        crc ^= data[byte] << 8;
+        for (uint32_t bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc & 0xFFFF;
+}
+
+/* Decodes a unit into page and returns whether its CRC matches */
+/* Page may overlap unit as long as it does not start after unit */
+static int __attribute__((section(".bootloader2"), noinline)) decode_unit(const uint8_t *unit, uint8_t *page)
+{
+    uint32_t encoded = 0;
+    uint32_t decoded = 0;
+    while (1) {
+        const uint32_t code = unit[encoded++];
+        for (uint32_t byte = 1; byte < code && encoded < PROGRAM_UNIT_LENGTH; ++byte) {
+            page[decoded++] = unit[encoded++];
+        }
+        if (encoded >= PROGRAM_UNIT_LENGTH) {
+            break;
+        }
+        page[decoded++] = PACKET_HEADER;
+    }
+    return crc16(0xFFFF, page, 64) == (uint32_t)(page[64] | (page[65] << 8));
+}
+
+/* Returns the byte of missingPages holding page, 7 pages in each byte */
+/* Division would call __aeabi_uidiv in the application, which is being overwritten, */
+/* so page / 7 is (page * 293) >> 11, exact for every page below 685 */
+static uint8_t * __attribute__((section(".bootloader2"), noinline)) missing_byte(uint8_t *missingPages, uint32_t page,
+                                                                               uint32_t *bit)
+{
+    const uint32_t byte = (page * 293) >> 11;
+    *bit = 1 << (page - byte * 7);
+    return &missingPages[byte];
+}
+
+/* Erases numPages pages at once (it takes as long as a single page) and writes pages in pageMask */
+static void __attribute__((section(".bootloader2"), noinline)) write_pages(uint32_t firstPage, uint32_t numPages,
+                                                                         const uint8_t *buffer, uint32_t pageMask)
+{
+    struct sIAP iap;
+    const uint32_t flashPage = firstPage + ((uintptr_t)&__vectors_start__) / 64;
+    
+    iap.cmd = IAP_PREPARE;
+    iap.par[0] = flashPage / 16;
+    iap.par[1] = (flashPage + numPages - 1) / 16;
+    IAP_Call(&iap.cmd, &iap.stat);
+    
+    iap.cmd = IAP_ERASE_PAGE;
+    iap.par[0] = flashPage;
+    iap.par[1] = flashPage + numPages - 1;
+    IAP_Call(&iap.cmd, &iap.stat);
+    
+    for (uint32_t page = 0; page < numPages; ++page) {
+        if ((pageMask & (1U << page)) == 0) {
+            continue;
+        }
+        iap.cmd = IAP_PREPARE;
+        iap.par[0] = (flashPage + page) / 16;
+        iap.par[1] = (flashPage + page) / 16;
+        IAP_Call(&iap.cmd, &iap.stat);
+        
+        iap.cmd = IAP_COPY_RAM2FLASH;
+        iap.par[0] = (flashPage + page) * 64;
+        iap.par[1] = (uintptr_t)&buffer[page * 64];
+        iap.par[2] = 64;
+        IAP_Call(&iap.cmd, &iap.stat);
+    }
+}
+
+/* Settings such as ID live in a page of the image, so keep them in RAM while the image is replaced */
+static int __attribute__((section(".bootloader2"), noinline)) save_retained_data(flash_data_t *saved)
+{
+    const flash_data_t *retainedData = retained_data();
+    if (retainedData == 0) {
+        return 0;
+    }
+    /* Copy by words not to call memcpy in the application being replaced */
+    const uint32_t *src = (const uint32_t *)retainedData;
+    uint32_t *dst = (uint32_t *)saved;
+    for (uint32_t word = 0; word < sizeof(flash_data_t) / 4; ++word) {
+        dst[word] = src[word];
+    }
+    /* New image may be broken, so keep waiting for updates until it is tested (see Command_Set_Fast_Boot) */
+    saved->fastBoot = 0;
+    return 1;
+}
+
+/* Writes the saved settings over the defaults of the new image, and reboots */
+static void __attribute__((section(".bootloader2"), noreturn, noinline)) finish_program(const flash_data_t *saved,
+                                                                                      int isSaved)
+{
+    const flash_data_t *retainedData = retained_data();
+    if (isSaved && retainedData) {
+        write_pages(((uintptr_t)retainedData - (uintptr_t)&__vectors_start__) / 64, 1, saved->raw, 1);
+    }
+    bootloader_reboot();
+}
+
+void __attribute__((section(".bootloader2"))) rs485_program_flash_impl(uint8_t numUsedPage)
 {
     __disable_irq();
     
-    struct sIAP iap;
-    uint8_t __attribute__((aligned(4))) pageBuffer[64];
+    /* Application is not running anymore, so its RAM is free to use */
+    uint8_t __attribute__((aligned(4))) blockBuffer[PROGRAM_BLOCK_PAGES * PROGRAM_UNIT_LENGTH];
+    flash_data_t __attribute__((aligned(4))) savedData;
+    const int isSaved = save_retained_data(&savedData);
     
     ACTIVATE_TRANSMITTER;
-    LPC_USART0->TXDAT = 1;
-    WAIT_SEND;
+    send_byte(1);
     ACTIVATE_RECEIVER;
     
-    for (uint32_t pageCounter = 0; pageCounter < numUsedPage; ++pageCounter) {
+    for (uint32_t pageCounter = 0; pageCounter < numUsedPage; pageCounter += PROGRAM_BLOCK_PAGES) {
+        uint32_t pagesInBlock = numUsedPage - pageCounter;
+        if (pagesInBlock > PROGRAM_BLOCK_PAGES) {
+            pagesInBlock = PROGRAM_BLOCK_PAGES;
+        }
+        uint32_t receivedPages = 0;
         while (1) {
-            for (uint32_t byte = 0; byte < 64; ++byte) {
-                WAIT_RECEIVE;
-                pageBuffer[byte] = LPC_USART0->RXDAT;
-                if (pageBuffer[byte] == PACKET_HEADER) {
-                    WAIT_RECEIVE;
-                    (void)LPC_USART0->RXDAT;
-                }
+            /* Units arrive back to back, so they cannot be decoded until the block ends */
+            for (uint32_t byte = receivedPages * PROGRAM_UNIT_LENGTH; byte < pagesInBlock * PROGRAM_UNIT_LENGTH; ++byte) {
+                blockBuffer[byte] = receive_byte();
             }
-            ACTIVATE_TRANSMITTER;
-            for (uint32_t byte = 0; byte < 64; ++byte) {
-                LPC_USART0->TXDAT = pageBuffer[byte];
-                WAIT_SEND;
-                if (pageBuffer[byte] == PACKET_HEADER) {
-                    LPC_USART0->TXDAT = 0;
-                    WAIT_SEND;
-                }
+            /* Page k is decoded to (64 * k), which never overtakes unit k or later */
+            while (receivedPages < pagesInBlock
+                   && decode_unit(&blockBuffer[receivedPages * PROGRAM_UNIT_LENGTH], &blockBuffer[receivedPages * 64])) {
+                ++receivedPages;
             }
-            ACTIVATE_RECEIVER;
-            WAIT_RECEIVE;
-            if (LPC_USART0->RXDAT) {
+            if (receivedPages == pagesInBlock) {
                 break;
             }
+            /* Host resends from the first broken page */
+            ACTIVATE_TRANSMITTER;
+            send_byte(receivedPages);
+            ACTIVATE_RECEIVER;
         }
         
-        const uint32_t flashPage = pageCounter + ((uintptr_t)&__vectors_start__) / 64;
-        const uint32_t sector = flashPage / 16;
-        
-        iap.cmd = IAP_PREPARE;
-        iap.par[0] = sector;
-        iap.par[1] = sector;
-        IAP_Call(&iap.cmd, &iap.stat);
-        
-        iap.cmd = IAP_ERASE_PAGE;
-        iap.par[0] = flashPage;
-        iap.par[1] = flashPage;
-        IAP_Call(&iap.cmd, &iap.stat);
-        
-        iap.cmd = IAP_PREPARE;
-        iap.par[0] = sector;
-        iap.par[1] = sector;
-        IAP_Call(&iap.cmd, &iap.stat);
-        
-        iap.cmd = IAP_COPY_RAM2FLASH;
-        iap.par[0] = flashPage * 64;
-        iap.par[1] = (uintptr_t)pageBuffer;
-        iap.par[2] = 64;
-        IAP_Call(&iap.cmd, &iap.stat);
+        write_pages(pageCounter, pagesInBlock, blockBuffer, ~0U);
         
+        /* Acknowledge the whole block, then host sends next one */
         ACTIVATE_TRANSMITTER;
-        LPC_USART0->TXDAT = 1;
-        WAIT_SEND;
+        send_byte(pagesInBlock);
         ACTIVATE_RECEIVER;
     }
 
-    bootloader_reboot();
+    finish_program(&savedData, isSaved);
+}
+
+void __attribute__((section(".bootloader2"))) rs485_program_flash_all(uint8_t numUsedPage, uint8_t id, uint32_t isPatch)
+{
+    __disable_irq();
+    
+    uint8_t __attribute__((aligned(4))) blockBuffer[PROGRAM_BLOCK_PAGES * PROGRAM_UNIT_LENGTH];
+    uint8_t missingPages[PROGRAM_STATUS_LENGTH]; /* 7 pages in each byte not to make 0xFF */
+    flash_data_t __attribute__((aligned(4))) savedData;
+    const int isSaved = save_retained_data(&savedData);
+    for (uint32_t byte = 0; byte < PROGRAM_STATUS_LENGTH; ++byte) {
+        missingPages[byte] = 0;
+    }
+    /* Patch only sends pages changed from the current image */
+    for (uint32_t page = 0; page < numUsedPage && isPatch == 0; ++page) {
+        uint32_t missingBit;
+        *missing_byte(missingPages, page, &missingBit) |= missingBit;
+    }
+    
+    /* Silently follow packets of <Header> <BROADCAST_ID> <Code = 3> <Command> <Parameter> */
+    uint32_t rxData = receive_byte();
+    while (1) {
+        if (rxData != PACKET_HEADER || receive_byte() != BROADCAST_ID) {
+            rxData = receive_byte();
+            continue;
+        }
+        (void)receive_byte();
+        const uint32_t command = receive_byte();
+        const uint32_t parameter = receive_byte();
+        uint32_t firstPage = parameter;
+        uint32_t numPages = 1;
+        switch (command) {
+            case Command_Program_Block:
+                firstPage = parameter * PROGRAM_BLOCK_PAGES;
+                numPages = numUsedPage - firstPage;
+                if (numPages > PROGRAM_BLOCK_PAGES) {
+                    numPages = PROGRAM_BLOCK_PAGES;
+                }
+                /* Fall through */
+            case Command_Resend_Page:
+                if (firstPage >= numUsedPage) {
+                    break;
+                }
+                for (uint32_t byte = 0; byte < numPages * PROGRAM_UNIT_LENGTH; ++byte) {
+                    blockBuffer[byte] = receive_byte();
+                    if (blockBuffer[byte] == PACKET_HEADER) {
+                        /* Some bytes are lost and next packet started */
+                        numPages = 0;
+                        break;
+                    }
+                }
+                if (numPages == 0) {
+                    /* Start over from the header just received */
+                    rxData = PACKET_HEADER;
+                    continue;
+                }
+                uint32_t pageMask = 0;
+                for (uint32_t page = 0; page < numPages; ++page) {
+                    uint32_t missingBit;
+                    uint8_t * const missingByte = missing_byte(missingPages, firstPage + page, &missingBit);
+                    if (command == Command_Program_Block || isPatch) {
+                        /* Whole block is erased below, even the pages already written */
+                        /* Patch writes every page sent, which stays missing if broken */
+                        *missingByte |= missingBit;
+                    }
+                    if ((*missingByte & missingBit)
+                        && decode_unit(&blockBuffer[page * PROGRAM_UNIT_LENGTH], &blockBuffer[page * 64])) {
+                        pageMask |= 1U << page;
+                        *missingByte &= ~missingBit;
+                    }
+                }
+                if (pageMask) {
+                    write_pages(firstPage, numPages, blockBuffer, pageMask);
+                }
+                break;
+                
+            case Command_Read_Program_Status:
+                if (parameter != id) {
+                    break;
+                }
+                /* Bytes of missingPages never be 0xFF, so COBS encoding is just a code */
+                ACTIVATE_TRANSMITTER;
+                send_byte(PACKET_HEADER);
+                send_byte(0);
+                send_byte(PROGRAM_STATUS_LENGTH + 2);
+                send_byte(Command_Reply_Program_Status);
+                for (uint32_t byte = 0; byte < PROGRAM_STATUS_LENGTH; ++byte) {
+                    send_byte(missingPages[byte]);
+                }
+                ACTIVATE_RECEIVER;
+                break;
+                
+            case Command_Finish_Program:
+                finish_program(&savedData, isSaved);
+                break;
+                
+            default:
+                break;
+        }
+        rxData = receive_byte();
+    }
 }
 
 static void __attribute__((section(".bootloader2"))) rs485_handler()
@@ -227,9 +453,9 @@ static const __attribute__((used, section(".bootloader_vector"))) isr_t vectors[
     0,                              // Reserved
     0,                              // Reserved
     bootloader_checksum,            // LPC MCU Checksum
-    0,                              // Reserved
-    0,                              // Reserved
-    0,                              // Reserved
+    (isr_t)rs485_program_flash_impl, // Reserved (entry for application)
+    (isr_t)rs485_program_flash_all, // Reserved (entry for application)
+    (isr_t)crc16,                   // Reserved (entry for application)
     bootloader_reboot,                         // SVCall handler
     0,                              // Reserved
     0,                              // Reserved
@@ -50,6 +50,8 @@ extern "C" {
 #endif
 #endif
 
+#include "flash.h"
+
 #define WEAK __attribute__ ((weak))
 #define ALIAS(f) __attribute__ ((weak, alias (#f)))
 
@@ -171,7 +173,7 @@ void (* const g_pfnVectors[])(void) = {
     0,                              // Reserved
     0,                              // Reserved
     __valid_user_code_checksum,     // LPC MCU Checksum
-    0,                              // Reserved
+    (void (*)(void))&defaultFlashData, // Reserved (retained data for bootloader)
     0,                              // Reserved
     0,                              // Reserved
     SVC_Handler,                    // SVCall handler
@@ -29,9 +29,15 @@ typedef union {
         uint8_t yIndex;
         int8_t  zSign;
         uint8_t zIndex;
+        uint8_t format;
+        uint8_t fastBoot; /* Bootloader skips the 2s wait if 1 */
+        uint8_t rate; /* rate_t */
     };
 } flash_data_t;
 
+/* Settings saved by flash_write, its address is exported to bootloader in the reserved vector */
+extern const flash_data_t defaultFlashData;
+
 #ifndef INLINE_ALL
 void flash_read(flash_data_t *data);
 void flash_write(flash_data_t *data);
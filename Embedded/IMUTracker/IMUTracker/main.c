@@ -37,6 +37,11 @@
 #define EXIT_SLEEP SCB->SCR = 0 /* Leave sleep on return from this ISR */
 #define LED_ON LPC_GPIO_PORT->B0[9] = 1
 #define LED_OFF LPC_GPIO_PORT->B0[9] = 0
+#define US_TO_CLOCK(us) ((us) * 15)
+#define BYTE_TO_CLOCK(bytes) ((bytes) * 15000000U / 46080) /* 10 bits at 460800 baud */
+#define MRT_ONE_SHOT ((1 << 1) | (1 << 0)) /* One-shot mode, enable interrupt */
+#define MRT_REPEAT (1 << 0) /* Repeat mode, enable interrupt */
+#define TIMESTAMP_NOW (0x7FFFFFFF - LPC_MRT->Channel[1].TIMER) /* MRT channel 1 is free running */
 
 static enum {
     state_initializing,
@@ -44,23 +49,54 @@ static enum {
     state_waiting_for_header,
     state_waiting_for_id,
     state_waiting_for_command,
+    state_waiting_for_broadcast_command,
+    state_waiting_for_id_bitmap,
+    state_waiting_for_slot,
+    state_waiting_for_streaming_config,
+    state_waiting_for_reply_command,
+    state_waiting_for_reply_node_id,
     state_waiting_for_unity_offset,
     state_waiting_for_axis,
     state_waiting_for_new_id,
+    state_waiting_for_format,
+    state_waiting_for_fast_boot,
+    state_waiting_for_rate,
+    state_waiting_for_history_sequence,
+    state_waiting_for_sync_time,
     state_waiting_for_num_pages,
+    state_waiting_for_program_config,
+    state_waiting_for_patch_config,
+    state_waiting_for_first_page,
     state_replying_ack,
     state_replying_quaternion,
+    state_replying_node_quaternion,
     state_replying_compass_accuracy,
+    state_replying_page_crcs,
+    state_replying_dmp_status,
+    state_replying_history,
+    state_replying_stamped_quaternion,
+    state_replying_latched_quaternion,
     state_flashing,
+    state_verifying_dmp,
+    state_resuming_dmp,
 } state = state_initializing;
 
 static volatile int isDMPFirmwareDownloaded = 0;
-static uint8_t serialBuffer[16];
+static volatile int isRateChanged = 0;
+static volatile int isSyncReceived = 0;
+static uint8_t streamingMasterID = 0; /* 0 while not streaming */
+static uint32_t streamingSlotDelay;
+static uint32_t slotClock;
+static uint8_t __attribute__((aligned(4))) serialBuffer[16];
 
 static const uint8_t replyAckPacket[] = {
     PACKET_HEADER, /* ID = 0 will be automatically inserted */ Command_Reply_Ack, 1
 };
 
+static const uint8_t replyNackPacket[] = {
+    PACKET_HEADER, /* ID = 0 will be automatically inserted */ Command_Reply_Ack, 0
+};
+
 static volatile struct __attribute__((packed)) {
     uint8_t dummy[2];
     uint8_t header;
@@ -74,6 +110,30 @@ static volatile struct __attribute__((packed)) {
     .header = PACKET_HEADER, .command = Command_Reply_Quaternion,
 };
 
+static volatile struct __attribute__((packed)) {
+    uint8_t dummy[1];
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint8_t id;
+    float w;
+    float x;
+    float y;
+    float z;
+} __attribute__((aligned(4))) nodeQuaternionReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_Node_Quaternion,
+};
+
+static volatile struct __attribute__((packed)) {
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint8_t id;
+    uint8_t data[QUATERNION_COMPACT_LENGTH];
+} compactQuaternionReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_Compact_Quaternion,
+};
+
 static volatile struct __attribute__((packed)) {
     uint8_t header;
     /* ID = 0 will be automatically inserted */
@@ -83,22 +143,296 @@ static volatile struct __attribute__((packed)) {
     .header = PACKET_HEADER, .command = Command_Reply_Compass_Accuracy
 };
 
+static struct __attribute__((packed)) {
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint8_t firstPage;
+    uint16_t crc[PAGE_CRCS_PER_REPLY];
+} pageCRCsReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_Page_CRCs
+};
+
+extern const uint32_t __vectors_start__;
+
+static struct __attribute__((packed)) {
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint8_t status;
+    uint16_t crc;
+} dmpStatusReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_DMP_Status
+};
+
+/* Compact quaternions in Unity coordinate, sample of sequence n is at n % HISTORY_LENGTH */
+static uint8_t history[HISTORY_LENGTH][QUATERNION_COMPACT_LENGTH];
+static volatile uint16_t historySequence; /* Sequence of the next sample */
+static volatile uint8_t historyCount; /* Samples recorded in history, up to HISTORY_LENGTH */
+static volatile uint32_t interruptTimestamp; /* Of the last interrupt from ICM20948 */
+static volatile uint32_t sampleTimestamp; /* Of the samples being processed */
+static uint32_t latestSampleTimestamp; /* Local clock of the sample in stampedQuaternionReplyPacket */
+static uint32_t headerTimestamp; /* Of the last packet */
+static volatile uint32_t syncTimestamp;
+static volatile uint32_t syncHostTime;
+
+/* Synchronized time (us) = clockBaseTime + (local clock - clockBaseTimestamp) * clockScale / 2^24 */
+#define CLOCK_NOMINAL_SCALE ((1U << 24) / (TIMESTAMP_CLOCK_HZ / 1000000))
+static uint32_t clockBaseTimestamp;
+static uint32_t clockBaseTime;
+static uint32_t clockScale = CLOCK_NOMINAL_SCALE;
+static uint32_t lastSyncTimestamp;
+static uint32_t lastSyncHostTime;
+static int isClockSynchronized = 0;
+
+static volatile struct __attribute__((packed)) {
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint16_t sequence;
+    uint32_t timestamp;
+    uint8_t data[QUATERNION_COMPACT_LENGTH];
+} stampedQuaternionReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_Stamped_Quaternion
+};
+
+static struct __attribute__((packed)) {
+    uint8_t header;
+    /* ID = 0 will be automatically inserted */
+    uint8_t command;
+    uint8_t id;
+    uint16_t sequence;
+    uint16_t age;
+    uint8_t data[QUATERNION_COMPACT_LENGTH];
+} latchedQuaternionReplyPacket = {
+    .header = PACKET_HEADER, .command = Command_Reply_Latched_Quaternion
+};
+
 static volatile quaternion_t currentChipQuaternion;
 static volatile quaternion_t chipOffset = QUATERNION_INITIALIZER;
 static volatile quaternion_t unityOffset = QUATERNION_INITIALIZER;
 
 static flash_data_t __attribute__((aligned(4))) retainedData;
 
-STATIC INLINE void replyAck()
+static void __attribute__((noinline)) replyAck()
 {
     state = state_replying_ack;
     rs485_send(replyAckPacket, sizeof(replyAckPacket));
 }
 
-void PININT0_IRQHandler()
+STATIC INLINE void replyNack()
 {
-    LPC_PIN_INT->RISE = 1 << 0; /* Clear interrupt flag */
-    EXIT_SLEEP;
+    state = state_replying_ack;
+    rs485_send(replyNackPacket, sizeof(replyNackPacket));
+}
+
+STATIC INLINE void replyNodeQuaternion()
+{
+    state = state_replying_node_quaternion;
+    if (retainedData.format == Format_Compact) {
+        rs485_send((void *)&compactQuaternionReplyPacket, sizeof(compactQuaternionReplyPacket));
+    } else {
+        rs485_send((void *)&nodeQuaternionReplyPacket.header, 19);
+    }
+}
+
+STATIC INLINE void replyPageCRCs(uint8_t firstPage)
+{
+    /* Takes about 3ms, but host just waits for this reply */
+    const uint8_t *image = (const uint8_t *)&__vectors_start__;
+    state = state_replying_page_crcs;
+    pageCRCsReplyPacket.firstPage = firstPage;
+    for (uint32_t index = 0; index < PAGE_CRCS_PER_REPLY; ++index) {
+        const uint32_t page = firstPage + index;
+        pageCRCsReplyPacket.crc[index] = page < PROGRAM_MAX_PAGES ? bootloader_crc16(0xFFFF, &image[page * 64], 64) : 0;
+    }
+    rs485_send(&pageCRCsReplyPacket, sizeof(pageCRCsReplyPacket));
+}
+
+STATIC INLINE void replyDMPStatus(uint8_t status, uint16_t crc)
+{
+    state = state_replying_dmp_status;
+    dmpStatusReplyPacket.status = status;
+    dmpStatusReplyPacket.crc = crc;
+    rs485_send(&dmpStatusReplyPacket, sizeof(dmpStatusReplyPacket));
+}
+
+STATIC INLINE void replyHistory(uint16_t sequence)
+{
+    /* Built on stack, since rs485_send encodes it into its own buffer */
+    struct __attribute__((packed)) {
+        uint8_t header;
+        /* ID = 0 will be automatically inserted */
+        uint8_t command;
+        uint16_t sequence;
+        uint8_t count;
+        uint8_t data[HISTORY_LENGTH][QUATERNION_COMPACT_LENGTH];
+    } packet;
+    const uint16_t nextSequence = historySequence;
+    const uint8_t recorded = historyCount;
+    uint16_t count = nextSequence - sequence;
+    if (count > recorded) {
+        /* Slots not recorded yet are zero, which is not a rotation */
+        count = recorded;
+        sequence = nextSequence - recorded;
+    }
+    packet.header = PACKET_HEADER;
+    packet.command = Command_Reply_History;
+    packet.sequence = sequence;
+    packet.count = count;
+    for (uint32_t sample = 0; sample < count; ++sample) {
+        const uint8_t *data = history[(uint16_t)(sequence + sample) % HISTORY_LENGTH];
+        for (uint32_t byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+            packet.data[sample][byte] = data[byte];
+        }
+    }
+    state = state_replying_history;
+    rs485_send(&packet, 5 + count * QUATERNION_COMPACT_LENGTH);
+}
+
+STATIC INLINE void latchQuaternion()
+{
+    /* Called from USART interrupt, so the sample is not updated meanwhile */
+    const uint32_t age = (TIMESTAMP_NOW - latestSampleTimestamp) & 0x7FFFFFFF;
+    const uint32_t ageUS = age / (TIMESTAMP_CLOCK_HZ / 1000000);
+    latchedQuaternionReplyPacket.sequence = stampedQuaternionReplyPacket.sequence;
+    latchedQuaternionReplyPacket.age = ageUS > 0xFFFF ? 0xFFFF : ageUS;
+    for (uint32_t byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+        latchedQuaternionReplyPacket.data[byte] = stampedQuaternionReplyPacket.data[byte];
+    }
+}
+
+static uint32_t __attribute__((noinline)) synchronizedTime(uint32_t timestamp)
+{
+    /* Local clock is 31bit, and timestamp may be a little older than the base */
+    int32_t elapsed = (int32_t)((timestamp - clockBaseTimestamp) << 1) >> 1;
+    if (elapsed > (1 << 29)) {
+        /* Move the base before the local clock wraps around */
+        clockBaseTime += (uint32_t)(((uint64_t)elapsed * clockScale) >> 24);
+        clockBaseTimestamp = timestamp;
+        elapsed = 0;
+    }
+    return clockBaseTime + (int32_t)(((int64_t)elapsed * clockScale) >> 24);
+}
+
+STATIC INLINE void synchronizeClock(uint32_t timestamp, uint32_t hostTime)
+{
+    const int32_t error = hostTime - synchronizedTime(timestamp);
+    if (isClockSynchronized == 0 || error > 1000000 || error < -1000000) {
+        /* First sync, or host clock has jumped */
+        clockBaseTimestamp = timestamp;
+        clockBaseTime = hostTime;
+        clockScale = CLOCK_NOMINAL_SCALE;
+        isClockSynchronized = 1;
+    } else {
+        /* Both drift and offset are filtered, since host sends beacons with jitter */
+        const uint32_t elapsed = (timestamp - lastSyncTimestamp) & 0x7FFFFFFF;
+        if (elapsed > TIMESTAMP_CLOCK_HZ / 10 && elapsed < (1U << 29)) {
+            const uint32_t measuredScale = ((uint64_t)(hostTime - lastSyncHostTime) << 24) / elapsed;
+            clockScale += (int32_t)(measuredScale - clockScale) / 4;
+        }
+        clockBaseTime = synchronizedTime(timestamp) + error / 2;
+        clockBaseTimestamp = timestamp;
+    }
+    lastSyncTimestamp = timestamp;
+    lastSyncHostTime = hostTime;
+}
+
+STATIC INLINE void setID(uint8_t id)
+{
+    nodeQuaternionReplyPacket.id = id;
+    compactQuaternionReplyPacket.id = id;
+    latchedQuaternionReplyPacket.id = id;
+}
+
+STATIC INLINE int isSelected(const uint32_t *idBitmap, uint8_t id)
+{
+    return id < 64 && (idBitmap[id / 32] & (1U << (id % 32)));
+}
+
+STATIC INLINE uint32_t countSelected(const uint32_t *idBitmap, uint8_t belowID)
+{
+    uint32_t count = 0;
+    for (uint8_t anID = 0; anID < belowID; ++anID) {
+        if (isSelected(idBitmap, anID)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+STATIC INLINE void startTimer(uint32_t mode, uint32_t clock)
+{
+    LPC_MRT->Channel[0].CTRL = mode;
+    LPC_MRT->Channel[0].INTVAL = clock | (1U << 31); /* Load immediately */
+}
+
+STATIC INLINE void stopTimer()
+{
+    LPC_MRT->Channel[0].INTVAL = 1U << 31; /* Loading 0 makes timer idle */
+}
+
+STATIC INLINE void waitForSlot(const uint32_t *idBitmap, uint8_t slotLength)
+{
+    if (! isSelected(idBitmap, retainedData.id)) {
+        state = state_waiting_for_header;
+        rs485_receive(serialBuffer, 1);
+        return;
+    }
+    const uint32_t slot = countSelected(idBitmap, retainedData.id);
+    slotClock = BYTE_TO_CLOCK(slotLength) + US_TO_CLOCK(BROADCAST_GUARD_US);
+    state = state_waiting_for_slot;
+    startTimer(MRT_ONE_SHOT, US_TO_CLOCK(BROADCAST_GUARD_US) + slot * slotClock);
+    /* Other nodes will talk until our slot comes */
+    rs485_receive(serialBuffer, 1);
+}
+
+STATIC INLINE void startStreaming(const uint32_t *idBitmap, uint8_t slotLength, uint32_t period)
+{
+    state = state_waiting_for_header;
+    rs485_receive(serialBuffer, 1);
+    if (! isSelected(idBitmap, retainedData.id)) {
+        streamingMasterID = 0;
+        stopTimer();
+        return;
+    }
+    const uint32_t slot = countSelected(idBitmap, retainedData.id);
+    const uint32_t numSlots = countSelected(idBitmap, 64) + 1; /* Last slot is for host */
+    slotClock = BYTE_TO_CLOCK(slotLength) + US_TO_CLOCK(BROADCAST_GUARD_US);
+    uint32_t periodClock = US_TO_CLOCK(period);
+    if (periodClock < numSlots * slotClock) {
+        periodClock = numSlots * slotClock;
+    }
+    uint8_t masterID = 0;
+    while (! isSelected(idBitmap, masterID)) {
+        ++masterID;
+    }
+    streamingMasterID = masterID;
+    if (slot == 0) {
+        /* Master sends by its own clock and others follow it */
+        startTimer(MRT_REPEAT, periodClock);
+    } else {
+        /* Reply of master is detected at its 5th byte (node ID after COBS code) */
+        streamingSlotDelay = slot * slotClock - BYTE_TO_CLOCK(5);
+    }
+}
+
+STATIC INLINE int isWatchingBus()
+{
+    /* Only replies of other nodes can be in progress */
+    return state == state_waiting_for_header
+        || state == state_waiting_for_id
+        || state == state_waiting_for_reply_command
+        || state == state_waiting_for_reply_node_id;
+}
+
+void MRT_IRQHandler()
+{
+    LPC_MRT->IRQ_FLAG = 1 << 0; /* Clear interrupt flag */
+    if (state == state_waiting_for_slot
+        || (streamingMasterID == retainedData.id && isWatchingBus())) {
+        replyNodeQuaternion();
+    }
 }
 
 INLINE void ICM20948_quaternion_callback(const quaternion_t *quaternion)
@@ -116,6 +450,31 @@ INLINE void ICM20948_quaternion_callback(const quaternion_t *quaternion)
     unityQuat.y.value = retainedData.ySign * chipQuat.axis[retainedData.yIndex].value;
     unityQuat.z.value = retainedData.zSign * chipQuat.axis[retainedData.zIndex].value;
     quaternion_left_mutable_multiply(&unityQuat, &theUnityOffset);
+    uint8_t data[QUATERNION_COMPACT_LENGTH];
+    quaternion_compact(&unityQuat, data);
+    const uint32_t time = synchronizedTime(sampleTimestamp);
+    __disable_irq();
+    uint8_t *sample = history[historySequence % HISTORY_LENGTH];
+    for (uint32_t byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+        sample[byte] = data[byte];
+        stampedQuaternionReplyPacket.data[byte] = data[byte];
+    }
+    stampedQuaternionReplyPacket.sequence = historySequence;
+    stampedQuaternionReplyPacket.timestamp = time;
+    latestSampleTimestamp = sampleTimestamp;
+    historySequence = historySequence + 1;
+    if (historyCount < HISTORY_LENGTH) {
+        historyCount = historyCount + 1;
+    }
+    __enable_irq();
+    if (retainedData.format == Format_Compact) {
+        __disable_irq();
+        for (uint32_t byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+            compactQuaternionReplyPacket.data[byte] = data[byte];
+        }
+        __enable_irq();
+        return;
+    }
     const float ieeeW = convertQ30ToFloat(unityQuat.w.value);
     const float ieeeX = convertQ30ToFloat(unityQuat.x.value);
     const float ieeeY = convertQ30ToFloat(unityQuat.y.value);
@@ -125,6 +484,10 @@ INLINE void ICM20948_quaternion_callback(const quaternion_t *quaternion)
     quaternionReplyPacket.x = ieeeX;
     quaternionReplyPacket.y = ieeeY;
     quaternionReplyPacket.z = ieeeZ;
+    nodeQuaternionReplyPacket.w = ieeeW;
+    nodeQuaternionReplyPacket.x = ieeeX;
+    nodeQuaternionReplyPacket.y = ieeeY;
+    nodeQuaternionReplyPacket.z = ieeeZ;
     __enable_irq();
 }
 
@@ -138,10 +501,30 @@ INLINE void ICM20948_compass_accuracy_callback(uint8_t accuracy)
     }
 }
 
+INLINE void ICM20948_fifo_read_callback()
+{
+    /* The latest sample in the burst came with the last interrupt */
+    sampleTimestamp = interruptTimestamp;
+    EXIT_SLEEP;
+}
+
+INLINE void ICM20948_rate_set_callback()
+{
+    /* Rate changed while the last one was written is set now */
+    EXIT_SLEEP;
+}
+
 #ifdef INLINE_ALL
 #include "ICM20948.c"
 #endif
 
+void PININT0_IRQHandler()
+{
+    LPC_PIN_INT->RISE = 1 << 0; /* Clear interrupt flag */
+    interruptTimestamp = TIMESTAMP_NOW;
+    ICM20948_read_fifo(); /* Burst is read by SPI interrupts */
+}
+
 INLINE void rs485_receive_callback()
 {
     switch (state) {
@@ -150,7 +533,8 @@ INLINE void rs485_receive_callback()
             break;
             
         case state_waiting_for_header:
-            if (serialBuffer[0] == PACKET_HEADER) {
+            if (serialBuffer[0] == PACKET_HEADER && rs485IsHeaderReceived) {
+                headerTimestamp = TIMESTAMP_NOW;
                 state = state_waiting_for_id;
             }
             rs485_receive(serialBuffer, 1);
@@ -165,6 +549,13 @@ INLINE void rs485_receive_callback()
             if (serialBuffer[0] == retainedData.id) {
                 state = state_waiting_for_command;
                 rs485_receive(serialBuffer, 1);
+            } else if (serialBuffer[0] == BROADCAST_ID) {
+                state = state_waiting_for_broadcast_command;
+                rs485_receive(serialBuffer, 1);
+            } else if (serialBuffer[0] == 0 && streamingMasterID != 0) {
+                /* Watch replies for the master of streaming */
+                state = state_waiting_for_reply_command;
+                rs485_receive(serialBuffer, 1);
             } else {
                 state = state_waiting_for_header;
                 rs485_receive_callback();
@@ -175,7 +566,41 @@ INLINE void rs485_receive_callback()
             switch (serialBuffer[0]) {
                 case Command_Read_Quaternion:
                     state = state_replying_quaternion;
-                    rs485_send((void *)&quaternionReplyPacket.header, 18);
+                    if (retainedData.format == Format_Compact) {
+                        rs485_send((void *)&compactQuaternionReplyPacket, sizeof(compactQuaternionReplyPacket));
+                    } else {
+                        rs485_send((void *)&quaternionReplyPacket.header, 18);
+                    }
+                    break;
+                    
+                case Command_Set_Format:
+                    state = state_waiting_for_format;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Set_Fast_Boot:
+                    state = state_waiting_for_fast_boot;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Set_Rate:
+                    state = state_waiting_for_rate;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Read_Stamped_Quaternion:
+                    state = state_replying_stamped_quaternion;
+                    rs485_send((void *)&stampedQuaternionReplyPacket, sizeof(stampedQuaternionReplyPacket));
+                    break;
+                    
+                case Command_Read_Latched_Quaternion:
+                    state = state_replying_latched_quaternion;
+                    rs485_send(&latchedQuaternionReplyPacket, sizeof(latchedQuaternionReplyPacket));
+                    break;
+                    
+                case Command_Read_History:
+                    state = state_waiting_for_history_sequence;
+                    rs485_receive(serialBuffer, 2);
                     break;
                     
                 case Command_Set_Unity_Offset:
@@ -202,6 +627,30 @@ INLINE void rs485_receive_callback()
                     rs485_receive(serialBuffer, 1);
                     break;
                     
+                case Command_Read_Page_CRCs:
+                    state = state_waiting_for_first_page;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Read_DMP_Status:
+                    if (isDMPFirmwareDownloaded) {
+                        replyDMPStatus(DMP_Status_Running, 0);
+                    } else {
+                        /* Reading DMP memory takes too long for ISR */
+                        state = state_verifying_dmp;
+                        EXIT_SLEEP;
+                    }
+                    break;
+                    
+                case Command_Resume_DMP:
+                    if (isDMPFirmwareDownloaded) {
+                        replyAck();
+                    } else {
+                        state = state_resuming_dmp;
+                        EXIT_SLEEP;
+                    }
+                    break;
+                    
                 case Command_Read_Compass_Accuracy:
                     state = state_replying_compass_accuracy;
                     rs485_send((void *)&replyCompassAccuracyPacket.header, 3);
@@ -224,6 +673,87 @@ INLINE void rs485_receive_callback()
             }
             break;
             
+        case state_waiting_for_broadcast_command:
+            switch (serialBuffer[0]) {
+                case Command_Read_All_Quaternions:
+                    state = state_waiting_for_id_bitmap;
+                    rs485_receive(serialBuffer, 9);
+                    break;
+                    
+                case Command_Start_Streaming:
+                    state = state_waiting_for_streaming_config;
+                    rs485_receive(serialBuffer, 11);
+                    break;
+                    
+                case Command_Program_All:
+                    state = state_waiting_for_program_config;
+                    rs485_receive(serialBuffer, 9);
+                    break;
+                    
+                case Command_Patch_All:
+                    state = state_waiting_for_patch_config;
+                    rs485_receive(serialBuffer, 9);
+                    break;
+                    
+                case Command_Stop_Streaming:
+                    streamingMasterID = 0;
+                    stopTimer();
+                    state = state_waiting_for_header;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Latch:
+                    latchQuaternion();
+                    state = state_waiting_for_header;
+                    rs485_receive(serialBuffer, 1);
+                    break;
+                    
+                case Command_Sync:
+                    state = state_waiting_for_sync_time;
+                    rs485_receive(serialBuffer, 4);
+                    break;
+                    
+                default:
+                    state = state_waiting_for_header;
+                    rs485_receive_callback();
+                    break;
+            }
+            break;
+            
+        case state_waiting_for_id_bitmap:
+            waitForSlot((const uint32_t *)serialBuffer, serialBuffer[8]);
+            break;
+            
+        case state_waiting_for_slot:
+            rs485_receive(serialBuffer, 1);
+            break;
+            
+        case state_waiting_for_streaming_config:
+            startStreaming((const uint32_t *)serialBuffer, serialBuffer[8], serialBuffer[9] | (serialBuffer[10] << 8));
+            break;
+            
+        case state_waiting_for_reply_command:
+            if (serialBuffer[0] == Command_Reply_Node_Quaternion
+                || serialBuffer[0] == Command_Reply_Compact_Quaternion) {
+                state = state_waiting_for_reply_node_id;
+                rs485_receive(serialBuffer, 1);
+            } else {
+                state = state_waiting_for_header;
+                rs485_receive_callback();
+            }
+            break;
+            
+        case state_waiting_for_reply_node_id:
+            if (serialBuffer[0] == streamingMasterID && streamingMasterID != retainedData.id) {
+                state = state_waiting_for_slot;
+                startTimer(MRT_ONE_SHOT, streamingSlotDelay);
+                rs485_receive(serialBuffer, 1);
+            } else {
+                state = state_waiting_for_header;
+                rs485_receive_callback();
+            }
+            break;
+            
         case state_waiting_for_unity_offset:
             unityOffset.w.value = ((int32_t *)serialBuffer)[0];
             unityOffset.x.value = ((int32_t *)serialBuffer)[1];
@@ -243,6 +773,29 @@ INLINE void rs485_receive_callback()
             break;
             
         case state_waiting_for_new_id:
+            setID(retainedData.id);
+            replyAck();
+            break;
+            
+        case state_waiting_for_format:
+            retainedData.format = serialBuffer[0] == Format_Compact ? Format_Compact : Format_Float;
+            replyAck();
+            break;
+            
+        case state_waiting_for_fast_boot:
+            retainedData.fastBoot = serialBuffer[0] ? 1 : 0;
+            replyAck();
+            break;
+            
+        case state_waiting_for_rate:
+            if (serialBuffer[0] > Rate_225Hz) {
+                replyNack();
+                break;
+            }
+            retainedData.rate = serialBuffer[0];
+            /* DMP registers are rewritten in the main loop */
+            isRateChanged = 1;
+            EXIT_SLEEP;
             replyAck();
             break;
             
@@ -250,6 +803,33 @@ INLINE void rs485_receive_callback()
             rs485_program_flash(serialBuffer[0]);
             break;
             
+        case state_waiting_for_program_config:
+        case state_waiting_for_patch_config:
+            if (isSelected((const uint32_t *)serialBuffer, retainedData.id)) {
+                rs485_program_flash_all(serialBuffer[8], retainedData.id, state == state_waiting_for_patch_config);
+            }
+            state = state_waiting_for_header;
+            rs485_receive(serialBuffer, 1);
+            break;
+            
+        case state_waiting_for_first_page:
+            replyPageCRCs(serialBuffer[0]);
+            break;
+            
+        case state_waiting_for_history_sequence:
+            replyHistory(*(const uint16_t *)serialBuffer);
+            break;
+            
+        case state_waiting_for_sync_time:
+            /* 64bit division takes too long for USART without FIFO, clock is updated in the main loop */
+            syncTimestamp = headerTimestamp;
+            syncHostTime = *(const uint32_t *)serialBuffer;
+            isSyncReceived = 1;
+            EXIT_SLEEP;
+            state = state_waiting_for_header;
+            rs485_receive(serialBuffer, 1);
+            break;
+            
         default:
             break;
     }
@@ -260,7 +840,13 @@ INLINE void rs485_send_callback(void)
     switch (state) {
         case state_replying_ack:
         case state_replying_quaternion:
+        case state_replying_node_quaternion:
         case state_replying_compass_accuracy:
+        case state_replying_page_crcs:
+        case state_replying_dmp_status:
+        case state_replying_history:
+        case state_replying_stamped_quaternion:
+        case state_replying_latched_quaternion:
             state = state_waiting_for_header;
             rs485_receive(serialBuffer, 1);
             break;
@@ -280,6 +866,7 @@ int main()
     /* Enable peripheral clocks */
     LPC_SYSCON->SYSAHBCLKCTRL[0] |= (1 << 6)   /* GPIO */
                                   | (1 << 7)   /* switch-matrix */
+                                  | (1 << 10)  /* multi-rate timer */
                                   | (1 << 11)  /* SPI0 */
                                   | (1 << 14)  /* USART0 */
                                   | (1 << 18)  /* IOCON */
@@ -301,11 +888,16 @@ int main()
     LPC_PIN_INT->IENR = 1 << 0; /* Enable interrupt for rising edge on P0_0 */
     NVIC_EnableIRQ(PININT0_IRQn);
     
+    NVIC_EnableIRQ(MRT_IRQn);
+    LPC_MRT->Channel[1].CTRL = 0; /* Repeat mode without interrupt */
+    LPC_MRT->Channel[1].INTVAL = 0x7FFFFFFF | (1U << 31); /* Load immediately */
+    
     /* Disable peripheral clocks */
     LPC_SYSCON->SYSAHBCLKCTRL[0] &= ~((1 << 7)    /* switch-matrix */
                                   |   (1 << 18)); /* IOCON */
     
     flash_read(&retainedData);
+    setID(retainedData.id);
     spi_init();
     ICM20948_init();
     
@@ -316,8 +908,13 @@ int main()
         ENTER_SLEEP;
         switch (state) {
             case state_downloading_dmp:
-                ICM20948_download();
-                isDMPFirmwareDownloaded = 1;
+                if (ICM20948_download()) {
+                    isDMPFirmwareDownloaded = 1;
+                } else {
+                    /* Rest of the stream has no header, and host finds DMP_Status_Waiting to upload again */
+                    state = state_waiting_for_header;
+                    rs485_receive(serialBuffer, 1);
+                }
                 break;
                 
             case state_flashing:
@@ -325,19 +922,47 @@ int main()
                 replyAck();
                 break;
                 
+            case state_verifying_dmp:
+                replyDMPStatus(DMP_Status_Waiting, ICM20948_dmp_crc());
+                break;
+                
+            case state_resuming_dmp:
+                isDMPFirmwareDownloaded = 1;
+                break;
+                
             default:
                 break;
         }
     }
     
     LED_ON;
-    ICM20948_enable_dmp();
-    state = state_waiting_for_header;
-    rs485_receive(serialBuffer, 1);
+    ICM20948_enable_dmp(retainedData.rate);
+    if (state == state_resuming_dmp) {
+        /* Host waits for acknowledge until DMP is enabled */
+        replyAck();
+    } else {
+        state = state_waiting_for_header;
+        rs485_receive(serialBuffer, 1);
+    }
     
     while (1) {
         ENTER_SLEEP;
         ICM20948_process_fifo();
+        if (isRateChanged) {
+            isRateChanged = 0;
+            if (ICM20948_set_rate(retainedData.rate) == 0) {
+                /* Retried after ICM20948_rate_set_callback() */
+                isRateChanged = 1;
+            }
+        }
+        if (isSyncReceived) {
+            __disable_irq();
+            const uint32_t timestamp = syncTimestamp;
+            const uint32_t hostTime = syncHostTime;
+            isSyncReceived = 0;
+            __enable_irq();
+            synchronizeClock(timestamp, hostTime);
+        }
     }
 
     return 0;
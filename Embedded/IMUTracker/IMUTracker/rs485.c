@@ -31,29 +31,41 @@
 
 const uint8_t *rs485SendBuffer;
 uint32_t rs485BytesToSend;
-uint32_t rs485ShouldSendPadding = 0;
 uint8_t *rs485ReceiveBuffer;
 uint32_t rs485BytesToReceive;
-int rs485ShouldSkipZero;
+uint32_t rs485IsHeaderReceived = 0;
+uint32_t rs485BytesInChunk = 0;
+uint32_t rs485ChunkEndsWithHeader = 0;
+static uint8_t rs485EncodedBuffer[RS485_MAX_PACKET_LENGTH + 2];
 
 INLINE void rs485_send(const void *buf, uint32_t length)
 {
-    rs485BytesToSend = length;
-    rs485SendBuffer = buf;
+    /* <Header> <ID = 0> are sent as is, and the rest is encoded by COBS */
+    /* Each code tells the number of following bytes + 1 until the (omitted) next 0xFF */
+    /* Packets are shorter than 254 bytes, so a code never exceeds 0xFE */
+    const uint8_t *data = (const uint8_t *)buf + 1;
+    uint8_t *code = &rs485EncodedBuffer[2];
+    uint8_t *encoded = code + 1;
+    rs485EncodedBuffer[0] = PACKET_HEADER;
+    rs485EncodedBuffer[1] = 0;
+    for (uint32_t byte = 1; byte < length; ++byte) {
+        if (data[byte - 1] == PACKET_HEADER) {
+            *code = encoded - code;
+            code = encoded++;
+        } else {
+            *encoded++ = data[byte - 1];
+        }
+    }
+    *code = encoded - code;
+    
+    rs485BytesToSend = encoded - rs485EncodedBuffer;
+    rs485SendBuffer = rs485EncodedBuffer;
     asm volatile ("":::"memory"); /* Parameters must be set before interrupt is enabled */
     LPC_GPIO_PORT->B0[1] = 1; /* Activate transmitter */
     LPC_USART0->INTENSET = 1 << 2; /* Enable Tx ready interrupt */
 }
 
 INLINE void rs485_receive(void *buf, uint32_t length)
-{
-    rs485BytesToReceive = length;
-    rs485ReceiveBuffer = buf;
-    rs485ShouldSkipZero = 0;
-    asm volatile ("":::"memory"); /* Ensure parameters are written */
-}
-
-INLINE void rs485_continous_receive(void *buf, uint32_t length)
 {
     rs485BytesToReceive = length;
     rs485ReceiveBuffer = buf;
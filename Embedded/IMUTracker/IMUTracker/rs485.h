@@ -19,23 +19,31 @@
 
 #include <stdint.h>
 
+#define RS485_MAX_PACKET_LENGTH 101 /* Including header, Command_Reply_History of HISTORY_LENGTH samples */
+
 extern const uint8_t *rs485SendBuffer;
 extern uint32_t rs485BytesToSend;
-extern uint32_t rs485ShouldSendPadding;
 extern uint8_t *rs485ReceiveBuffer;
 extern uint32_t rs485BytesToReceive;
-extern int rs485ShouldSkipZero;
+extern uint32_t rs485IsHeaderReceived; /* Distinguishes header from decoded 0xFF in data */
+extern uint32_t rs485BytesInChunk;
+extern uint32_t rs485ChunkEndsWithHeader;
 
 #ifndef INLINE_ALL
 void rs485_send(const void *buf, uint32_t length);
 void rs485_receive(void *buf, uint32_t length);
-void rs485_continous_receive(void *buf, uint32_t length);
 
 extern void rs485_send_callback(void);
 extern void rs485_receive_callback(void);
 #endif
 
 /* void rs485_program_flash(uint8_t numUsedPage); */
-#define rs485_program_flash ((void (*)(uint8_t))0x1a5)
+/* Bootloader exports them in the reserved vectors, which are not covered by the checksum */
+#define rs485_program_flash (*(void (* const *)(uint8_t))0x20)
+/* void rs485_program_flash_all(uint8_t numUsedPage, uint8_t id, uint32_t isPatch); */
+#define rs485_program_flash_all (*(void (* const *)(uint8_t, uint8_t, uint32_t))0x24)
+/* uint32_t bootloader_crc16(uint32_t crc, const uint8_t *data, uint32_t length); */
+/* CRC-16/CCITT-FALSE starts with crc = 0xFFFF, and continues with the last result */
+#define bootloader_crc16 (*(uint32_t (* const *)(uint32_t, const uint8_t *, uint32_t))0x28)
 
 #endif
@@ -23,14 +23,24 @@ void UART0_IRQHandler()
     const uint32_t flag = LPC_USART0->INTSTAT;
     if (flag & (1 << 0)) {
         /* Rx ready */
-        const uint8_t rxData = LPC_USART0->RXDAT;
-        if (rs485ShouldSkipZero) {
-            rs485ShouldSkipZero = 0;
-            if (rxData == 0) {
+        uint8_t rxData = LPC_USART0->RXDAT;
+        rs485IsHeaderReceived = rxData == PACKET_HEADER;
+        if (rs485IsHeaderReceived) {
+            /* 0xFF never appears in COBS encoded data, so it always starts a packet */
+            /* ID is not encoded, treat it as a chunk of 1 byte without trailing 0xFF */
+            rs485BytesInChunk = 1;
+            rs485ChunkEndsWithHeader = 0;
+        } else if (rs485BytesInChunk == 0) {
+            /* COBS code, 0xFF omitted at the end of previous chunk comes first */
+            const uint32_t shouldInsertHeader = rs485ChunkEndsWithHeader;
+            rs485BytesInChunk = rxData - 1;
+            rs485ChunkEndsWithHeader = rxData != 0xFE;
+            if (! shouldInsertHeader) {
                 return;
             }
-        } else if (rxData == PACKET_HEADER) {
-            rs485ShouldSkipZero = 1;
+            rxData = PACKET_HEADER;
+        } else {
+            --rs485BytesInChunk;
         }
         *rs485ReceiveBuffer = rxData;
         if (--rs485BytesToReceive) {
@@ -41,16 +51,7 @@ void UART0_IRQHandler()
     }
     if (flag & (1 << 2)) {
         /* Tx ready */
-        if (rs485ShouldSendPadding) {
-            rs485ShouldSendPadding = 0;
-            LPC_USART0->TXDAT = 0;
-        } else {
-            LPC_USART0->TXDAT = *rs485SendBuffer;
-            if (*rs485SendBuffer == PACKET_HEADER) {
-                rs485ShouldSendPadding = 1;
-                return;
-            }
-        }
+        LPC_USART0->TXDAT = *rs485SendBuffer;
         if (--rs485BytesToSend) {
             ++rs485SendBuffer;
         } else {
@@ -21,6 +21,8 @@ const uint8_t *spiSendBuffer;
 uint8_t *spiReceiveBuffer;
 uint32_t spiBytesToSend;
 uint32_t spiBytesToReceive;
+static spi_transaction_t *spiQueueHead;
+static spi_transaction_t *spiQueueTail;
 
 INLINE void spi_init()
 {
@@ -37,13 +39,46 @@ INLINE void spi_init()
     NVIC_EnableIRQ(SPI0_IRQn);
 }
 
-INLINE void spi_transfer(const void *txBuffer, void *rxBuffer, uint32_t length)
+STATIC INLINE void spi_start(const spi_transaction_t *transaction)
 {
-    spiSendBuffer = (const uint8_t *)txBuffer;
-    spiReceiveBuffer = (uint8_t *)rxBuffer;
-    spiBytesToSend = length;
-    spiBytesToReceive = length;
+    spiSendBuffer = (const uint8_t *)transaction->txBuffer;
+    spiReceiveBuffer = (uint8_t *)transaction->rxBuffer;
+    spiBytesToSend = transaction->length;
+    spiBytesToReceive = transaction->length;
     asm volatile ("":::"memory"); /* Parameters must be set before interrupt is enabled */
     LPC_SPI0->TXCTL = 7 << 24; /* 8bit data length (This clears end of transfer flag) */
     LPC_SPI0->INTENSET = 1 << 1; /* Tx ready */
 }
+
+INLINE void spi_transfer(spi_transaction_t *transaction)
+{
+    /* Called from both thread and interrupts */
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    transaction->next = 0;
+    if (spiQueueTail) {
+        spiQueueTail->next = transaction;
+    } else {
+        spiQueueHead = transaction;
+        spi_start(transaction);
+    }
+    spiQueueTail = transaction;
+    __set_PRIMASK(primask);
+}
+
+INLINE void spi_transfer_done()
+{
+    /* Next transaction starts before the callback, which may queue another one */
+    __disable_irq();
+    spi_transaction_t * const done = spiQueueHead;
+    spiQueueHead = done->next;
+    if (spiQueueHead) {
+        spi_start(spiQueueHead);
+    } else {
+        spiQueueTail = 0;
+    }
+    __enable_irq();
+    if (done->callback) {
+        done->callback();
+    }
+}
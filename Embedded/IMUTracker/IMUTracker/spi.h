@@ -19,6 +19,15 @@
 
 #include <stdint.h>
 
+/* Transactions are queued and run one after another without CPU waiting */
+typedef struct spi_transaction_t {
+    const void *txBuffer;
+    void *rxBuffer;
+    uint32_t length;
+    void (*callback)(void); /* Called from SPI interrupt after the transaction (may be 0) */
+    struct spi_transaction_t *next;
+} spi_transaction_t;
+
 extern const uint8_t *spiSendBuffer;
 extern uint8_t *spiReceiveBuffer;
 extern uint32_t spiBytesToSend;
@@ -26,8 +35,9 @@ extern uint32_t spiBytesToReceive;
 
 #ifndef INLINE_ALL
 void spi_init(void);
-void spi_transfer(const void *txBuffer, void *rxBuffer, uint32_t length);
-extern void spi_transfer_callback(void);
+/* Transaction must be kept until its callback, but may be queued again in the callback */
+void spi_transfer(spi_transaction_t *transaction);
+void spi_transfer_done(void);
 #endif
 
 #endif
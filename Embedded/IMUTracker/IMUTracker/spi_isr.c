@@ -27,7 +27,7 @@ void SPI0_IRQHandler()
         if (--spiBytesToReceive) {
             ++spiReceiveBuffer;
         } else {
-            spi_transfer_callback();
+            spi_transfer_done();
         }
     }
     if (irqFlag & (1 << 1)) {
@@ -95,6 +95,47 @@ static uint32_t multiplyQ30_acc(int32_t a, int32_t b)
     }
 }
 
+- (void)testCompact
+{
+    for (int i = 0; i < 1000; ++i) {
+        const float theta = (float)arc4random() / UINT32_MAX * 2 * M_PI - M_PI;
+        const float ux = (float)arc4random() / UINT32_MAX - 0.5;
+        const float uy = (float)arc4random() / UINT32_MAX - 0.5;
+        const float uz = sqrtf(1 - ux * ux - uy * uy);
+        const float source[] = {cosf(theta / 2), ux * sinf(theta / 2), uy * sinf(theta / 2), uz * sinf(theta / 2)};
+        
+        quaternion_t quat = {
+            .w.value = convertFloatToQ30(source[0]), .x.value = convertFloatToQ30(source[1]),
+            .y.value = convertFloatToQ30(source[2]), .z.value = convertFloatToQ30(source[3])
+        };
+        uint8_t data[QUATERNION_COMPACT_LENGTH];
+        quaternion_compact(&quat, data);
+        
+        uint64_t packed = 0;
+        for (int byte = 0; byte < QUATERNION_COMPACT_LENGTH; ++byte) {
+            packed |= (uint64_t)data[byte] << (8 * byte);
+        }
+        const int largest = packed & 0b11;
+        float decoded[4];
+        float sum = 0;
+        int shift = 2;
+        for (int index = 0; index < 4; ++index) {
+            if (index == largest) {
+                continue;
+            }
+            decoded[index] = ((packed >> shift) & 0x7FFF) / 32767.0 * M_SQRT2 - M_SQRT1_2;
+            sum += decoded[index] * decoded[index];
+            shift += 15;
+        }
+        decoded[largest] = sqrtf(1 - sum);
+        
+        const float sign = source[largest] < 0 ? -1 : 1;
+        for (int index = 0; index < 4; ++index) {
+            XCTAssertEqualWithAccuracy(decoded[index], sign * source[index], 1e-4);
+        }
+    }
+}
+
 - (void)testCLZ
 {
     XCTAssertEqual(count_leading_zeros(0), 32);
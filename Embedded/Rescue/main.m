@@ -4,27 +4,9 @@
 #import <IOKit/serial/IOSerialKeys.h>
 #import <sys/ioctl.h>
 #import "Serial.h"
+#import "Program.h"
 #import "Protocol.h"
 
-static NSData *maskData(NSData *data)
-{
-    const uint8_t header = PACKET_HEADER;
-    const uint8_t paddedHeader[] = {PACKET_HEADER, 0x00};
-    NSData *headerData = [NSData dataWithBytes:&header length:1];
-    NSMutableData *ret = [data mutableCopy];
-    NSRange searchRange = NSMakeRange(0, [data length]);
-    while (1) {
-        NSRange headerRange = [ret rangeOfData:headerData options:0 range:searchRange];
-        if (headerRange.location == NSNotFound) {
-            break;
-        }
-        [ret replaceBytesInRange:headerRange withBytes:paddedHeader length:2];
-        searchRange.location = headerRange.location + 2;
-        searchRange.length = [ret length] - searchRange.location;
-    }
-    return ret;
-}
-
 static NSData *programData;
 static uint8_t numOfPages;
 
@@ -48,57 +30,8 @@ static void deviceDidFound(void *shouldFlash, io_iterator_t iterator)
                     exit(1);
                 }
                 
-                const uint8_t rawAck = 1;
-                const uint8_t rawNack = 0;
-                NSData *ackData = [NSData dataWithBytes:&rawAck length:1];
-                NSData *nackData = [NSData dataWithBytes:&rawNack length:1];
-                for (int page = 0; page < (numOfPages - 1); ++page) {
-                    NSData *partialData = [programData subdataWithRange:NSMakeRange(64 * page, 64)];
-                    NSData *maskedData = maskData(partialData);
-                    while (1) {
-                        [serial sendRawData:maskedData];
-                        NSData *rxData = [serial readRawDataOfLength:[maskedData length]];
-                        if ([rxData length] != [maskedData length]) {
-                            fprintf(stderr, "Device did not send verify data on page %d\n", page);
-                            exit(1);
-                        }
-                        if ([rxData isEqualToData:maskedData]) {
-                            [serial sendRawData:ackData];
-                            NSData *rxData = [serial readRawDataOfLength:1];
-                            if ([rxData length] < 1) {
-                                fprintf(stderr, "Device did not send ack on page %d\n", page);
-                                exit(1);
-                            }
-                            break;
-                        }
-                        [serial sendRawData:nackData];
-                    }
-                }
-                
-                const NSUInteger finalDataLength = [programData length] - 64 * (numOfPages - 1);
-                const NSRange finalDataRange = NSMakeRange(64 * (numOfPages - 1), finalDataLength);
-                NSMutableData *finalData = [[programData subdataWithRange:finalDataRange] mutableCopy];
-                if ([finalData length] < 64) {
-                    [finalData increaseLengthBy:64 - [finalData length]];
-                }
-                NSData *finalMaskedData = maskData(finalData);
-                while (1) {
-                    [serial sendRawData:finalMaskedData];
-                    NSData *rxData = [serial readRawDataOfLength:[finalMaskedData length]];
-                    if ([rxData length] != [finalMaskedData length]) {
-                        fprintf(stderr, "Device did not send verify data on page %d\n", (numOfPages - 1));
-                        exit(1);
-                    }
-                    if ([rxData isEqualToData:finalMaskedData]) {
-                        [serial sendRawData:ackData];
-                        NSData *rxData = [serial readRawDataOfLength:1];
-                        if ([rxData length] == 0) {
-                            fprintf(stderr, "Device did not send ack on page %d\n", (numOfPages - 1));
-                            exit(1);
-                        }
-                        break;
-                    }
-                    [serial sendRawData:nackData];
+                if (! programPages(serial, programData, numOfPages)) {
+                    exit(1);
                 }
                 CFRunLoopStop(CFRunLoopGetCurrent());
             }
@@ -122,7 +55,7 @@ int main(int argc, const char * argv[])
     }
 
     numOfPages = ([programData length] - 1) / 64 + 1;
-    if (numOfPages > 240) {
+    if (numOfPages > PROGRAM_MAX_PAGES) {
         fprintf(stderr, "Binary is not fit in flash\n");
         return 1;
     }
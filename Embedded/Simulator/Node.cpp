@@ -0,0 +1,1094 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Node.h"
+#include "Simulator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define NS_PER_US 1000
+#define SAMPLE_DELAY_NS 1000000 /* FIFO burst is read and processed after the interrupt */
+#define FLASH_WRITE_NS 101000000
+#define PAGE_CRCS_NS 3000000
+#define DMP_READ_BACK_NS 100000000
+#define DMP_ENABLE_NS 50000000
+#define ERASE_NS 100000000
+#define PAGE_WRITE_NS 1000000
+#define BOOT_WAIT_NS 2000000000
+#define FAST_BOOT_WAIT_NS 100000000
+#define SENSOR_RATE_HZ 225
+#define TURNS_PER_SECOND 0.2
+#define CLOCK_DRIFT_PPM 50
+
+static const Rotation identity = {1, 0, 0, 0};
+
+static Rotation multiply(const Rotation &left, const Rotation &right)
+{
+    return {
+        left.w * right.w - left.x * right.x - left.y * right.y - left.z * right.z,
+        left.w * right.x + left.x * right.w + left.y * right.z - left.z * right.y,
+        left.w * right.y - left.x * right.z + left.y * right.w + left.z * right.x,
+        left.w * right.z + left.x * right.y - left.y * right.x + left.z * right.w,
+    };
+}
+
+/* Same as quaternion_compact() */
+static void compact(const Rotation &rotation, uint8_t *data)
+{
+    const double components[4] = {rotation.w, rotation.x, rotation.y, rotation.z};
+    int largest = 0;
+    for (int index = 1; index < 4; ++index) {
+        if (std::fabs(components[index]) > std::fabs(components[largest])) {
+            largest = index;
+        }
+    }
+    const double sign = components[largest] < 0 ? -1 : 1;
+    uint64_t packed = largest;
+    int shift = 2;
+    for (int index = 0; index < 4; ++index) {
+        if (index == largest) {
+            continue;
+        }
+        const double value = sign * components[index] + M_SQRT1_2;
+        const uint64_t quantized = value <= 0 ? 0 : std::min<long>(std::lround(value * 32767 / M_SQRT2), 32767);
+        packed |= quantized << shift;
+        shift += 15;
+    }
+    for (int byte = 0; byte < 6; ++byte) {
+        data[byte] = packed >> (8 * byte);
+    }
+}
+
+/* Same as crc16() of bootloader */
+static uint32_t crc16(uint32_t crc, const uint8_t *data, size_t length)
+{
+    for (size_t byte = 0; byte < length; ++byte) {
+        crc ^= data[byte] << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc & 0xFFFF;
+}
+
+static bool isSelected(uint64_t idBitmap, uint8_t id)
+{
+    return id < 64 && (idBitmap & (1ULL << id));
+}
+
+static uint32_t countSelected(uint64_t idBitmap, uint8_t belowID)
+{
+    uint32_t count = 0;
+    for (uint8_t anID = 0; anID < belowID; ++anID) {
+        if (isSelected(idBitmap, anID)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+static uint64_t readBitmap(const uint8_t *data)
+{
+    uint64_t bitmap = 0;
+    for (int byte = 0; byte < 8; ++byte) {
+        bitmap |= (uint64_t)data[byte] << (8 * byte);
+    }
+    return bitmap;
+}
+
+/* Returns the length of parameters, or -1 for unknown commands */
+static int parameterLength(bool isBroadcast, uint8_t command)
+{
+    if (isBroadcast) {
+        switch (command) {
+            case Command_Read_All_Quaternions: return 9;
+            case Command_Start_Streaming: return 11;
+            case Command_Program_All: return 9;
+            case Command_Patch_All: return 9;
+            case Command_Stop_Streaming: return 0;
+            case Command_Latch: return 0;
+            case Command_Sync: return 4;
+            default: return -1;
+        }
+    }
+    switch (command) {
+        case Command_Ping: return 0;
+        case Command_Read_Quaternion: return 0;
+        case Command_Set_Chip_Offset: return 0;
+        case Command_Set_Unity_Offset: return 16;
+        case Command_Set_Axis: return 1;
+        case Command_Set_ID: return 1;
+        case Command_Flash: return 0;
+        case Command_Program: return 1;
+        case Command_Read_Compass_Accuracy: return 0;
+        case Command_Set_Format: return 1;
+        case Command_Read_Page_CRCs: return 1;
+        case Command_Set_Fast_Boot: return 1;
+        case Command_Read_DMP_Status: return 0;
+        case Command_Resume_DMP: return 0;
+        case Command_Set_Rate: return 1;
+        case Command_Read_History: return 2;
+        case Command_Read_Stamped_Quaternion: return 0;
+        case Command_Read_Latched_Quaternion: return 0;
+        default: return -1;
+    }
+}
+
+static int64_t samplePeriodOf(uint8_t rate)
+{
+    static const int64_t dividers[] = {3, 4, 2, 1}; /* rate_t */
+    return dividers[rate] * 1000000000LL / SENSOR_RATE_HZ;
+}
+
+Node::Node(Simulator &simulator, uint32_t index, uint8_t id, const std::vector<uint8_t> &image)
+    : simulator(simulator), index(index), transmittingUntil(0), timerGeneration(0),
+      dmpMemory(DMP_FIRMWARE_LENGTH), image(PROGRAM_MAX_PAGES * 64, 0xFF), bootUntil(0),
+      blockBuffer(PROGRAM_BLOCK_PAGES * PROGRAM_UNIT_LENGTH)
+{
+    flashed = {id, 1, 0, 1, 1, 1, 2, Format_Float, 0, Rate_75Hz};
+    std::copy(image.begin(), image.begin() + std::min(image.size(), this->image.size()), this->image.begin());
+    /* Node has been configured after the image was written */
+    storeSettings();
+    /* Local clocks start at random and drift a little */
+    clockOrigin = -(int64_t)index * 123456789;
+    clockRate = TIMESTAMP_CLOCK_HZ / 1e9 * (1 + (int)(index * 37 % (2 * CLOCK_DRIFT_PPM + 1) - CLOCK_DRIFT_PPM) * 1e-6);
+    startApplication(0);
+    if (simulator.config().isDMPRunning) {
+        enableDMP(0);
+    }
+}
+
+void Node::receive(uint8_t byte, int64_t time)
+{
+    switch (mode) {
+        case Mode_Booting:
+            receiveBooting(byte, time);
+            return;
+
+        case Mode_Programming:
+            receiveProgramming(byte, time);
+            return;
+
+        case Mode_Programming_All:
+            receiveProgrammingAll(byte, time);
+            return;
+
+        case Mode_Application:
+            break;
+    }
+    /* Same as UART0_IRQHandler, ID right after the header is not encoded */
+    if (byte == PACKET_HEADER) {
+        isIDNext = true;
+        receiveDecoded(byte, true, time);
+        return;
+    }
+    if (isIDNext) {
+        isIDNext = false;
+        quiks_decoder_reset(&decoder);
+        receiveDecoded(byte, false, time);
+        return;
+    }
+    uint8_t decoded;
+    if (quiks_decode(&decoder, byte, &decoded)) {
+        receiveDecoded(decoded, false, time);
+    }
+}
+
+bool Node::isWatchingBus() const
+{
+    /* Only replies of other nodes can be in progress */
+    return state == State_Waiting_For_Header
+        || state == State_Waiting_For_ID
+        || state == State_Waiting_For_Reply_Command
+        || state == State_Waiting_For_Reply_Node_ID;
+}
+
+void Node::receiveDecoded(uint8_t byte, bool isHeader, int64_t time)
+{
+    switch (state) {
+        case State_Waiting_For_Header:
+            if (isHeader && ! simulator.isLost()) {
+                headerTimestamp = localClock(time);
+                state = State_Waiting_For_ID;
+            }
+            break;
+
+        case State_Waiting_For_ID:
+            if (byte == DMP_UPLOAD_ID && ! isDMPFirmwareDownloaded) {
+                state = State_Downloading_DMP;
+                dmpStream.clear();
+                dmpBitPosition = 0;
+                dmpDecoded = 0;
+            } else if (byte == retained.id) {
+                isBroadcast = false;
+                state = State_Waiting_For_Command;
+            } else if (byte == BROADCAST_ID) {
+                isBroadcast = true;
+                state = State_Waiting_For_Command;
+            } else if (byte == 0 && streamingMasterID != 0) {
+                /* Watch replies for the master of streaming */
+                state = State_Waiting_For_Reply_Command;
+            } else {
+                state = State_Waiting_For_Header;
+                receiveDecoded(byte, isHeader, time);
+            }
+            break;
+
+        case State_Waiting_For_Command: {
+            const int length = parameterLength(isBroadcast, byte);
+            if (length < 0) {
+                state = State_Waiting_For_Header;
+                receiveDecoded(byte, isHeader, time);
+                break;
+            }
+            command = byte;
+            numParameters = 0;
+            expectedParameters = length;
+            if (length == 0) {
+                handleCommand(time);
+            } else {
+                state = State_Waiting_For_Parameters;
+            }
+            break;
+        }
+
+        case State_Waiting_For_Parameters:
+            /* Like the firmware, a header of the next packet is taken as a parameter */
+            parameters[numParameters++] = byte;
+            if (numParameters == expectedParameters) {
+                handleCommand(time);
+            }
+            break;
+
+        case State_Waiting_For_Reply_Command:
+            if (byte == Command_Reply_Node_Quaternion || byte == Command_Reply_Compact_Quaternion) {
+                state = State_Waiting_For_Reply_Node_ID;
+            } else {
+                state = State_Waiting_For_Header;
+                receiveDecoded(byte, isHeader, time);
+            }
+            break;
+
+        case State_Waiting_For_Reply_Node_ID:
+            if (byte == streamingMasterID && streamingMasterID != retained.id) {
+                state = State_Waiting_For_Slot;
+                startTimer(time + streamingSlotDelay, 0);
+            } else {
+                state = State_Waiting_For_Header;
+                receiveDecoded(byte, isHeader, time);
+            }
+            break;
+
+        case State_Downloading_DMP:
+            receiveDMP(byte, time);
+            break;
+
+        case State_Waiting_For_Slot:
+        case State_Busy:
+            break;
+    }
+}
+
+void Node::handleCommand(int64_t time)
+{
+    const int64_t start = time + simulator.config().turnaroundUS * NS_PER_US;
+    state = State_Waiting_For_Header;
+    switch (command) {
+        case Command_Ping:
+            replyAck(start);
+            break;
+
+        case Command_Read_Quaternion:
+            replyQuaternion(start, false);
+            break;
+
+        case Command_Set_Chip_Offset: {
+            Sample sample;
+            if (latestSample(time, &sample)) {
+                const Rotation chip = chipRotation(sample.time);
+                chipOffset = {chip.w, -chip.x, -chip.y, -chip.z};
+            } else {
+                /* Quaternion of the chip is still zero */
+                chipOffset = {0, 0, 0, 0};
+            }
+            replyAck(start);
+            break;
+        }
+
+        case Command_Set_Unity_Offset: {
+            int32_t values[4];
+            std::memcpy(values, parameters, sizeof(values));
+            unityOffset = {values[0] / 1073741824.0, values[1] / 1073741824.0,
+                           values[2] / 1073741824.0, values[3] / 1073741824.0};
+            replyAck(start);
+            break;
+        }
+
+        case Command_Set_Axis:
+            retained.xSign = (parameters[0] & (1 << 0)) ? -1 : 1;
+            retained.xIndex = (parameters[0] >> 1) & 0b11;
+            retained.ySign = (parameters[0] & (1 << 3)) ? -1 : 1;
+            retained.yIndex = (parameters[0] >> 4) & 0b11;
+            retained.zSign = (parameters[0] & (1 << 6)) ? -1 : 1;
+            retained.zIndex = 3 - retained.xIndex - retained.yIndex;
+            replyAck(start);
+            break;
+
+        case Command_Set_ID:
+            retained.id = parameters[0];
+            replyAck(start);
+            break;
+
+        case Command_Flash:
+            state = State_Busy;
+            if (isDMPFirmwareDownloaded) {
+                /* Main loop only flashes before DMP is enabled, so the firmware never replies */
+                break;
+            }
+            flashed = retained;
+            storeSettings();
+            replyAck(start + FLASH_WRITE_NS);
+            break;
+
+        case Command_Program:
+            startProgramming(start, parameters[0]);
+            break;
+
+        case Command_Read_Compass_Accuracy: {
+            const uint8_t packet[] = {Command_Reply_Compass_Accuracy, compassAccuracy};
+            reply(start, packet, sizeof(packet));
+            break;
+        }
+
+        case Command_Set_Format:
+            retained.format = parameters[0] == Format_Compact ? Format_Compact : Format_Float;
+            replyAck(start);
+            break;
+
+        case Command_Read_Page_CRCs: {
+            uint8_t packet[2 + 2 * PAGE_CRCS_PER_REPLY] = {Command_Reply_Page_CRCs, parameters[0]};
+            for (uint32_t crcIndex = 0; crcIndex < PAGE_CRCS_PER_REPLY; ++crcIndex) {
+                const uint32_t page = parameters[0] + crcIndex;
+                const uint32_t crc = page < PROGRAM_MAX_PAGES ? crc16(0xFFFF, &image[page * 64], 64) : 0;
+                packet[2 + 2 * crcIndex] = crc;
+                packet[3 + 2 * crcIndex] = crc >> 8;
+            }
+            reply(start + PAGE_CRCS_NS, packet, sizeof(packet));
+            break;
+        }
+
+        case Command_Set_Fast_Boot:
+            retained.fastBoot = parameters[0] ? 1 : 0;
+            replyAck(start);
+            break;
+
+        case Command_Read_DMP_Status:
+            if (isDMPFirmwareDownloaded) {
+                const uint8_t packet[] = {Command_Reply_DMP_Status, DMP_Status_Running, 0, 0};
+                reply(start, packet, sizeof(packet));
+            } else {
+                /* Same as ICM20948_dmp_crc() */
+                static const uint8_t volatileChunks[] = DMP_VOLATILE_CHUNKS;
+                const uint8_t * const end = volatileChunks + sizeof(volatileChunks);
+                uint32_t crc = 0xFFFF;
+                for (size_t chunk = 0; chunk * 16 < dmpMemory.size(); ++chunk) {
+                    if (std::find(volatileChunks, end, chunk) == end) {
+                        crc = crc16(crc, &dmpMemory[chunk * 16], std::min<size_t>(16, dmpMemory.size() - chunk * 16));
+                    }
+                }
+                const uint8_t packet[] = {Command_Reply_DMP_Status, DMP_Status_Waiting, (uint8_t)crc, (uint8_t)(crc >> 8)};
+                reply(start + DMP_READ_BACK_NS, packet, sizeof(packet));
+            }
+            break;
+
+        case Command_Resume_DMP:
+            if (isDMPFirmwareDownloaded) {
+                replyAck(start);
+            } else {
+                /* Host waits for acknowledge until DMP is enabled */
+                enableDMP(time + DMP_ENABLE_NS);
+                replyAck(start + DMP_ENABLE_NS);
+            }
+            break;
+
+        case Command_Set_Rate:
+            if (parameters[0] > Rate_225Hz) {
+                replyAck(start, false);
+                break;
+            }
+            retained.rate = parameters[0];
+            setRate(time, parameters[0]);
+            replyAck(start);
+            break;
+
+        case Command_Read_History: {
+            uint16_t sequence = parameters[0] | (parameters[1] << 8);
+            Sample sample;
+            const int64_t latestIndex = latestSample(time, &sample) ? sampleIndex(sample) : -1;
+            const uint16_t historySequence = latestIndex + 1;
+            const uint16_t recorded = std::min<int64_t>(latestIndex + 1, HISTORY_LENGTH);
+            uint16_t count = historySequence - sequence;
+            if (count > recorded) {
+                count = recorded;
+                sequence = historySequence - recorded;
+            }
+            uint8_t packet[4 + HISTORY_LENGTH * 6] = {Command_Reply_History, (uint8_t)sequence, (uint8_t)(sequence >> 8), (uint8_t)count};
+            for (uint32_t offset = 0; offset < count; ++offset) {
+                makeSample(latestIndex - (count - 1 - offset), &sample);
+                std::memcpy(&packet[4 + 6 * offset], sample.data, 6);
+            }
+            reply(start, packet, 4 + 6 * count);
+            break;
+        }
+
+        case Command_Read_Stamped_Quaternion: {
+            uint8_t packet[13] = {Command_Reply_Stamped_Quaternion};
+            Sample sample;
+            if (latestSample(time, &sample)) {
+                const uint32_t timestamp = synchronizedTime(localClock(sample.time));
+                packet[1] = sample.sequence;
+                packet[2] = sample.sequence >> 8;
+                std::memcpy(&packet[3], &timestamp, 4);
+                std::memcpy(&packet[7], sample.data, 6);
+            }
+            reply(start, packet, sizeof(packet));
+            break;
+        }
+
+        case Command_Read_Latched_Quaternion: {
+            uint8_t packet[12] = {Command_Reply_Latched_Quaternion, retained.id,
+                                  (uint8_t)latchedSequence, (uint8_t)(latchedSequence >> 8),
+                                  (uint8_t)latchedAge, (uint8_t)(latchedAge >> 8)};
+            std::memcpy(&packet[6], latchedData, 6);
+            reply(start, packet, sizeof(packet));
+            break;
+        }
+
+        case Command_Read_All_Quaternions: {
+            const uint64_t idBitmap = readBitmap(parameters);
+            if (! isSelected(idBitmap, retained.id)) {
+                break;
+            }
+            const int64_t slotTime = simulator.byteTime(parameters[8]) + BROADCAST_GUARD_US * NS_PER_US;
+            state = State_Waiting_For_Slot;
+            startTimer(time + BROADCAST_GUARD_US * NS_PER_US + countSelected(idBitmap, retained.id) * slotTime, 0);
+            break;
+        }
+
+        case Command_Start_Streaming: {
+            const uint64_t idBitmap = readBitmap(parameters);
+            if (! isSelected(idBitmap, retained.id)) {
+                streamingMasterID = 0;
+                stopTimer();
+                break;
+            }
+            const uint32_t slot = countSelected(idBitmap, retained.id);
+            const uint32_t numSlots = countSelected(idBitmap, 64) + 1; /* Last slot is for host */
+            const int64_t slotTime = simulator.byteTime(parameters[8]) + BROADCAST_GUARD_US * NS_PER_US;
+            const int64_t period = std::max<int64_t>((parameters[9] | (parameters[10] << 8)) * NS_PER_US, numSlots * slotTime);
+            uint8_t masterID = 0;
+            while (! isSelected(idBitmap, masterID)) {
+                ++masterID;
+            }
+            streamingMasterID = masterID;
+            if (slot == 0) {
+                /* Master sends by its own clock and others follow it */
+                startTimer(time + period, period);
+            } else {
+                /* Reply of master is detected at its 5th byte (node ID after COBS code) */
+                streamingSlotDelay = slot * slotTime - simulator.byteTime(5);
+            }
+            break;
+        }
+
+        case Command_Program_All:
+        case Command_Patch_All:
+            if (isSelected(readBitmap(parameters), retained.id)) {
+                startProgrammingAll(parameters[8], command == Command_Patch_All);
+            }
+            break;
+
+        case Command_Stop_Streaming:
+            streamingMasterID = 0;
+            stopTimer();
+            break;
+
+        case Command_Latch: {
+            Sample sample;
+            if (latestSample(time, &sample)) {
+                const uint32_t ageUS = ((localClock(time) - localClock(sample.time)) & 0x7FFFFFFF) / (TIMESTAMP_CLOCK_HZ / 1000000);
+                latchedSequence = sample.sequence;
+                latchedAge = ageUS > 0xFFFF ? 0xFFFF : ageUS;
+                std::memcpy(latchedData, sample.data, 6);
+            } else {
+                latchedAge = 0xFFFF;
+            }
+            break;
+        }
+
+        case Command_Sync: {
+            uint32_t hostTime;
+            std::memcpy(&hostTime, parameters, 4);
+            synchronizeClock(headerTimestamp, hostTime);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void Node::receiveDMP(uint8_t byte, int64_t time)
+{
+    /* LZSS tokens are read MSB first, see Protocol.h */
+    dmpStream.push_back(byte);
+    const auto readBits = [this](int count) {
+        uint32_t value = 0;
+        for (int bit = 0; bit < count; ++bit, ++dmpBitPosition) {
+            value = (value << 1) | ((dmpStream[dmpBitPosition / 8] >> (7 - dmpBitPosition % 8)) & 1);
+        }
+        return value;
+    };
+    while (dmpDecoded < DMP_FIRMWARE_LENGTH) {
+        const size_t available = dmpStream.size() * 8 - dmpBitPosition;
+        if (available < 1) {
+            return;
+        }
+        const bool isLiteral = (dmpStream[dmpBitPosition / 8] >> (7 - dmpBitPosition % 8)) & 1;
+        if (available < (isLiteral ? 9U : 13U)) {
+            return;
+        }
+        ++dmpBitPosition;
+        if (isLiteral) {
+            dmpMemory[dmpDecoded++] = readBits(8);
+            continue;
+        }
+        const size_t distance = readBits(8) + 1;
+        uint32_t count = readBits(4) + 2;
+        for (; count && dmpDecoded < DMP_FIRMWARE_LENGTH; --count, ++dmpDecoded) {
+            dmpMemory[dmpDecoded] = distance <= dmpDecoded ? dmpMemory[dmpDecoded - distance] : 0;
+        }
+    }
+    /* Padding of the stream is ignored while DMP is being enabled */
+    isDMPFirmwareDownloaded = true;
+    state = State_Busy;
+    simulator.schedule(time + DMP_ENABLE_NS, [this, time]() {
+        enableDMP(time + DMP_ENABLE_NS);
+        state = State_Waiting_For_Header;
+    });
+}
+
+void Node::reply(int64_t start, const uint8_t *data, size_t length)
+{
+    uint8_t packet[2 + QUIKS_MAX_REPLY_LENGTH + QUIKS_MAX_REPLY_LENGTH / 253 + 1];
+    packet[0] = PACKET_HEADER;
+    packet[1] = 0;
+    const size_t encoded = quiks_encode(data, length, &packet[2]);
+    state = State_Busy;
+    const int64_t end = sendRaw(start, packet, 2 + encoded);
+    simulator.schedule(end, [this]() {
+        if (mode == Mode_Application && state == State_Busy) {
+            state = State_Waiting_For_Header;
+        }
+    });
+}
+
+void Node::replyAck(int64_t start, bool isSucceeded)
+{
+    const uint8_t packet[] = {Command_Reply_Ack, (uint8_t)(isSucceeded ? 1 : 0)};
+    reply(start, packet, sizeof(packet));
+}
+
+void Node::replyQuaternion(int64_t start, bool hasNodeID)
+{
+    Sample sample;
+    const bool hasSample = latestSample(start, &sample);
+    if (retained.format == Format_Compact) {
+        uint8_t packet[8] = {Command_Reply_Compact_Quaternion, retained.id};
+        if (hasSample) {
+            std::memcpy(&packet[2], sample.data, 6);
+        }
+        reply(start, packet, sizeof(packet));
+        return;
+    }
+    uint8_t packet[18] = {hasNodeID ? (uint8_t)Command_Reply_Node_Quaternion : (uint8_t)Command_Reply_Quaternion, retained.id};
+    if (hasSample) {
+        const float components[4] = {(float)sample.rotation.w, (float)sample.rotation.x,
+                                     (float)sample.rotation.y, (float)sample.rotation.z};
+        std::memcpy(&packet[hasNodeID ? 2 : 1], components, sizeof(components));
+    }
+    reply(start, packet, hasNodeID ? 18 : 17);
+}
+
+int64_t Node::sendRaw(int64_t start, const uint8_t *data, size_t length)
+{
+    transmittingUntil = simulator.transmit(this, std::max(start, transmittingUntil), data, length);
+    return transmittingUntil;
+}
+
+void Node::startTimer(int64_t time, int64_t interval)
+{
+    const uint32_t generation = ++timerGeneration;
+    simulator.schedule(time, [this, generation, time, interval]() {
+        timerFired(generation, time, interval);
+    });
+}
+
+void Node::stopTimer()
+{
+    ++timerGeneration;
+}
+
+void Node::timerFired(uint32_t generation, int64_t time, int64_t interval)
+{
+    if (generation != timerGeneration || mode != Mode_Application) {
+        return;
+    }
+    if (interval) {
+        simulator.schedule(time + interval, [this, generation, time, interval]() {
+            timerFired(generation, time + interval, interval);
+        });
+    }
+    /* Same as MRT_IRQHandler */
+    if (state == State_Waiting_For_Slot || (streamingMasterID == retained.id && isWatchingBus())) {
+        replyQuaternion(time, true);
+    }
+}
+
+void Node::startProgramming(int64_t start, uint8_t numUsedPages)
+{
+    /* rs485_program_flash_impl() */
+    mode = Mode_Programming;
+    streamingMasterID = 0;
+    stopTimer();
+    hasSavedSettings = retainedPage() >= 0;
+    this->numUsedPages = numUsedPages;
+    firstPage = 0;
+    numPages = std::min<uint32_t>(numUsedPages, PROGRAM_BLOCK_PAGES);
+    receivedPages = 0;
+    blockBytes = 0;
+    loaderState = LoaderState_Receiving_Units;
+    const uint8_t ready = 1;
+    const int64_t end = sendRaw(start, &ready, 1);
+    if (numUsedPages == 0) {
+        loaderState = LoaderState_Writing;
+        finishProgramming(end);
+    }
+}
+
+void Node::receiveProgramming(uint8_t byte, int64_t time)
+{
+    if (loaderState != LoaderState_Receiving_Units) {
+        /* Interrupts are disabled while writing, so the bytes are lost */
+        return;
+    }
+    blockBuffer[blockBytes++] = byte;
+    if (blockBytes < numPages * PROGRAM_UNIT_LENGTH) {
+        return;
+    }
+    /* Page k is decoded to (64 * k), which never overtakes unit k or later */
+    while (receivedPages < numPages
+           && decodeUnit(&blockBuffer[receivedPages * PROGRAM_UNIT_LENGTH], &blockBuffer[receivedPages * 64])) {
+        ++receivedPages;
+    }
+    const int64_t start = time + simulator.config().turnaroundUS * NS_PER_US;
+    if (receivedPages < numPages) {
+        /* Host resends from the first broken page */
+        const uint8_t resend = receivedPages;
+        sendRaw(start, &resend, 1);
+        blockBytes = receivedPages * PROGRAM_UNIT_LENGTH;
+        return;
+    }
+    loaderState = LoaderState_Writing;
+    writePages(firstPage, numPages, ~0U);
+    const int64_t written = start + ERASE_NS + numPages * PAGE_WRITE_NS;
+    simulator.schedule(written, [this, written]() {
+        /* Acknowledge the whole block, then host sends next one */
+        const uint8_t acknowledge = numPages;
+        const int64_t end = sendRaw(written, &acknowledge, 1);
+        firstPage += PROGRAM_BLOCK_PAGES;
+        if (firstPage >= numUsedPages) {
+            finishProgramming(end);
+            return;
+        }
+        numPages = std::min<uint32_t>(numUsedPages - firstPage, PROGRAM_BLOCK_PAGES);
+        receivedPages = 0;
+        blockBytes = 0;
+        loaderState = LoaderState_Receiving_Units;
+    });
+}
+
+void Node::startProgrammingAll(uint8_t numUsedPages, bool isPatch)
+{
+    /* rs485_program_flash_all() */
+    mode = Mode_Programming_All;
+    streamingMasterID = 0;
+    stopTimer();
+    hasSavedSettings = retainedPage() >= 0;
+    this->numUsedPages = numUsedPages;
+    this->isPatch = isPatch;
+    std::memset(missingPages, 0, sizeof(missingPages));
+    /* Patch only sends pages changed from the current image */
+    for (uint32_t page = 0; page < numUsedPages && ! isPatch; ++page) {
+        missingPages[page / 7] |= 1 << (page % 7);
+    }
+    loaderState = LoaderState_Waiting_For_Header;
+}
+
+void Node::receiveProgrammingAll(uint8_t byte, int64_t time)
+{
+    /* Silently follow packets of <Header> <BROADCAST_ID> <Code = 3> <Command> <Parameter> */
+    switch (loaderState) {
+        case LoaderState_Waiting_For_Header:
+            if (byte == PACKET_HEADER && ! simulator.isLost()) {
+                loaderState = LoaderState_Waiting_For_ID;
+            }
+            return;
+
+        case LoaderState_Waiting_For_ID:
+            loaderState = byte == BROADCAST_ID ? LoaderState_Waiting_For_Code : LoaderState_Waiting_For_Header;
+            return;
+
+        case LoaderState_Waiting_For_Code:
+            loaderState = LoaderState_Waiting_For_Command;
+            return;
+
+        case LoaderState_Waiting_For_Command:
+            loaderCommand = byte;
+            loaderState = LoaderState_Waiting_For_Parameter;
+            return;
+
+        case LoaderState_Receiving_Units:
+            if (byte == PACKET_HEADER) {
+                /* Some bytes are lost and next packet started */
+                loaderState = LoaderState_Waiting_For_ID;
+                return;
+            }
+            blockBuffer[blockBytes++] = byte;
+            if (blockBytes == numPages * PROGRAM_UNIT_LENGTH) {
+                writeUnits(time);
+            }
+            return;
+
+        case LoaderState_Writing:
+            return;
+
+        case LoaderState_Waiting_For_Parameter:
+            break;
+    }
+
+    loaderState = LoaderState_Waiting_For_Header;
+    firstPage = byte;
+    numPages = 1;
+    switch (loaderCommand) {
+        case Command_Program_Block:
+            firstPage = byte * PROGRAM_BLOCK_PAGES;
+            numPages = firstPage < numUsedPages ? std::min<uint32_t>(numUsedPages - firstPage, PROGRAM_BLOCK_PAGES) : 0;
+            /* Fall through */
+        case Command_Resend_Page:
+            if (firstPage < numUsedPages) {
+                blockBytes = 0;
+                loaderState = LoaderState_Receiving_Units;
+            }
+            break;
+
+        case Command_Read_Program_Status: {
+            if (byte != retained.id) {
+                break;
+            }
+            /* Bytes of missingPages never be 0xFF, so COBS encoding is just a code */
+            uint8_t packet[4 + PROGRAM_STATUS_LENGTH] = {PACKET_HEADER, 0, PROGRAM_STATUS_LENGTH + 2, Command_Reply_Program_Status};
+            std::memcpy(&packet[4], missingPages, PROGRAM_STATUS_LENGTH);
+            sendRaw(time + simulator.config().turnaroundUS * NS_PER_US, packet, sizeof(packet));
+            break;
+        }
+
+        case Command_Finish_Program:
+            loaderState = LoaderState_Writing;
+            finishProgramming(time);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void Node::writeUnits(int64_t time)
+{
+    uint32_t pageMask = 0;
+    for (uint32_t page = 0; page < numPages; ++page) {
+        uint8_t * const missingByte = &missingPages[(firstPage + page) / 7];
+        const uint8_t missingBit = 1 << ((firstPage + page) % 7);
+        if (loaderCommand == Command_Program_Block || isPatch) {
+            /* Whole block is erased below, even the pages already written */
+            /* Patch writes every page sent, which stays missing if broken */
+            *missingByte |= missingBit;
+        }
+        if ((*missingByte & missingBit)
+            && decodeUnit(&blockBuffer[page * PROGRAM_UNIT_LENGTH], &blockBuffer[page * 64])) {
+            pageMask |= 1U << page;
+            *missingByte &= ~missingBit;
+        }
+    }
+    if (pageMask == 0) {
+        loaderState = LoaderState_Waiting_For_Header;
+        return;
+    }
+    writePages(firstPage, numPages, pageMask);
+    loaderState = LoaderState_Writing;
+    int64_t written = time + ERASE_NS;
+    for (uint32_t bits = pageMask; bits; bits &= bits - 1) {
+        written += PAGE_WRITE_NS;
+    }
+    simulator.schedule(written, [this]() {
+        if (mode == Mode_Programming_All && loaderState == LoaderState_Writing) {
+            loaderState = LoaderState_Waiting_For_Header;
+        }
+    });
+}
+
+void Node::writePages(uint32_t firstPage, uint32_t numPages, uint32_t pageMask)
+{
+    /* Pages are erased at once, and the ones in pageMask are written */
+    for (uint32_t page = 0; page < numPages && firstPage + page < PROGRAM_MAX_PAGES; ++page) {
+        uint8_t * const flash = &image[(firstPage + page) * 64];
+        if (pageMask & (1U << page)) {
+            std::memcpy(flash, &blockBuffer[page * 64], 64);
+        } else {
+            std::memset(flash, 0xFF, 64);
+        }
+    }
+}
+
+int Node::retainedPage() const
+{
+    /* Same as retained_data() of bootloader, image starts with the address of the vector table */
+    const auto word = [this](uint32_t offset) {
+        return (uint32_t)(image[offset] | (image[offset + 1] << 8) | (image[offset + 2] << 16) | (image[offset + 3] << 24));
+    };
+    /* Erased flash (0xFFFFFFFF) is out of range */
+    const uint32_t vectors = word(0) - PROGRAM_FLASH_ORIGIN;
+    if (vectors > image.size() - 4 * (PROGRAM_RETAINED_VECTOR + 1)) {
+        return -1;
+    }
+    const uint32_t retainedData = word(vectors + 4 * PROGRAM_RETAINED_VECTOR) - PROGRAM_FLASH_ORIGIN;
+    if (retainedData >= image.size() || retainedData % 64 != 0) {
+        return -1;
+    }
+    return retainedData / 64;
+}
+
+void Node::storeSettings()
+{
+    const int page = retainedPage();
+    if (page >= 0) {
+        std::memcpy(&image[page * 64], &flashed, sizeof(flashed));
+    }
+}
+
+void Node::finishProgramming(int64_t time)
+{
+    /* finish_program(), settings of the old image are written over the defaults of the new one */
+    const int page = retainedPage();
+    if (page >= 0 && ! hasSavedSettings) {
+        std::memcpy(&flashed, &image[page * 64], sizeof(flashed));
+    }
+    /* Nodes without retained settings in either image just keep theirs, as simulated nodes need IDs */
+    flashed.fastBoot = 0;
+    if (page >= 0 && hasSavedSettings) {
+        storeSettings();
+        time += FLASH_WRITE_NS;
+    }
+    reboot(time);
+}
+
+bool Node::decodeUnit(uint8_t *unit, uint8_t *page) const
+{
+    /* Same as decode_unit(), page may overlap unit as long as it does not start after unit */
+    uint32_t encoded = 0;
+    uint32_t decoded = 0;
+    while (true) {
+        const uint32_t code = unit[encoded++];
+        for (uint32_t byte = 1; byte < code && encoded < PROGRAM_UNIT_LENGTH; ++byte) {
+            page[decoded++] = unit[encoded++];
+        }
+        if (encoded >= PROGRAM_UNIT_LENGTH || decoded >= 66) {
+            break;
+        }
+        page[decoded++] = PACKET_HEADER;
+    }
+    return decoded >= 66 && crc16(0xFFFF, page, 64) == (uint32_t)(page[64] | (page[65] << 8));
+}
+
+void Node::receiveBooting(uint8_t byte, int64_t time)
+{
+    /* Firmware update packet: 0x46 0x93 <Number of pages> */
+    switch (magicCount) {
+        case 0:
+            magicCount = byte == 0x46 ? 1 : 0;
+            break;
+
+        case 1:
+            magicCount = byte == 0x93 ? 2 : 0;
+            break;
+
+        default:
+            magicCount = 0;
+            startProgramming(time + simulator.config().turnaroundUS * NS_PER_US, byte);
+            break;
+    }
+}
+
+void Node::reboot(int64_t time)
+{
+    mode = Mode_Booting;
+    magicCount = 0;
+    isDMPFirmwareDownloaded = false;
+    const int64_t until = time + (flashed.fastBoot ? FAST_BOOT_WAIT_NS : BOOT_WAIT_NS);
+    bootUntil = until;
+    simulator.schedule(until, [this, until]() {
+        if (mode == Mode_Booting && bootUntil == until) {
+            startApplication(until);
+        }
+    });
+}
+
+void Node::startApplication(int64_t time)
+{
+    (void)time;
+    mode = Mode_Application;
+    state = State_Waiting_For_Header;
+    isIDNext = false;
+    quiks_decoder_reset(&decoder);
+    retained = flashed;
+    streamingMasterID = 0;
+    stopTimer();
+    isDMPFirmwareDownloaded = false;
+    chipOffset = identity;
+    unityOffset = identity;
+    compassAccuracy = 0;
+    headerTimestamp = 0;
+    clockBaseTimestamp = 0;
+    clockBaseTime = 0;
+    clockScale = (1U << 24) / (TIMESTAMP_CLOCK_HZ / 1000000);
+    lastSyncTimestamp = 0;
+    lastSyncHostTime = 0;
+    isClockSynchronized = false;
+    latchedSequence = 0;
+    latchedAge = 0;
+    std::memset(latchedData, 0, sizeof(latchedData));
+}
+
+void Node::enableDMP(int64_t time)
+{
+    isDMPFirmwareDownloaded = true;
+    compassAccuracy = 3;
+    samplePeriod = samplePeriodOf(retained.rate);
+    /* Nodes are not in phase */
+    sampleBase = time + (int64_t)index * 1234567 % samplePeriod;
+    sampleBaseIndex = 0;
+}
+
+void Node::setRate(int64_t time, uint8_t rate)
+{
+    if (! isDMPFirmwareDownloaded) {
+        return;
+    }
+    Sample sample;
+    if (latestSample(time, &sample)) {
+        /* Next sample comes a new period after the latest one */
+        const int64_t latestIndex = sampleIndex(sample);
+        sampleBase = sample.time;
+        sampleBaseIndex = latestIndex;
+    }
+    samplePeriod = samplePeriodOf(rate);
+}
+
+Rotation Node::chipRotation(int64_t time) const
+{
+    /* Turns around an axis of its own */
+    const double axisAngle = index * 2.39996; /* Golden angle spreads the axes */
+    const double axisLength = std::sqrt(1 + 0.25);
+    const double angle = 2 * M_PI * TURNS_PER_SECOND * time * 1e-9 + index;
+    const double sine = std::sin(angle / 2) / axisLength;
+    return {std::cos(angle / 2), std::cos(axisAngle) * sine, std::sin(axisAngle) * sine, 0.5 * sine};
+}
+
+bool Node::latestSample(int64_t time, Sample *sample) const
+{
+    if (! isDMPFirmwareDownloaded || time < sampleBase + SAMPLE_DELAY_NS) {
+        return false;
+    }
+    makeSample(sampleBaseIndex + (time - SAMPLE_DELAY_NS - sampleBase) / samplePeriod, sample);
+    return true;
+}
+
+int64_t Node::sampleIndex(const Sample &sample) const
+{
+    return sampleBaseIndex + (sample.time - sampleBase) / samplePeriod;
+}
+
+void Node::makeSample(int64_t sampleIndex, Sample *sample) const
+{
+    sample->sequence = sampleIndex;
+    sample->time = sampleBase + (sampleIndex - sampleBaseIndex) * samplePeriod;
+    /* Same as ICM20948_quaternion_callback() */
+    const Rotation chip = multiply(chipOffset, chipRotation(sample->time));
+    const double axis[3] = {chip.x, chip.y, chip.z};
+    const Rotation unity = {chip.w, retained.xSign * axis[retained.xIndex],
+                            retained.ySign * axis[retained.yIndex], retained.zSign * axis[retained.zIndex]};
+    sample->rotation = multiply(unity, unityOffset);
+    compact(sample->rotation, sample->data);
+}
+
+uint32_t Node::localClock(int64_t time) const
+{
+    return (uint32_t)(int64_t)((time - clockOrigin) * clockRate) & 0x7FFFFFFF;
+}
+
+uint32_t Node::synchronizedTime(uint32_t timestamp)
+{
+    /* Same as the firmware, local clock is 31bit */
+    int32_t elapsed = (int32_t)((timestamp - clockBaseTimestamp) << 1) >> 1;
+    if (elapsed > (1 << 29)) {
+        clockBaseTime += (uint32_t)(((uint64_t)elapsed * clockScale) >> 24);
+        clockBaseTimestamp = timestamp;
+        elapsed = 0;
+    }
+    return clockBaseTime + (int32_t)(((int64_t)elapsed * clockScale) >> 24);
+}
+
+void Node::synchronizeClock(uint32_t timestamp, uint32_t hostTime)
+{
+    const int32_t error = hostTime - synchronizedTime(timestamp);
+    if (! isClockSynchronized || error > 1000000 || error < -1000000) {
+        clockBaseTimestamp = timestamp;
+        clockBaseTime = hostTime;
+        clockScale = (1U << 24) / (TIMESTAMP_CLOCK_HZ / 1000000);
+        isClockSynchronized = true;
+    } else {
+        const uint32_t elapsed = (timestamp - lastSyncTimestamp) & 0x7FFFFFFF;
+        if (elapsed > TIMESTAMP_CLOCK_HZ / 10 && elapsed < (1U << 29)) {
+            const uint32_t measuredScale = ((uint64_t)(hostTime - lastSyncHostTime) << 24) / elapsed;
+            clockScale += (int32_t)(measuredScale - clockScale) / 4;
+        }
+        clockBaseTime = synchronizedTime(timestamp) + error / 2;
+        clockBaseTimestamp = timestamp;
+    }
+    lastSyncTimestamp = timestamp;
+    lastSyncHostTime = hostTime;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Node__
+#define __Node__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "quiks.h"
+#include "Protocol.h"
+
+class Simulator;
+
+struct Rotation {
+    double w;
+    double x;
+    double y;
+    double z;
+};
+
+/* IMUTracker on the bus, following main.c and bootloader.c byte by byte */
+/* The sensor turns around an axis of its own, and DMP outputs samples at the selected rate */
+class Node {
+public:
+    Node(Simulator &simulator, uint32_t index, uint8_t id, const std::vector<uint8_t> &image);
+
+    /* A byte on the bus ended at time, including the ones from other nodes */
+    void receive(uint8_t byte, int64_t time);
+
+private:
+    /* Same as flash_data_t */
+    struct Settings {
+        uint8_t id;
+        int8_t xSign;
+        uint8_t xIndex;
+        int8_t ySign;
+        uint8_t yIndex;
+        int8_t zSign;
+        uint8_t zIndex;
+        uint8_t format;
+        uint8_t fastBoot;
+        uint8_t rate;
+    };
+
+    struct Sample {
+        uint16_t sequence;
+        int64_t time; /* Of the interrupt from ICM20948 */
+        uint8_t data[6]; /* Compact quaternion in Unity coordinate */
+        Rotation rotation; /* The same in double */
+    };
+
+    enum Mode {
+        Mode_Booting, /* Bootloader waits for 0x46 0x93 */
+        Mode_Application,
+        Mode_Programming, /* rs485_program_flash_impl */
+        Mode_Programming_All, /* rs485_program_flash_all */
+    };
+
+    enum State {
+        State_Waiting_For_Header,
+        State_Waiting_For_ID,
+        State_Waiting_For_Command,
+        State_Waiting_For_Parameters,
+        State_Waiting_For_Slot,
+        State_Waiting_For_Reply_Command,
+        State_Waiting_For_Reply_Node_ID,
+        State_Downloading_DMP,
+        State_Busy, /* Replying, or working in the main loop */
+    };
+
+    enum LoaderState {
+        LoaderState_Waiting_For_Header,
+        LoaderState_Waiting_For_ID,
+        LoaderState_Waiting_For_Code,
+        LoaderState_Waiting_For_Command,
+        LoaderState_Waiting_For_Parameter,
+        LoaderState_Receiving_Units,
+        LoaderState_Writing,
+    };
+
+    bool isWatchingBus() const;
+    void receiveDecoded(uint8_t byte, bool isHeader, int64_t time);
+    void handleCommand(int64_t time);
+    void receiveDMP(uint8_t byte, int64_t time);
+
+    /* Replies <Header> <ID = 0> and encoded data, then waits for the next header */
+    void reply(int64_t start, const uint8_t *data, size_t length);
+    void replyAck(int64_t start, bool isSucceeded = true);
+    void replyQuaternion(int64_t start, bool hasNodeID);
+    /* Sends bytes as is after the previous ones, returns the time they end */
+    int64_t sendRaw(int64_t start, const uint8_t *data, size_t length);
+
+    /* MRT channel 0, repeated if interval is not 0 */
+    void startTimer(int64_t time, int64_t interval);
+    void stopTimer();
+    void timerFired(uint32_t generation, int64_t time, int64_t interval);
+
+    void startProgramming(int64_t start, uint8_t numUsedPages);
+    void receiveProgramming(uint8_t byte, int64_t time);
+    void startProgrammingAll(uint8_t numUsedPages, bool isPatch);
+    void receiveProgrammingAll(uint8_t byte, int64_t time);
+    void writeUnits(int64_t time);
+    void writePages(uint32_t firstPage, uint32_t numPages, uint32_t pageMask);
+    /* Page of the retained settings exported by the image, -1 if the image has none */
+    int retainedPage() const;
+    /* Writes flashed to the retained page, as flash_write() and finish_program() do */
+    void storeSettings();
+    void finishProgramming(int64_t time);
+    bool decodeUnit(uint8_t *unit, uint8_t *page) const;
+    void receiveBooting(uint8_t byte, int64_t time);
+    void reboot(int64_t time);
+    void startApplication(int64_t time);
+
+    void enableDMP(int64_t time);
+    void setRate(int64_t time, uint8_t rate);
+    Rotation chipRotation(int64_t time) const;
+    /* Latest sample processed by time, returns false if DMP has output nothing */
+    bool latestSample(int64_t time, Sample *sample) const;
+    int64_t sampleIndex(const Sample &sample) const;
+    void makeSample(int64_t sampleIndex, Sample *sample) const;
+    uint32_t localClock(int64_t time) const;
+    uint32_t synchronizedTime(uint32_t timestamp);
+    void synchronizeClock(uint32_t timestamp, uint32_t hostTime);
+
+    Simulator &simulator;
+    const uint32_t index;
+    Settings retained;
+    Settings flashed;
+    Mode mode;
+    State state;
+    quiks_decoder_t decoder;
+    bool isIDNext;
+    int64_t transmittingUntil;
+
+    bool isBroadcast;
+    uint8_t command;
+    uint8_t parameters[16];
+    size_t numParameters;
+    size_t expectedParameters;
+
+    uint32_t timerGeneration;
+    uint8_t streamingMasterID; /* 0 while not streaming */
+    int64_t streamingSlotDelay;
+
+    /* DMP outputs sample n at sampleBase + (n - sampleBaseIndex) * samplePeriod */
+    bool isDMPFirmwareDownloaded;
+    int64_t sampleBase;
+    int64_t sampleBaseIndex;
+    int64_t samplePeriod;
+    Rotation chipOffset;
+    Rotation unityOffset;
+    uint8_t compassAccuracy;
+    int64_t clockOrigin;
+    double clockRate; /* Ticks of local clock in ns, with drift */
+    std::vector<uint8_t> dmpMemory;
+    std::vector<uint8_t> dmpStream;
+    size_t dmpBitPosition;
+    size_t dmpDecoded;
+
+    uint32_t headerTimestamp;
+    uint32_t clockBaseTimestamp;
+    uint32_t clockBaseTime;
+    uint32_t clockScale;
+    uint32_t lastSyncTimestamp;
+    uint32_t lastSyncHostTime;
+    bool isClockSynchronized;
+    uint16_t latchedSequence;
+    uint16_t latchedAge;
+    uint8_t latchedData[6];
+
+    std::vector<uint8_t> image; /* From PROGRAM_FLASH_ORIGIN */
+    int64_t bootUntil;
+    uint8_t magicCount;
+    LoaderState loaderState;
+    uint8_t loaderCommand;
+    uint32_t numUsedPages;
+    uint32_t firstPage;
+    uint32_t numPages;
+    uint32_t receivedPages;
+    bool isPatch;
+    bool hasSavedSettings; /* Old image had retained settings when programming started */
+    std::vector<uint8_t> blockBuffer;
+    size_t blockBytes;
+    uint8_t missingPages[PROGRAM_STATUS_LENGTH];
+};
+
+#endif
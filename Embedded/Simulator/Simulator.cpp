@@ -0,0 +1,198 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Simulator.h"
+#include "Node.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define IDLE_WAIT_NS 10000000
+#define GARBLE_MASK 0x5A /* Overlapping bytes are broken into something else */
+#define TRANSMISSION_HISTORY_NS 100000000 /* Longer than anything scheduled ahead */
+
+Simulator::Simulator(const SimulatorConfig &config)
+    : configuration(config), byteNS((10 * 1000000000LL + config.baud / 2) / config.baud),
+      master(-1), slave(-1), hostFreeAt(0), busyUntil(0), random(config.seed)
+{
+    origin = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    for (uint32_t index = 0; index < config.numNodes; ++index) {
+        nodes.emplace_back(new Node(*this, index, config.firstID + index, config.image));
+    }
+}
+
+Simulator::~Simulator()
+{
+    if (slave != -1) {
+        close(slave);
+    }
+    if (master != -1) {
+        close(master);
+    }
+}
+
+bool Simulator::open()
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        return false;
+    }
+    const char *name = ptsname(master);
+    if (name == nullptr) {
+        return false;
+    }
+    slavePath = name;
+    /* Kept open, so reads of master do not fail while host is not connected */
+    slave = ::open(name, O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        return false;
+    }
+    struct termios options;
+    if (tcgetattr(slave, &options) == -1) {
+        return false;
+    }
+    cfmakeraw(&options);
+    if (tcsetattr(slave, TCSANOW, &options) == -1) {
+        return false;
+    }
+    return fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK) != -1;
+}
+
+int64_t Simulator::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - origin;
+}
+
+void Simulator::schedule(int64_t time, std::function<void()> event)
+{
+    events.emplace(time, std::move(event));
+}
+
+bool Simulator::isLost()
+{
+    if (configuration.lossRate <= 0 || std::uniform_real_distribution<double>(0, 1)(random) >= configuration.lossRate) {
+        return false;
+    }
+    ++statistics.lostPackets;
+    return true;
+}
+
+void Simulator::run(const std::atomic<bool> &isRunning)
+{
+    while (isRunning) {
+        const int64_t current = now();
+        while (! events.empty() && events.begin()->first <= current) {
+            const std::function<void()> event = std::move(events.begin()->second);
+            events.erase(events.begin());
+            event();
+        }
+
+        const int64_t wait = events.empty() ? IDLE_WAIT_NS
+                           : std::min<int64_t>(IDLE_WAIT_NS, std::max<int64_t>(0, events.begin()->first - now()));
+        struct pollfd pfd = {master, POLLIN, 0};
+        const struct timespec timeout = {(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+        if (ppoll(&pfd, 1, &timeout, nullptr) > 0 && (pfd.revents & POLLIN)) {
+            receiveFromHost();
+        }
+    }
+}
+
+void Simulator::receiveFromHost()
+{
+    uint8_t buffer[256];
+    const ssize_t received = read(master, buffer, sizeof(buffer));
+    if (received <= 0) {
+        return;
+    }
+    /* Adapter sends the bytes back to back after the ones still on the bus */
+    hostFreeAt = transmit(nullptr, std::max(now(), hostFreeAt), buffer, received);
+}
+
+int64_t Simulator::transmit(Node *node, int64_t start, const uint8_t *data, size_t length)
+{
+    const int64_t end = start + byteTime(length);
+    transmissions.push_back({node, start, end});
+    statistics.busyNS += std::max<int64_t>(0, end - std::max(start, busyUntil));
+    busyUntil = std::max(busyUntil, end);
+    bool isLostByHost = false;
+    if (node == nullptr) {
+        statistics.hostBytes += length;
+    } else {
+        ++statistics.replies;
+        statistics.nodeBytes += length;
+        isLostByHost = configuration.lossRate > 0
+                    && std::uniform_real_distribution<double>(0, 1)(random) < configuration.lossRate;
+        if (isLostByHost) {
+            ++statistics.lostReplies;
+        }
+    }
+    for (size_t index = 0; index < length; ++index) {
+        const int64_t byteStart = start + byteTime(index);
+        const uint8_t byte = data[index];
+        const bool isLast = index + 1 == length;
+        schedule(byteStart + byteNS, [this, node, byte, byteStart, isLast, isLostByHost]() {
+            deliver(node, byte, byteStart, byteStart + byteNS, isLast, isLostByHost);
+        });
+    }
+    return end;
+}
+
+void Simulator::deliver(Node *source, uint8_t byte, int64_t start, int64_t end, bool isLast, bool isLostByHost)
+{
+    while (! transmissions.empty() && transmissions.front().end + TRANSMISSION_HISTORY_NS < end) {
+        transmissions.pop_front();
+    }
+    for (const Transmission &transmission : transmissions) {
+        if (transmission.source != source && transmission.start < end && start < transmission.end) {
+            byte ^= GARBLE_MASK;
+            ++statistics.garbledBytes;
+            break;
+        }
+    }
+    for (const std::unique_ptr<Node> &node : nodes) {
+        /* Transmitter does not hear itself */
+        if (node.get() != source) {
+            node->receive(byte, end);
+        }
+    }
+    if (source == nullptr || isLostByHost) {
+        return;
+    }
+    toHost.push_back(byte);
+    if (isLast) {
+        schedule(end + configuration.adapterLatencyUS * 1000, [this]() {
+            flushToHost();
+        });
+    }
+}
+
+void Simulator::flushToHost()
+{
+    if (toHost.empty()) {
+        return;
+    }
+    /* Dropped if host does not read, like an overflowing adapter */
+    const ssize_t written = write(master, toHost.data(), toHost.size());
+    (void)written;
+    toHost.clear();
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Simulator__
+#define __Simulator__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+class Node;
+
+struct SimulatorConfig {
+    uint32_t numNodes = 10;
+    uint8_t firstID = 1; /* Nodes have IDs from firstID */
+    uint32_t baud = 460800;
+    uint32_t turnaroundUS = 10; /* From the end of request to the start of reply */
+    uint32_t adapterLatencyUS = 0; /* From the end of reply on the bus to host */
+    double lossRate = 0; /* Probability that a node misses a packet, or host misses a reply */
+    bool isDMPRunning = true; /* false starts nodes waiting for DMP firmware like after power on */
+    uint32_t seed = 1;
+    std::vector<uint8_t> image; /* Firmware in flash of every node, erased if empty */
+};
+
+struct SimulatorStats {
+    std::atomic<uint64_t> hostBytes{0};
+    std::atomic<uint64_t> nodeBytes{0};
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> garbledBytes{0}; /* Sent while another one is talking */
+    std::atomic<uint64_t> lostPackets{0}; /* Missed by a node */
+    std::atomic<uint64_t> lostReplies{0}; /* Missed by host */
+    std::atomic<uint64_t> busyNS{0}; /* Time anyone is talking on the bus */
+};
+
+/* Virtual RS485 bus on a pseudo terminal, where host talks to simulated nodes */
+/* Bytes take their time on the bus at the baud rate, and overlapping ones are garbled */
+class Simulator {
+public:
+    explicit Simulator(const SimulatorConfig &config);
+    ~Simulator();
+    Simulator(const Simulator &) = delete;
+    Simulator &operator=(const Simulator &) = delete;
+
+    /* Opens the pseudo terminal, returns false on failure (errno tells the reason) */
+    bool open();
+    /* Path for host to open as a serial port */
+    const std::string &path() const { return slavePath; }
+    /* Runs the bus until isRunning becomes false */
+    void run(const std::atomic<bool> &isRunning);
+    const SimulatorStats &stats() const { return statistics; }
+
+    /* Interface for nodes, times are in ns from the start */
+    const SimulatorConfig &config() const { return configuration; }
+    int64_t now() const;
+    int64_t byteTime(size_t bytes) const { return bytes * byteNS; }
+    void schedule(int64_t time, std::function<void()> event);
+    /* Puts bytes on the bus back to back from start, returns the time the last one ends */
+    int64_t transmit(Node *node, int64_t start, const uint8_t *data, size_t length);
+    /* Rolls whether a node misses the packet starting now */
+    bool isLost();
+
+private:
+    struct Transmission {
+        Node *source; /* nullptr for host */
+        int64_t start;
+        int64_t end;
+    };
+
+    void deliver(Node *source, uint8_t byte, int64_t start, int64_t end, bool isLast, bool isLostByHost);
+    void flushToHost();
+    void receiveFromHost();
+
+    SimulatorConfig configuration;
+    SimulatorStats statistics;
+    int64_t byteNS;
+    int64_t origin;
+    int master;
+    int slave;
+    std::string slavePath;
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::multimap<int64_t, std::function<void()>> events;
+    std::deque<Transmission> transmissions;
+    int64_t hostFreeAt;
+    int64_t busyUntil;
+    std::vector<uint8_t> toHost;
+    std::mt19937 random;
+};
+
+#endif
@@ -0,0 +1,385 @@
+#include "Simulator.h"
+#include "Serial.h"
+#include "quiks.h"
+#include "Protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (! (condition)) { \
+        std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while (0)
+
+/* Runs the simulator on its own thread while alive */
+class RunningSimulator {
+public:
+    explicit RunningSimulator(const SimulatorConfig &config) : simulator(config), isRunning(true)
+    {
+        CHECK(simulator.open());
+        thread = std::thread([this]() {
+            simulator.run(isRunning);
+        });
+    }
+
+    ~RunningSimulator()
+    {
+        isRunning = false;
+        thread.join();
+    }
+
+    Simulator simulator;
+
+private:
+    std::atomic<bool> isRunning;
+    std::thread thread;
+};
+
+/* CRC-16/CCITT-FALSE */
+static uint32_t crc16(const std::vector<uint8_t> &data)
+{
+    uint32_t crc = 0xFFFF;
+    for (uint8_t byte : data) {
+        crc ^= byte << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+        }
+    }
+    return crc;
+}
+
+/* A page filled with value */
+static std::vector<uint8_t> pattern(uint8_t value)
+{
+    return std::vector<uint8_t>(64, value);
+}
+
+/* Page and its CRC16, encoded */
+static std::vector<uint8_t> encodeUnit(std::vector<uint8_t> page)
+{
+    const uint32_t crc = crc16(page);
+    page.push_back(crc);
+    page.push_back(crc >> 8);
+    uint8_t unit[PROGRAM_UNIT_LENGTH];
+    CHECK(quiks_encode(page.data(), page.size(), unit) == PROGRAM_UNIT_LENGTH);
+    return std::vector<uint8_t>(unit, unit + PROGRAM_UNIT_LENGTH);
+}
+
+/* Decodes a reply read by readRaw() */
+static std::vector<uint8_t> decodeReply(const uint8_t *reply, size_t length)
+{
+    std::vector<uint8_t> decoded;
+    quiks_decoder_t decoder;
+    quiks_decoder_reset(&decoder);
+    for (size_t index = 2; index < length; ++index) {
+        uint8_t byte;
+        if (quiks_decode(&decoder, reply[index], &byte)) {
+            decoded.push_back(byte);
+        }
+    }
+    return decoded;
+}
+
+static void writePacket(Serial &serial, uint8_t id, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> packet(2 + data.size() + data.size() / 253 + 1);
+    packet[0] = PACKET_HEADER;
+    packet[1] = id;
+    packet.resize(2 + quiks_encode(data.data(), data.size(), &packet[2]));
+    CHECK(serial.write(packet.data(), packet.size()));
+}
+
+/* Reads exactly length bytes, returns false on timeout */
+static bool readRaw(Serial &serial, uint8_t *data, size_t length, uint32_t timeoutUS)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUS);
+    while (length) {
+        const long received = serial.read(data, length, 10000);
+        if (received < 0 || std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+/* Sends a request and waits for its reply, returns the decoded length (0 on timeout) */
+static size_t request(quiks_t *quiks, uint8_t id, const uint8_t *packet, size_t length, uint8_t *reply)
+{
+    CHECK(quiks_send(quiks, id, packet, length) == 1);
+    for (int wait = 0; wait < 100; ++wait) {
+        const size_t replyLength = quiks_receive(quiks, reply, QUIKS_MAX_REPLY_LENGTH);
+        if (replyLength) {
+            return replyLength;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    return 0;
+}
+
+static void testCommands()
+{
+    SimulatorConfig config;
+    config.numNodes = 4;
+    RunningSimulator running(config);
+    quiks_t *quiks = quiks_open(running.simulator.path().c_str(), config.baud);
+    CHECK(quiks != nullptr);
+    if (quiks == nullptr) {
+        return;
+    }
+    uint8_t reply[QUIKS_MAX_REPLY_LENGTH];
+
+    const uint8_t ping[] = {Command_Ping};
+    CHECK(request(quiks, 2, ping, sizeof(ping), reply) == 2);
+    CHECK(reply[0] == Command_Reply_Ack && reply[1] == 1);
+    CHECK(request(quiks, 9, ping, sizeof(ping), reply) == 0);
+
+    /* Erased flash */
+    const uint8_t readPageCRCs[] = {Command_Read_Page_CRCs, 0};
+    CHECK(request(quiks, 1, readPageCRCs, sizeof(readPageCRCs), reply) == 2 + 2 * PAGE_CRCS_PER_REPLY);
+    CHECK(reply[0] == Command_Reply_Page_CRCs && (uint32_t)(reply[2] | (reply[3] << 8)) == crc16(pattern(0xFF)));
+
+    /* Node 3 has output some samples at 75 Hz */
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const uint8_t readHistory[] = {Command_Read_History, 0, 0};
+    const size_t historyLength = request(quiks, 3, readHistory, sizeof(readHistory), reply);
+    CHECK(historyLength >= 4 + 6 && reply[0] == Command_Reply_History && reply[3] >= 1 && historyLength == 4 + 6U * reply[3]);
+    const uint8_t setFormat[] = {Command_Set_Format, Format_Compact};
+    CHECK(request(quiks, 4, setFormat, sizeof(setFormat), reply) == 2 && reply[0] == Command_Reply_Ack);
+    const uint8_t setInvalidRate[] = {Command_Set_Rate, Rate_225Hz + 1};
+    CHECK(request(quiks, 4, setInvalidRate, sizeof(setInvalidRate), reply) == 2);
+    CHECK(reply[0] == Command_Reply_Ack && reply[1] == 0);
+
+    /* Float and compact replies in their slots */
+    quiks_read_all(quiks, 0b11110, NODE_QUATERNION_SLOT_LENGTH, 20000);
+    quiks_rotation_t rotation;
+    for (int wait = 0; wait < 100 && quiks_get_rotation(quiks, 4, &rotation) < 3; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (uint8_t id = 1; id <= 4; ++id) {
+        CHECK(quiks_get_rotation(quiks, id, &rotation) >= 3);
+        const double norm = rotation.w * rotation.w + rotation.x * rotation.x
+                          + rotation.y * rotation.y + rotation.z * rotation.z;
+        CHECK(std::fabs(norm - 1) < 1e-3);
+    }
+    quiks_read_all(quiks, 0, 0, 0);
+    quiks_close(quiks);
+    CHECK(running.simulator.stats().garbledBytes == 0);
+}
+
+static void testCollision()
+{
+    SimulatorConfig config;
+    config.numNodes = 2;
+    RunningSimulator running(config);
+    quiks_t *quiks = quiks_open(running.simulator.path().c_str(), config.baud);
+    CHECK(quiks != nullptr);
+    if (quiks == nullptr) {
+        return;
+    }
+    /* Slots are too short for the replies */
+    const uint8_t readAll[] = {Command_Read_All_Quaternions, 0b110, 0, 0, 0, 0, 0, 0, 0, 3};
+    CHECK(quiks_send(quiks, BROADCAST_ID, readAll, sizeof(readAll)) == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    quiks_close(quiks);
+    CHECK(running.simulator.stats().garbledBytes > 0);
+}
+
+static void testLoss()
+{
+    SimulatorConfig config;
+    config.numNodes = 1;
+    config.lossRate = 1;
+    RunningSimulator running(config);
+    quiks_t *quiks = quiks_open(running.simulator.path().c_str(), config.baud);
+    CHECK(quiks != nullptr);
+    if (quiks == nullptr) {
+        return;
+    }
+    const uint8_t ping[] = {Command_Ping};
+    uint8_t reply[QUIKS_MAX_REPLY_LENGTH];
+    CHECK(request(quiks, 1, ping, sizeof(ping), reply) == 0);
+    quiks_close(quiks);
+    CHECK(running.simulator.stats().lostPackets > 0 && running.simulator.stats().replies == 0);
+}
+
+static void testProgram()
+{
+    SimulatorConfig config;
+    config.numNodes = 1;
+    RunningSimulator running(config);
+    Serial serial;
+    CHECK(serial.open(running.simulator.path().c_str(), config.baud));
+
+    /* Second page is broken at first, then resent */
+    writePacket(serial, 1, {Command_Program, 2});
+    uint8_t result;
+    CHECK(readRaw(serial, &result, 1, 100000) && result == 1);
+    std::vector<uint8_t> units;
+    for (uint8_t value = 1; value <= 2; ++value) {
+        const std::vector<uint8_t> unit = encodeUnit(pattern(value));
+        units.insert(units.end(), unit.begin(), unit.end());
+    }
+    std::vector<uint8_t> broken = units;
+    broken[PROGRAM_UNIT_LENGTH + 10] ^= 1;
+    CHECK(serial.write(broken.data(), broken.size()));
+    CHECK(readRaw(serial, &result, 1, 100000) && result == 1);
+    CHECK(serial.write(&units[PROGRAM_UNIT_LENGTH], PROGRAM_UNIT_LENGTH));
+    CHECK(readRaw(serial, &result, 1, 300000) && result == 2);
+
+    /* Node is back after the bootloader waits 2s */
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    writePacket(serial, 1, {Command_Read_Page_CRCs, 0});
+    uint8_t reply[4 + 2 * PAGE_CRCS_PER_REPLY];
+    CHECK(readRaw(serial, reply, sizeof(reply), 100000));
+    CHECK(reply[0] == PACKET_HEADER && reply[1] == 0);
+    const std::vector<uint8_t> decoded = decodeReply(reply, sizeof(reply));
+    CHECK(decoded.size() >= 8 && decoded[0] == Command_Reply_Page_CRCs);
+    if (decoded.size() >= 8) {
+        CHECK((uint32_t)(decoded[2] | (decoded[3] << 8)) == crc16(pattern(1)));
+        CHECK((uint32_t)(decoded[4] | (decoded[5] << 8)) == crc16(pattern(2)));
+        CHECK((uint32_t)(decoded[6] | (decoded[7] << 8)) == crc16(pattern(0xFF)));
+    }
+}
+
+static void testProgramKeepsSettings()
+{
+    /* Vector table in page 1 exports the retained settings in page 2, which has ID 64 */
+    std::vector<uint8_t> pages[3] = {pattern(0), pattern(0), pattern(0)};
+    const uint32_t vectors = PROGRAM_FLASH_ORIGIN + 64;
+    const uint32_t retainedData = PROGRAM_FLASH_ORIGIN + 128;
+    for (int byte = 0; byte < 4; ++byte) {
+        pages[0][byte] = vectors >> (8 * byte);
+        pages[1][4 * PROGRAM_RETAINED_VECTOR + byte] = retainedData >> (8 * byte);
+    }
+    pages[2][0] = 64;
+
+    /* Node runs the same image, configured as ID 5 */
+    SimulatorConfig config;
+    config.numNodes = 1;
+    config.firstID = 5;
+    for (const std::vector<uint8_t> &page : pages) {
+        config.image.insert(config.image.end(), page.begin(), page.end());
+    }
+    RunningSimulator running(config);
+    Serial serial;
+    CHECK(serial.open(running.simulator.path().c_str(), config.baud));
+    writePacket(serial, 5, {Command_Program, 3});
+    uint8_t result;
+    CHECK(readRaw(serial, &result, 1, 100000) && result == 1);
+    for (const std::vector<uint8_t> &page : pages) {
+        const std::vector<uint8_t> unit = encodeUnit(page);
+        CHECK(serial.write(unit.data(), unit.size()));
+    }
+    CHECK(readRaw(serial, &result, 1, 300000) && result == 3);
+
+    /* Node keeps its ID, which is written over the defaults in page 2 */
+    std::this_thread::sleep_for(std::chrono::milliseconds(2200));
+    writePacket(serial, 5, {Command_Read_Page_CRCs, 0});
+    uint8_t reply[4 + 2 * PAGE_CRCS_PER_REPLY];
+    CHECK(readRaw(serial, reply, sizeof(reply), 100000));
+    const std::vector<uint8_t> decoded = decodeReply(reply, sizeof(reply));
+    CHECK(decoded.size() >= 8 && decoded[0] == Command_Reply_Page_CRCs);
+    std::vector<uint8_t> kept = pages[2];
+    const uint8_t settings[] = {5, 1, 0, 1, 1, 1, 2, Format_Float, 0, Rate_75Hz};
+    std::copy(settings, settings + sizeof(settings), kept.begin());
+    if (decoded.size() >= 8) {
+        CHECK((uint32_t)(decoded[6] | (decoded[7] << 8)) == crc16(kept));
+    }
+}
+
+static void testDMPUpload()
+{
+    SimulatorConfig config;
+    config.numNodes = 2;
+    config.isDMPRunning = false;
+    RunningSimulator running(config);
+    Serial serial;
+    CHECK(serial.open(running.simulator.path().c_str(), config.baud));
+    /* Reading back DMP memory takes 100ms, longer than quiks waits for */
+    writePacket(serial, 1, {Command_Read_DMP_Status});
+    uint8_t reply[QUIKS_MAX_REPLY_LENGTH];
+    CHECK(readRaw(serial, reply, 7, 200000));
+    CHECK(reply[0] == PACKET_HEADER && reply[3] == Command_Reply_DMP_Status && reply[4] == DMP_Status_Waiting);
+
+    /* Literals only, padded to a multiple of 16 bytes */
+    std::vector<uint8_t> firmware(DMP_FIRMWARE_LENGTH);
+    for (size_t index = 0; index < firmware.size(); ++index) {
+        firmware[index] = index * 13;
+    }
+    std::vector<uint8_t> stream;
+    size_t bits = 0;
+    for (uint8_t byte : firmware) {
+        const uint32_t token = 0x100 | byte;
+        for (int bit = 8; bit >= 0; --bit, ++bits) {
+            if (bits % 8 == 0) {
+                stream.push_back(0);
+            }
+            stream.back() |= ((token >> bit) & 1) << (7 - bits % 8);
+        }
+    }
+    stream.resize((stream.size() + 15) / 16 * 16);
+    writePacket(serial, DMP_UPLOAD_ID, stream);
+    serial.close();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    quiks_t *quiks = quiks_open(running.simulator.path().c_str(), config.baud);
+    const uint8_t readDMPStatus[] = {Command_Read_DMP_Status};
+    CHECK(request(quiks, 2, readDMPStatus, sizeof(readDMPStatus), reply) == 4);
+    CHECK(reply[0] == Command_Reply_DMP_Status && reply[1] == DMP_Status_Running);
+    quiks_close(quiks);
+}
+
+static void testHistoryAfterResume()
+{
+    SimulatorConfig config;
+    config.numNodes = 1;
+    config.isDMPRunning = false;
+    RunningSimulator running(config);
+    Serial serial;
+    CHECK(serial.open(running.simulator.path().c_str(), config.baud));
+    /* Enabling DMP takes 50ms, longer than quiks waits for */
+    writePacket(serial, 1, {Command_Resume_DMP});
+    uint8_t reply[QUIKS_MAX_REPLY_LENGTH];
+    CHECK(readRaw(serial, reply, 5, 200000));
+    CHECK(reply[0] == PACKET_HEADER && reply[3] == Command_Reply_Ack && reply[4] == 1);
+    serial.close();
+
+    /* A few samples at 75 Hz, and a sequence far ahead still gets only the recorded ones */
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    quiks_t *quiks = quiks_open(running.simulator.path().c_str(), config.baud);
+    const uint8_t readHistory[] = {Command_Read_History, 0x00, 0x80};
+    const size_t historyLength = request(quiks, 1, readHistory, sizeof(readHistory), reply);
+    CHECK(reply[0] == Command_Reply_History && reply[3] >= 1 && reply[3] < HISTORY_LENGTH);
+    CHECK(historyLength == 4 + 6U * reply[3] && (reply[1] | (reply[2] << 8)) == 0);
+    for (uint32_t sample = 0; sample < reply[3]; ++sample) {
+        /* Slots never written are zero */
+        CHECK(std::any_of(&reply[4 + 6 * sample], &reply[4 + 6 * sample + 6], [](uint8_t byte) { return byte != 0; }));
+    }
+    quiks_close(quiks);
+}
+
+int main()
+{
+    testCommands();
+    testCollision();
+    testLoss();
+    testProgram();
+    testProgramKeepsSettings();
+    testDMPUpload();
+    testHistoryAfterResume();
+    if (failures) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("All tests passed\n");
+    return 0;
+}
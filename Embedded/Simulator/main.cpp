@@ -0,0 +1,110 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Simulator.h"
+#include "Protocol.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+static std::atomic<bool> isRunning(true);
+
+static void stop(int)
+{
+    isRunning = false;
+}
+
+static void usage(const char *command)
+{
+    fprintf(stderr, "Usage: %s [-n nodes] [-i first id] [-b baud] [-t turnaround us] [-a adapter latency us]\n"
+                    "       [-l loss rate] [-s seed] [-f image] [-w] [-L link]\n"
+                    "  -w  Nodes wait for DMP firmware upload like after power on\n"
+                    "  -L  Make a symbolic link to the pseudo terminal\n", command);
+}
+
+int main(int argc, char * const argv[])
+{
+    SimulatorConfig config;
+    const char *link = nullptr;
+    int option;
+    while ((option = getopt(argc, argv, "n:i:b:t:a:l:s:f:wL:")) != -1) {
+        switch (option) {
+            case 'n': config.numNodes = atoi(optarg); break;
+            case 'i': config.firstID = atoi(optarg); break;
+            case 'b': config.baud = atoi(optarg); break;
+            case 't': config.turnaroundUS = atoi(optarg); break;
+            case 'a': config.adapterLatencyUS = atoi(optarg); break;
+            case 'l': config.lossRate = atof(optarg); break;
+            case 's': config.seed = atoi(optarg); break;
+            case 'w': config.isDMPRunning = false; break;
+            case 'L': link = optarg; break;
+            case 'f': {
+                std::ifstream file(optarg, std::ios::binary);
+                if (! file) {
+                    fprintf(stderr, "Could not open %s\n", optarg);
+                    return 1;
+                }
+                config.image.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.numNodes < 1 || config.firstID < 1 || config.firstID + config.numNodes > 64 || config.baud == 0) {
+        fprintf(stderr, "IDs of nodes must be in 1 - 63\n");
+        return 1;
+    }
+    if (config.image.size() > PROGRAM_MAX_PAGES * 64) {
+        fprintf(stderr, "Binary is not fit in flash\n");
+        return 1;
+    }
+
+    Simulator simulator(config);
+    if (! simulator.open()) {
+        fprintf(stderr, "Could not open pseudo terminal: %s\n", strerror(errno));
+        return 1;
+    }
+    if (link) {
+        unlink(link);
+        if (symlink(simulator.path().c_str(), link) == -1) {
+            fprintf(stderr, "Could not link %s: %s\n", link, strerror(errno));
+            return 1;
+        }
+    }
+    printf("%s\n", simulator.path().c_str());
+    fflush(stdout);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    simulator.run(isRunning);
+    if (link) {
+        unlink(link);
+    }
+
+    const SimulatorStats &stats = simulator.stats();
+    fprintf(stderr, "Host bytes: %llu, node bytes: %llu, replies: %llu\n",
+            (unsigned long long)stats.hostBytes, (unsigned long long)stats.nodeBytes, (unsigned long long)stats.replies);
+    fprintf(stderr, "Garbled bytes: %llu, lost packets: %llu, lost replies: %llu\n",
+            (unsigned long long)stats.garbledBytes, (unsigned long long)stats.lostPackets, (unsigned long long)stats.lostReplies);
+    return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "quiks.h"
+#include "Protocol.h"
+#include "Serial.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#define QUEUE_LENGTH 8
+#define REPLY_TIMEOUT_US 20000 /* Latency of USB serial adapters is included */
+#define IDLE_WAIT_MS 100
+#define POSE_IS_NEWER 4 /* Flag in sharedPose, which is newer than frontPose */
+
+typedef std::chrono::steady_clock Clock;
+
+struct quiks {
+    Serial serial;
+    uint32_t byteUS; /* 10 bits on the bus */
+    std::thread thread;
+    std::atomic<bool> isRunning;
+
+    /* Shared with callers, guarded by mutex */
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    uint64_t idBitmap;
+    uint8_t slotLength;
+    uint32_t period;
+    struct {
+        quiks_rotation_t rotation;
+        uint32_t count;
+    } nodes[64];
+    struct {
+        uint8_t id;
+        size_t length;
+        uint8_t data[QUIKS_MAX_REQUEST_LENGTH];
+    } requests[QUEUE_LENGTH];
+    size_t firstRequest;
+    size_t numRequests;
+    struct {
+        size_t length;
+        uint8_t data[QUIKS_MAX_REPLY_LENGTH];
+    } replies[QUEUE_LENGTH];
+    size_t firstReply;
+    size_t numReplies;
+
+    /* Triple buffer of poses, exchanged without locks */
+    quiks_pose_t poses[3];
+    std::atomic<int> sharedPose;
+    int frontPose; /* Owned by quiks_get_pose() caller */
+
+    /* Owned by I/O thread */
+    quiks_pose_t pose; /* Being read */
+    int backPose;
+    quiks_parser_t parser;
+    uint8_t readBuffer[256];
+    size_t readLength;
+    size_t readOffset;
+    uint8_t writeBuffer[2 + QUIKS_MAX_REQUEST_LENGTH + QUIKS_MAX_REQUEST_LENGTH / 253 + 1];
+};
+
+static bool writePacket(quiks_t *quiks, uint8_t id, const uint8_t *data, size_t length)
+{
+    quiks->writeBuffer[0] = PACKET_HEADER;
+    quiks->writeBuffer[1] = id;
+    const size_t encoded = quiks_encode(data, length, &quiks->writeBuffer[2]);
+    return quiks->serial.write(quiks->writeBuffer, 2 + encoded);
+}
+
+/* Returns decoded length of the next reply, or 0 on timeout */
+/* Bytes after the reply are kept for the next call */
+static size_t readReply(quiks_t *quiks, Clock::time_point deadline)
+{
+    while (true) {
+        if (quiks->readOffset < quiks->readLength) {
+            size_t packetLength;
+            quiks->readOffset += quiks_parse(&quiks->parser, &quiks->readBuffer[quiks->readOffset],
+                                             quiks->readLength - quiks->readOffset, &packetLength);
+            if (packetLength) {
+                return packetLength;
+            }
+            continue;
+        }
+        const Clock::time_point now = Clock::now();
+        if (now >= deadline) {
+            return 0;
+        }
+        const long received = quiks->serial.read(quiks->readBuffer, sizeof(quiks->readBuffer),
+            std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count());
+        if (received < 0) {
+            return 0;
+        }
+        quiks->readLength = received;
+        quiks->readOffset = 0;
+    }
+}
+
+/* Rotations go to nodes and pose, and the others are left for quiks_receive() */
+static void handleReply(quiks_t *quiks, size_t length)
+{
+    const uint8_t *packet = quiks->parser.packet;
+    switch (packet[0]) {
+        case Command_Reply_Node_Quaternion:
+        case Command_Reply_Compact_Quaternion: {
+            const uint8_t id = packet[1];
+            if (id >= 64) {
+                return;
+            }
+            if (packet[0] == Command_Reply_Node_Quaternion) {
+                quiks_decode_rotation(&packet[2], &quiks->pose.rotations[id]);
+            } else {
+                quiks_decode_compact_rotation(&packet[2], &quiks->pose.rotations[id]);
+            }
+            ++quiks->pose.counts[id];
+            std::lock_guard<std::mutex> lock(quiks->mutex);
+            quiks->nodes[id].rotation = quiks->pose.rotations[id];
+            quiks->nodes[id].count = quiks->pose.counts[id];
+            return;
+        }
+
+        default:
+            break;
+    }
+    std::lock_guard<std::mutex> lock(quiks->mutex);
+    if (quiks->numReplies == QUEUE_LENGTH) {
+        /* Drop the oldest one nobody took */
+        quiks->firstReply = (quiks->firstReply + 1) % QUEUE_LENGTH;
+        --quiks->numReplies;
+    }
+    const size_t index = (quiks->firstReply + quiks->numReplies) % QUEUE_LENGTH;
+    std::memcpy(quiks->replies[index].data, packet, length);
+    quiks->replies[index].length = length;
+    ++quiks->numReplies;
+}
+
+/* Exchange publishes the copy to the back buffer before it */
+static void publishPose(quiks_t *quiks)
+{
+    ++quiks->pose.sequence;
+    quiks->poses[quiks->backPose] = quiks->pose;
+    quiks->backPose = quiks->sharedPose.exchange(quiks->backPose | POSE_IS_NEWER) & ~POSE_IS_NEWER;
+}
+
+static void readAll(quiks_t *quiks, uint64_t idBitmap, uint8_t slotLength)
+{
+    uint8_t request[10] = {Command_Read_All_Quaternions};
+    for (int byte = 0; byte < 8; ++byte) {
+        request[1 + byte] = idBitmap >> (8 * byte);
+    }
+    request[9] = slotLength;
+    if (! writePacket(quiks, BROADCAST_ID, request, sizeof(request))) {
+        return;
+    }
+    int numNodes = 0;
+    for (uint64_t bits = idBitmap; bits; bits &= bits - 1) {
+        ++numNodes;
+    }
+    /* Request itself, slots, and latency of the adapter */
+    const uint32_t timeout = (2 + sizeof(request) + 2) * quiks->byteUS
+                           + numNodes * (slotLength * quiks->byteUS + BROADCAST_GUARD_US)
+                           + REPLY_TIMEOUT_US;
+    const Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout);
+    for (int count = 0; count < numNodes; ++count) {
+        const size_t length = readReply(quiks, deadline);
+        if (length == 0) {
+            break;
+        }
+        handleReply(quiks, length);
+    }
+    publishPose(quiks);
+}
+
+static void run(quiks_t *quiks)
+{
+    Clock::time_point nextRead = Clock::now();
+    while (quiks->isRunning) {
+        uint8_t id = 0;
+        size_t length = 0;
+        uint8_t request[QUIKS_MAX_REQUEST_LENGTH];
+        uint64_t idBitmap;
+        uint8_t slotLength;
+        {
+            std::unique_lock<std::mutex> lock(quiks->mutex);
+            const Clock::time_point now = Clock::now();
+            if (quiks->numRequests == 0 && (quiks->idBitmap == 0 || now < nextRead)) {
+                quiks->wakeup.wait_until(lock, quiks->idBitmap ? nextRead : now + std::chrono::milliseconds(IDLE_WAIT_MS));
+                continue;
+            }
+            if (quiks->numRequests) {
+                id = quiks->requests[quiks->firstRequest].id;
+                length = quiks->requests[quiks->firstRequest].length;
+                std::memcpy(request, quiks->requests[quiks->firstRequest].data, length);
+                quiks->firstRequest = (quiks->firstRequest + 1) % QUEUE_LENGTH;
+                --quiks->numRequests;
+            } else {
+                nextRead += std::chrono::microseconds(quiks->period);
+                if (nextRead < now) {
+                    /* Do not catch up with the reads already missed */
+                    nextRead = now + std::chrono::microseconds(quiks->period);
+                }
+            }
+            idBitmap = quiks->idBitmap;
+            slotLength = quiks->slotLength;
+        }
+
+        if (length == 0) {
+            readAll(quiks, idBitmap, slotLength);
+            continue;
+        }
+        if (! writePacket(quiks, id, request, length) || id == BROADCAST_ID) {
+            continue;
+        }
+        const uint32_t timeout = (2 + length + 1) * quiks->byteUS + REPLY_TIMEOUT_US;
+        const size_t replyLength = readReply(quiks, Clock::now() + std::chrono::microseconds(timeout));
+        if (replyLength) {
+            handleReply(quiks, replyLength);
+        }
+    }
+}
+
+quiks_t *quiks_open(const char *path, uint32_t baud)
+{
+    quiks_t *quiks = new (std::nothrow) quiks_t();
+    if (quiks == nullptr) {
+        return nullptr;
+    }
+    if (! quiks->serial.open(path, baud)) {
+        delete quiks;
+        return nullptr;
+    }
+    quiks->byteUS = (10 * 1000000 + baud - 1) / baud;
+    quiks_parser_reset(&quiks->parser);
+    quiks->backPose = 0;
+    quiks->sharedPose = 1;
+    quiks->frontPose = 2;
+    quiks->isRunning = true;
+    quiks->thread = std::thread(run, quiks);
+    return quiks;
+}
+
+void quiks_close(quiks_t *quiks)
+{
+    {
+        std::lock_guard<std::mutex> lock(quiks->mutex);
+        quiks->isRunning = false;
+    }
+    quiks->wakeup.notify_one();
+    quiks->thread.join();
+    delete quiks;
+}
+
+void quiks_read_all(quiks_t *quiks, uint64_t idBitmap, uint8_t slotLength, uint32_t period)
+{
+    {
+        std::lock_guard<std::mutex> lock(quiks->mutex);
+        quiks->idBitmap = idBitmap & ~(1ULL << 0);
+        quiks->slotLength = slotLength;
+        quiks->period = period;
+    }
+    quiks->wakeup.notify_one();
+}
+
+uint32_t quiks_get_rotation(quiks_t *quiks, uint8_t id, quiks_rotation_t *rotation)
+{
+    if (id >= 64) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(quiks->mutex);
+    if (quiks->nodes[id].count) {
+        *rotation = quiks->nodes[id].rotation;
+    }
+    return quiks->nodes[id].count;
+}
+
+int quiks_get_pose(quiks_t *quiks, quiks_pose_t *pose)
+{
+    if (quiks->sharedPose.load() & POSE_IS_NEWER) {
+        quiks->frontPose = quiks->sharedPose.exchange(quiks->frontPose) & ~POSE_IS_NEWER;
+    }
+    if (quiks->poses[quiks->frontPose].sequence == 0) {
+        return 0;
+    }
+    *pose = quiks->poses[quiks->frontPose];
+    return 1;
+}
+
+int quiks_send(quiks_t *quiks, uint8_t id, const uint8_t *packet, size_t length)
+{
+    if (length == 0 || length > QUIKS_MAX_REQUEST_LENGTH) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(quiks->mutex);
+        if (quiks->numRequests == QUEUE_LENGTH) {
+            return 0;
+        }
+        const size_t index = (quiks->firstRequest + quiks->numRequests) % QUEUE_LENGTH;
+        quiks->requests[index].id = id;
+        quiks->requests[index].length = length;
+        std::memcpy(quiks->requests[index].data, packet, length);
+        ++quiks->numRequests;
+    }
+    quiks->wakeup.notify_one();
+    return 1;
+}
+
+size_t quiks_receive(quiks_t *quiks, uint8_t *packet, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(quiks->mutex);
+    if (quiks->numReplies == 0) {
+        return 0;
+    }
+    const size_t length = quiks->replies[quiks->firstReply].length;
+    std::memcpy(packet, quiks->replies[quiks->firstReply].data, length < capacity ? length : capacity);
+    quiks->firstReply = (quiks->firstReply + 1) % QUEUE_LENGTH;
+    --quiks->numReplies;
+    return length;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "quiks.h"
+#include "Protocol.h"
+#include <cmath>
+#include <cstring>
+
+size_t quiks_encode(const uint8_t *data, size_t length, uint8_t *encoded)
+{
+    uint8_t *code = encoded;
+    uint8_t *out = encoded + 1;
+    for (size_t index = 0; index < length; ++index) {
+        if (data[index] == PACKET_HEADER) {
+            *code = out - code;
+            code = out++;
+            continue;
+        }
+        *out++ = data[index];
+        if (out - code == 0xFE) {
+            /* Longest chunk, which is not followed by 0xFF */
+            *code = 0xFE;
+            code = out++;
+        }
+    }
+    *code = out - code;
+    return out - encoded;
+}
+
+void quiks_decoder_reset(quiks_decoder_t *decoder)
+{
+    decoder->bytesInChunk = 0;
+    decoder->chunkEndsWithHeader = 0;
+}
+
+int quiks_decode(quiks_decoder_t *decoder, uint8_t byte, uint8_t *decoded)
+{
+    if (decoder->bytesInChunk) {
+        --decoder->bytesInChunk;
+        *decoded = byte;
+        return 1;
+    }
+    const int shouldInsertHeader = decoder->chunkEndsWithHeader;
+    decoder->bytesInChunk = byte - 1;
+    decoder->chunkEndsWithHeader = byte != 0xFE;
+    *decoded = PACKET_HEADER;
+    return shouldInsertHeader;
+}
+
+void quiks_decode_rotation(const uint8_t *data, quiks_rotation_t *rotation)
+{
+    /* Both of node and host are little endian */
+    std::memcpy(&rotation->w, data + 0, 4);
+    std::memcpy(&rotation->x, data + 4, 4);
+    std::memcpy(&rotation->y, data + 8, 4);
+    std::memcpy(&rotation->z, data + 12, 4);
+}
+
+void quiks_decode_compact_rotation(const uint8_t *data, quiks_rotation_t *rotation)
+{
+    uint64_t packed = 0;
+    for (int byte = 0; byte < 6; ++byte) {
+        packed |= (uint64_t)data[byte] << (8 * byte);
+    }
+    const int largest = packed & 0b11;
+    float components[4];
+    float sum = 0;
+    int shift = 2;
+    for (int index = 0; index < 4; ++index) {
+        if (index == largest) {
+            continue;
+        }
+        components[index] = ((packed >> shift) & 0x7FFF) / 32767.0 * M_SQRT2 - M_SQRT1_2;
+        sum += components[index] * components[index];
+        shift += 15;
+    }
+    components[largest] = std::sqrt(std::fmax(0.0f, 1 - sum));
+    rotation->w = components[0];
+    rotation->x = components[1];
+    rotation->y = components[2];
+    rotation->z = components[3];
+}
+
+/* Decoded length of the reply, which may be unknown until its first bytes (0 for unknown commands) */
+static size_t replyLength(const uint8_t *packet, size_t length)
+{
+    switch (packet[0]) {
+        case Command_Reply_Ack:
+        case Command_Reply_Compass_Accuracy:
+            return 2;
+        case Command_Reply_Quaternion:
+            return 17;
+        case Command_Reply_Node_Quaternion:
+            return 18;
+        case Command_Reply_Compact_Quaternion:
+            return 8;
+        case Command_Reply_Program_Status:
+            return 1 + PROGRAM_STATUS_LENGTH;
+        case Command_Reply_Page_CRCs:
+            return 2 + 2 * PAGE_CRCS_PER_REPLY;
+        case Command_Reply_DMP_Status:
+            return 4;
+        case Command_Reply_History:
+            if (length < 4) {
+                return 4;
+            }
+            return packet[3] <= HISTORY_LENGTH ? 4 + packet[3] * 6 : 0;
+        case Command_Reply_Stamped_Quaternion:
+            return 13;
+        case Command_Reply_Latched_Quaternion:
+            return 12;
+        default:
+            return 0;
+    }
+}
+
+enum {
+    parser_waiting_for_header,
+    parser_waiting_for_id,
+    parser_receiving,
+};
+
+void quiks_parser_reset(quiks_parser_t *parser)
+{
+    parser->state = parser_waiting_for_header;
+    parser->length = 0;
+}
+
+size_t quiks_parse(quiks_parser_t *parser, const uint8_t *data, size_t length, size_t *packetLength)
+{
+    *packetLength = 0;
+    for (size_t consumed = 0; consumed < length; ) {
+        const uint8_t byte = data[consumed++];
+        if (byte == PACKET_HEADER) {
+            /* 0xFF never appears in encoded data, so it always starts a packet */
+            parser->state = parser_waiting_for_id;
+            continue;
+        }
+        switch (parser->state) {
+            case parser_waiting_for_id:
+                if (byte == 0) {
+                    parser->state = parser_receiving;
+                    parser->length = 0;
+                    quiks_decoder_reset(&parser->decoder);
+                } else {
+                    /* Requests from host are not for us */
+                    parser->state = parser_waiting_for_header;
+                }
+                break;
+                
+            case parser_receiving: {
+                uint8_t decoded;
+                if (! quiks_decode(&parser->decoder, byte, &decoded)) {
+                    break;
+                }
+                parser->packet[parser->length++] = decoded;
+                const size_t expected = replyLength(parser->packet, parser->length);
+                if (parser->length == expected) {
+                    parser->state = parser_waiting_for_header;
+                    *packetLength = parser->length;
+                    return consumed;
+                }
+                if (expected == 0 || parser->length >= QUIKS_MAX_REPLY_LENGTH) {
+                    parser->state = parser_waiting_for_header;
+                }
+                break;
+            }
+                
+            default:
+                break;
+        }
+    }
+    return length;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Serial.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+
+Serial::Serial() : fd(-1)
+{
+}
+
+Serial::~Serial()
+{
+    close();
+}
+
+#ifndef __APPLE__
+static speed_t speedOf(uint32_t baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B0;
+    }
+}
+#endif
+
+bool Serial::open(const char *path, uint32_t baud)
+{
+    close();
+    fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct termios options;
+    if (tcgetattr(fd, &options) == -1) {
+        close();
+        return false;
+    }
+    cfmakeraw(&options);
+    options.c_cflag |= CS8 | CLOCAL | CREAD;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+#ifdef __APPLE__
+    /* Speeds above 230400 are set by IOSSIOSPEED, see Flasher */
+    cfsetspeed(&options, B230400);
+    if (tcsetattr(fd, TCSANOW, &options) == -1) {
+        close();
+        return false;
+    }
+    speed_t speed = baud;
+    if (ioctl(fd, IOSSIOSPEED, &speed) == -1) {
+        close();
+        return false;
+    }
+    unsigned long mics = 1;
+    ioctl(fd, IOSSDATALAT, &mics); /* Optional, some drivers do not support it */
+#else
+    const speed_t speed = speedOf(baud);
+    if (speed == B0) {
+        close();
+        errno = EINVAL;
+        return false;
+    }
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    if (tcsetattr(fd, TCSANOW, &options) == -1) {
+        close();
+        return false;
+    }
+#endif
+    tcflush(fd, TCIOFLUSH);
+    return true;
+}
+
+void Serial::close()
+{
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool Serial::write(const uint8_t *data, size_t length)
+{
+    while (length) {
+        const ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+long Serial::read(uint8_t *data, size_t length, uint32_t timeoutUS)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    const int result = poll(&pfd, 1, (timeoutUS + 999) / 1000);
+    if (result < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (result == 0) {
+        return 0;
+    }
+    const ssize_t received = ::read(fd, data, length);
+    if (received < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    return received;
+}
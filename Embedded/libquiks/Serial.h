@@ -0,0 +1,44 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __quiks_Serial__
+#define __quiks_Serial__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Raw serial port by POSIX termios */
+class Serial {
+public:
+    Serial();
+    ~Serial();
+    Serial(const Serial &) = delete;
+    Serial &operator=(const Serial &) = delete;
+
+    /* Returns false on failure, errno tells the reason */
+    bool open(const char *path, uint32_t baud);
+    void close();
+    bool write(const uint8_t *data, size_t length);
+
+    /* Reads available bytes (at most length) after waiting for the first one up to timeout */
+    /* Returns 0 on timeout, or -1 on error */
+    long read(uint8_t *data, size_t length, uint32_t timeoutUS);
+
+private:
+    int fd;
+};
+
+#endif
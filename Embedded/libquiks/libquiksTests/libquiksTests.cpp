@@ -0,0 +1,238 @@
+#include "quiks.h"
+#include "Protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (! (condition)) { \
+        std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while (0)
+
+/* <Header> <ID> and encoded data */
+static std::vector<uint8_t> makePacket(uint8_t id, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> packet(2 + data.size() + data.size() / 253 + 1);
+    packet[0] = PACKET_HEADER;
+    packet[1] = id;
+    packet.resize(2 + quiks_encode(data.data(), data.size(), &packet[2]));
+    return packet;
+}
+
+static std::vector<uint8_t> decode(const uint8_t *encoded, size_t length)
+{
+    std::vector<uint8_t> decoded;
+    quiks_decoder_t decoder;
+    quiks_decoder_reset(&decoder);
+    for (size_t index = 0; index < length; ++index) {
+        uint8_t byte;
+        if (quiks_decode(&decoder, encoded[index], &byte)) {
+            decoded.push_back(byte);
+        }
+    }
+    return decoded;
+}
+
+static void testEncodeDecode()
+{
+    const size_t lengths[] = {0, 1, 2, 252, 253, 254, 600};
+    for (size_t length : lengths) {
+        std::vector<uint8_t> data(length);
+        for (size_t index = 0; index < length; ++index) {
+            data[index] = index % 5 == 0 ? PACKET_HEADER : index * 7;
+        }
+        std::vector<uint8_t> packet = makePacket(0, data);
+        CHECK(std::find(packet.begin() + 2, packet.end(), PACKET_HEADER) == packet.end());
+        std::vector<uint8_t> decoded = decode(&packet[2], packet.size() - 2);
+        /* The last chunk is not followed by 0xFF, but data may end with it */
+        CHECK(decoded == data || (decoded.size() + 1 == data.size() && data.back() == PACKET_HEADER));
+    }
+}
+
+/* Identity: w is the largest, and the others are in the middle */
+static void packIdentity(uint8_t *data)
+{
+    const uint64_t middle = 16384;
+    const uint64_t packed = 0 | (middle << 2) | (middle << 17) | (middle << 32);
+    for (int byte = 0; byte < 6; ++byte) {
+        data[byte] = packed >> (8 * byte);
+    }
+}
+
+static void testDecodeCompactRotation()
+{
+    uint8_t data[6];
+    packIdentity(data);
+    quiks_rotation_t rotation;
+    quiks_decode_compact_rotation(data, &rotation);
+    CHECK(std::fabs(rotation.w - 1) < 1e-4);
+    CHECK(std::fabs(rotation.x) < 1e-4);
+    CHECK(std::fabs(rotation.y) < 1e-4);
+    CHECK(std::fabs(rotation.z) < 1e-4);
+}
+
+static std::vector<uint8_t> nodeQuaternionReply(uint8_t id, float w, float x, float y, float z)
+{
+    std::vector<uint8_t> data(18);
+    data[0] = Command_Reply_Node_Quaternion;
+    data[1] = id;
+    std::memcpy(&data[2], &w, 4);
+    std::memcpy(&data[6], &x, 4);
+    std::memcpy(&data[10], &y, 4);
+    std::memcpy(&data[14], &z, 4);
+    return makePacket(0, data);
+}
+
+static void testParserAcrossReads()
+{
+    /* A request, a reply with 0xFF inside, garbage, a broken reply and an ack */
+    std::vector<uint8_t> stream = makePacket(3, {Command_Read_Quaternion});
+    std::vector<uint8_t> reply = nodeQuaternionReply(5, -0.0f, 1.0f, 0.5f, NAN);
+    stream.insert(stream.end(), reply.begin(), reply.end());
+    stream.insert(stream.end(), {0x12, 0x34});
+    stream.insert(stream.end(), reply.begin(), reply.begin() + 7);
+    std::vector<uint8_t> ack = makePacket(0, {Command_Reply_Ack, 1});
+    stream.insert(stream.end(), ack.begin(), ack.end());
+
+    for (size_t chunk = 1; chunk <= stream.size(); ++chunk) {
+        quiks_parser_t parser;
+        quiks_parser_reset(&parser);
+        std::vector<std::vector<uint8_t>> packets;
+        for (size_t offset = 0; offset < stream.size(); offset += chunk) {
+            const size_t length = std::min(chunk, stream.size() - offset);
+            size_t consumed = 0;
+            while (consumed < length) {
+                size_t packetLength;
+                consumed += quiks_parse(&parser, &stream[offset + consumed], length - consumed, &packetLength);
+                if (packetLength) {
+                    packets.emplace_back(parser.packet, parser.packet + packetLength);
+                }
+            }
+        }
+        CHECK(packets.size() == 2);
+        if (packets.size() == 2) {
+            CHECK(packets[0].size() == 18 && packets[0][1] == 5);
+            quiks_rotation_t rotation;
+            quiks_decode_rotation(&packets[0][2], &rotation);
+            CHECK(rotation.x == 1.0f && rotation.y == 0.5f && std::isnan(rotation.z));
+            CHECK(packets[1] == std::vector<uint8_t>({Command_Reply_Ack, 1}));
+        }
+    }
+}
+
+/* Reads a request from host, returns decoded <Command> <Parameters> and stores the ID */
+static std::vector<uint8_t> readRequest(int fd, uint8_t *id)
+{
+    std::vector<uint8_t> packet;
+    while (true) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, packet.empty() ? 1000 : 5) <= 0) {
+            break;
+        }
+        uint8_t buffer[64];
+        const ssize_t received = read(fd, buffer, sizeof(buffer));
+        if (received <= 0) {
+            break;
+        }
+        packet.insert(packet.end(), buffer, buffer + received);
+    }
+    if (packet.size() < 3 || packet[0] != PACKET_HEADER) {
+        return {};
+    }
+    *id = packet[1];
+    return decode(&packet[2], packet.size() - 2);
+}
+
+static void testBus()
+{
+    int master, slave;
+    char path[128];
+    CHECK(openpty(&master, &slave, path, nullptr, nullptr) == 0);
+    quiks_t *quiks = quiks_open(path, 460800);
+    CHECK(quiks != nullptr);
+    if (quiks == nullptr) {
+        return;
+    }
+
+    /* Node 5 replies in float, and node 7 in compact format */
+    std::thread node([master]() {
+        uint8_t id;
+        std::vector<uint8_t> request = readRequest(master, &id);
+        CHECK(id == BROADCAST_ID && request.size() == 10 && request[0] == Command_Read_All_Quaternions);
+        CHECK(request.size() == 10 && request[1] == ((1 << 5) | (1 << 7)) && request[9] == NODE_QUATERNION_SLOT_LENGTH);
+        std::vector<uint8_t> reply = nodeQuaternionReply(5, 0.5f, -0.5f, 0.5f, -0.5f);
+        std::vector<uint8_t> compact = {Command_Reply_Compact_Quaternion, 7, 0, 0, 0, 0, 0, 0};
+        packIdentity(&compact[2]);
+        std::vector<uint8_t> compactReply = makePacket(0, compact);
+        reply.insert(reply.end(), compactReply.begin(), compactReply.end());
+        CHECK(write(master, reply.data(), reply.size()) == (ssize_t)reply.size());
+
+        request = readRequest(master, &id);
+        CHECK(id == 5 && request == std::vector<uint8_t>({Command_Ping}));
+        std::vector<uint8_t> ack = makePacket(0, {Command_Reply_Ack, 1});
+        CHECK(write(master, ack.data(), ack.size()) == (ssize_t)ack.size());
+    });
+
+    quiks_rotation_t rotation;
+    quiks_pose_t pose;
+    CHECK(quiks_get_rotation(quiks, 5, &rotation) == 0);
+    CHECK(quiks_get_pose(quiks, &pose) == 0);
+    quiks_read_all(quiks, (1 << 5) | (1 << 7), NODE_QUATERNION_SLOT_LENGTH, 1000000);
+    for (int wait = 0; wait < 100 && quiks_get_rotation(quiks, 7, &rotation) == 0; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(quiks_get_rotation(quiks, 5, &rotation) == 1);
+    CHECK(rotation.w == 0.5f && rotation.x == -0.5f && rotation.y == 0.5f && rotation.z == -0.5f);
+    CHECK(quiks_get_rotation(quiks, 7, &rotation) == 1);
+    CHECK(std::fabs(rotation.w - 1) < 1e-4);
+
+    /* Both replies are in the pose of the read */
+    for (int wait = 0; wait < 100 && quiks_get_pose(quiks, &pose) == 0; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(pose.sequence == 1 && pose.counts[5] == 1 && pose.counts[7] == 1 && pose.counts[6] == 0);
+    CHECK(pose.rotations[5].w == 0.5f && std::fabs(pose.rotations[7].w - 1) < 1e-4);
+
+    const uint8_t ping[] = {Command_Ping};
+    CHECK(quiks_send(quiks, 5, ping, sizeof(ping)) == 1);
+    uint8_t reply[QUIKS_MAX_REPLY_LENGTH];
+    size_t length = 0;
+    for (int wait = 0; wait < 100 && (length = quiks_receive(quiks, reply, sizeof(reply))) == 0; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(length == 2 && reply[0] == Command_Reply_Ack && reply[1] == 1);
+
+    node.join();
+    quiks_close(quiks);
+    close(master);
+    close(slave);
+}
+
+int main()
+{
+    testEncodeDecode();
+    testDecodeCompactRotation();
+    testParserAcrossReads();
+    testBus();
+    if (failures) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2020 mtkrtk
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __quiks__
+#define __quiks__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t bytesInChunk;
+    uint8_t chunkEndsWithHeader;
+} quiks_decoder_t;
+
+#define QUIKS_MAX_REPLY_LENGTH 100 /* Command_Reply_History of HISTORY_LENGTH samples, decoded */
+#define QUIKS_MAX_REQUEST_LENGTH 64 /* <Command> <Parameters> of quiks_send(), decoded */
+
+/* Finds replies (<Header> <ID = 0> ...) in received bytes, without allocation */
+typedef struct {
+    quiks_decoder_t decoder;
+    uint8_t state;
+    size_t length;
+    uint8_t packet[QUIKS_MAX_REPLY_LENGTH]; /* Decoded <Command> <Parameters> */
+} quiks_parser_t;
+
+/* Connection to the bus through a terminal node (see quiks_open) */
+typedef struct quiks quiks_t;
+
+typedef struct {
+    float w;
+    float x;
+    float y;
+    float z;
+} quiks_rotation_t;
+
+/* Rotations of all nodes read by one Command_Read_All_Quaternions (see quiks_get_pose) */
+typedef struct {
+    uint32_t sequence; /* Number of reads published so far */
+    uint32_t counts[64]; /* Rotations received from each node so far (0 if none) */
+    quiks_rotation_t rotations[64]; /* Latest one of each node, nodes missing in the read keep the previous */
+} quiks_pose_t;
+
+/* Encode <Command> <Parameters> of a packet by COBS (see Protocol.h) */
+/* encoded must have (length + length / 253 + 1) bytes, returns the encoded length */
+size_t quiks_encode(const uint8_t *data, size_t length, uint8_t *encoded);
+
+/* Reset decoder after <Header> <ID> is received */
+void quiks_decoder_reset(quiks_decoder_t *decoder);
+
+/* Feed a byte following <ID>, returns 1 and stores *decoded if a byte is decoded */
+int quiks_decode(quiks_decoder_t *decoder, uint8_t byte, uint8_t *decoded);
+
+/* Decode <w> <x> <y> <z> of Command_Reply_Quaternion (16 bytes, decoded) */
+void quiks_decode_rotation(const uint8_t *data, quiks_rotation_t *rotation);
+
+/* Decode <Data> of Command_Reply_Compact_Quaternion (6 bytes, decoded) */
+void quiks_decode_compact_rotation(const uint8_t *data, quiks_rotation_t *rotation);
+
+/* Start looking for the next header */
+void quiks_parser_reset(quiks_parser_t *parser);
+
+/* Feed received bytes in any size, returns the number of bytes consumed */
+/* Stops after a complete reply and stores its length to *packetLength (0 if not completed) */
+/* Partial replies are kept across calls, and broken ones are dropped at the next header */
+size_t quiks_parse(quiks_parser_t *parser, const uint8_t *data, size_t length, size_t *packetLength);
+
+/* Open the serial port of terminal node and start I/O thread, returns NULL on failure */
+quiks_t *quiks_open(const char *path, uint32_t baud);
+
+/* Stop I/O thread and close the serial port */
+void quiks_close(quiks_t *quiks);
+
+/* Let I/O thread read nodes by Command_Read_All_Quaternions every period (us) */
+/* Slot length is NODE_QUATERNION_SLOT_LENGTH or COMPACT_QUATERNION_SLOT_LENGTH, idBitmap = 0 stops */
+void quiks_read_all(quiks_t *quiks, uint64_t idBitmap, uint8_t slotLength, uint32_t period);
+
+/* Copy the latest rotation of the node without blocking */
+/* Returns the number of rotations received from the node so far (0 if none, rotation is untouched) */
+uint32_t quiks_get_rotation(quiks_t *quiks, uint8_t id, quiks_rotation_t *rotation);
+
+/* Copy the newest pose published by I/O thread after each read, without blocking (triple buffered) */
+/* Pose never mixes two reads, but must be taken from one thread only */
+/* Returns 0 if no pose is published yet (pose is untouched) */
+int quiks_get_pose(quiks_t *quiks, quiks_pose_t *pose);
+
+/* Queue <Header> <ID> <Command> <Parameters> to be sent between reads without blocking */
+/* Reply is waited unless ID is BROADCAST_ID, returns 0 if the queue is full or packet is too long */
+int quiks_send(quiks_t *quiks, uint8_t id, const uint8_t *packet, size_t length);
+
+/* Take a reply to quiks_send() without blocking, returns its decoded length (0 if none) */
+/* Replies longer than capacity are truncated */
+size_t quiks_receive(quiks_t *quiks, uint8_t *packet, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -37,11 +37,13 @@ public class Demo : MonoBehaviour {
     public Button button;
     public Text buttonTitle;
     public Animator avator;
+    /* Logs bytes allocated while reading, including ones by the main thread */
+    public bool measureAllocations = false;
 
     private TrackerManager manager;
     private State state = State.waitLaunching;
-    private Timer readTimer;
-    private Mutex readMutex = new Mutex();
+    private Thread readThread;
+    private volatile bool isReading = false;
 
     void Start() {
         foreach (string path in SerialPort.GetPortNames()) {
@@ -66,7 +68,12 @@ public class Demo : MonoBehaviour {
         }
 
         button.onClick.AddListener(ButtonCallback);
-        readTimer = new Timer(ReadSensors);
+    }
+
+    void OnDestroy() {
+        if (isReading) {
+            StopReading();
+        }
     }
 
     void Update() {
@@ -79,7 +86,7 @@ public class Demo : MonoBehaviour {
                 break;
 
             case State.running:
-                manager.SetRotations();
+                manager.SetInterpolatedRotations();
                 break;
         }
     }
@@ -106,8 +113,9 @@ public class Demo : MonoBehaviour {
 
             case State.waitOffsetting:
             case State.running:
-                readTimer.Change(Timeout.Infinite, Timeout.Infinite);
-                readMutex.WaitOne();
+                if (isReading) {
+                    StopReading();
+                }
                 state = State.offsetCounting;
                 for (int i = 3; i > 0; --i) {
                     buttonTitle.text = i.ToString();
@@ -116,8 +124,7 @@ public class Demo : MonoBehaviour {
                 manager.SetChipOffsets();
                 state = State.running;
                 buttonTitle.text = "Set Offset";
-                readMutex.ReleaseMutex();
-                readTimer.Change(0, 1000 / 30);
+                StartReading();
                 break;
 
             default:
@@ -125,10 +132,36 @@ public class Demo : MonoBehaviour {
         }
     }
 
-    void ReadSensors(object arg) {
-        if (readMutex.WaitOne(0)) {
-            manager.PrepareRotations();
-            readMutex.ReleaseMutex();
+    void StartReading() {
+        manager.StartStreaming();
+        isReading = true;
+        readThread = new Thread(ReadSensors);
+        readThread.Start();
+    }
+
+    void StopReading() {
+        isReading = false;
+        readThread.Join();
+        manager.StopStreaming();
+    }
+
+    void ReadSensors() {
+        const int ReadsToMeasure = 1000;
+        int reads = 0;
+        long memory = GC.GetTotalMemory(false);
+        int collections = GC.CollectionCount(0);
+        while (isReading) {
+            manager.ReadStreamedRotations();
+            if (measureAllocations && ++reads == ReadsToMeasure) {
+                long allocated = GC.GetTotalMemory(false) - memory;
+                int collected = GC.CollectionCount(0) - collections;
+                /* Logging allocates, so it is out of the measurement */
+                Debug.LogFormat("Allocated {0} bytes per read, {1} collections in {2} reads",
+                                (double)allocated / ReadsToMeasure, collected, ReadsToMeasure);
+                reads = 0;
+                memory = GC.GetTotalMemory(false);
+                collections = GC.CollectionCount(0);
+            }
         }
     }
 }
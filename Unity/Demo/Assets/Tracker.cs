@@ -18,17 +18,76 @@ using System;
 using System.IO.Ports;
 using System.Collections.Generic;
 using System.Linq;
+using System.Runtime.CompilerServices;
 using System.Threading;
 using System.Net;
 using UnityEngine;
 
 public class Tracker {
     private SerialPort serial;
+    private Link link;
     private byte id;
     private Transform bone;
     private bool isCalibrated = false;
     private const byte PacketHeader = 0xFF;
-    private Quaternion quat;
+    private const byte DMPUploadID = 0xFE;
+    private const byte BroadcastID = 0xFD;
+    private const byte NodeQuaternionSlotLength = 21;
+    private const byte CompactQuaternionSlotLength = 11;
+    private const int BroadcastGuardUS = 50; /* Spare time of each slot, see Protocol.h */
+    private const int AdapterLatency = 20; /* Longer than the latency timer of USB serial adapters (16ms by default) */
+    private const int DMPFirmwareLength = 14290;
+    private const int DMPWindowLength = 256;
+    private const int DMPMaxMatchLength = 17;
+    private static readonly int[] DMPVolatileChunks = {1, 5, 7, 10, 14, 15, 16, 22, 39, 70, 82, 83}; /* See Protocol.h */
+    private const int DMPReadBackTimeout = 1000;
+    private const int DMPDecodeTime = 200; /* Trackers decode the last chunks and enable DMP after the stream */
+    private const int LatchedReplyTimeout = 20; /* Longer than the latency timer of USB serial adapters (16ms by default) */
+    private const int MaxSkippedPollsShift = 6; /* Trackers missing replies are skipped up to 63 polls in a row */
+    private const int HistoryLength = 16;
+    private const int MaxRequestLength = 32; /* <Command> <Parameters> of requests, decoded */
+    private const int MaxReplyLength = 4 + HistoryLength * 6; /* Command_Reply_History, decoded */
+    private const int ReceiveBufferLength = 4096;
+    private const double TimestampClock = 1000000;
+    private static System.Diagnostics.Stopwatch hostClock = System.Diagnostics.Stopwatch.StartNew();
+    private static byte[] compressedDMPFirmware;
+    private static int dmpFirmwareCRC = -1;
+    private static ConditionalWeakTable<SerialPort, Link> links = new ConditionalWeakTable<SerialPort, Link>();
+    private static ConditionalWeakTable<SerialPort, Link>.CreateValueCallback createLink = port => new Link(port);
+    private Quaternion quat; /* Latest rotation read, owned by the reading thread */
+    private uint quatTimestamp;
+    private bool hasRotation = false;
+    private Quaternion poseRotation; /* Rotation of the pose taken by the rendering thread */
+    private Format format = Format.Float;
+    private int historySequence = -1; /* Sequence of the next sample to read from history, -1 before the first read */
+    private int lostSamples = 0;
+    private ushort sampleSequence;
+    private uint sampleTimestamp;
+    private int latchAge; /* In microseconds */
+    private byte[] latchedRequest; /* Encoded beforehand, to be written as soon as the previous reply arrives */
+    private int missedReplies = 0; /* In a row */
+    private int pollsToSkip = 0;
+    private RotationBuffer rotationBuffer = new RotationBuffer();
+
+    /* Seconds rotations are delayed by SetInterpolatedRotation(), longer is smoother against jitter */
+    public double InterpolationDelay = 0.03;
+    /* Seconds rotations may be extrapolated when newer ones are late */
+    public double MaxExtrapolation = 0.05;
+
+    /**
+     * Format of rotations sent by a tracker.
+     */
+    public enum Format {
+        Float, /* Four IEEE754 floats (16 bytes) */
+        Compact, /* Smallest three in 15 bits each (6 bytes), error of each component < 2.2e-5 */
+    };
+
+    public enum Rate {
+        Rate75Hz, /* Sensors at 225 Hz, DMP outputs every 3 samples (default) */
+        Rate56Hz,
+        Rate112Hz,
+        Rate225Hz,
+    };
 
     enum CommandID {
         Ping, /* <Header> <ID> <Command_Ping> (Ack required) */
@@ -43,133 +102,909 @@ public class Tracker {
         Program, /* <Header> <ID> <Command_Program> <Number of pages> */
         Read_Compass_Accuracy, /* <Header> <ID> <Command_Read_Compass_Accuracy> */
         Reply_Compass_Accuracy, /* <Header> <ID = 0> <Command_Reply_Quaternion> <Accuracy> */
+        Read_All_Quaternions, /* <Header> <BROADCAST_ID> <Command_Read_All_Quaternions> <ID bitmap> */
+        Reply_Node_Quaternion, /* <Header> <ID = 0> <Command_Reply_Node_Quaternion> <Node ID> <w> <x> <y> <z> (In IEEE754) */
+        Start_Streaming, /* <Header> <BROADCAST_ID> <Command_Start_Streaming> <ID bitmap> <Period> */
+        Stop_Streaming, /* <Header> <BROADCAST_ID> <Command_Stop_Streaming> */
+        Set_Format, /* <Header> <ID> <Command_Set_Format> <Format> (Ack required) */
+        Reply_Compact_Quaternion, /* <Header> <ID = 0> <Command_Reply_Compact_Quaternion> <Node ID> <Data (48bit)> */
+        Program_All, /* <Header> <BROADCAST_ID> <Command_Program_All> <ID bitmap> <Number of pages> */
+        Program_Block, /* <Header> <BROADCAST_ID> <Command_Program_Block> <Block index> <Units> */
+        Resend_Page, /* <Header> <BROADCAST_ID> <Command_Resend_Page> <Page> <Unit> */
+        Read_Program_Status, /* <Header> <BROADCAST_ID> <Command_Read_Program_Status> <ID> */
+        Reply_Program_Status, /* <Header> <ID = 0> <Command_Reply_Program_Status> <Missing pages> */
+        Finish_Program, /* <Header> <BROADCAST_ID> <Command_Finish_Program> <0> */
+        Read_Page_CRCs, /* <Header> <ID> <Command_Read_Page_CRCs> <First page> */
+        Reply_Page_CRCs, /* <Header> <ID = 0> <Command_Reply_Page_CRCs> <First page> <CRC16 x PAGE_CRCS_PER_REPLY> */
+        Patch_All, /* <Header> <BROADCAST_ID> <Command_Patch_All> <ID bitmap> <Number of pages> */
+        Set_Fast_Boot, /* <Header> <ID> <Command_Set_Fast_Boot> <1(Enable)/0(Disable)> (Ack required) */
+        Read_DMP_Status, /* <Header> <ID> <Command_Read_DMP_Status> */
+        Reply_DMP_Status, /* <Header> <ID = 0> <Command_Reply_DMP_Status> <DMP status> <CRC16> */
+        Resume_DMP, /* <Header> <ID> <Command_Resume_DMP> (Ack required) */
+        Set_Rate, /* <Header> <ID> <Command_Set_Rate> <Rate> (Ack required) */
+        Read_History, /* <Header> <ID> <Command_Read_History> <Sequence (16bit)> */
+        Reply_History, /* <Header> <ID = 0> <Command_Reply_History> <Sequence (16bit)> <Count> <Data (48bit) * Count> */
+        Read_Stamped_Quaternion, /* <Header> <ID> <Command_Read_Stamped_Quaternion> */
+        Reply_Stamped_Quaternion, /* <Header> <ID = 0> <Command_Reply_Stamped_Quaternion> <Sequence (16bit)> <Timestamp (32bit)> <Data (48bit)> */
+        Latch, /* <Header> <BROADCAST_ID> <Command_Latch> */
+        Read_Latched_Quaternion, /* <Header> <ID> <Command_Read_Latched_Quaternion> */
+        Reply_Latched_Quaternion, /* <Header> <ID = 0> <Command_Reply_Latched_Quaternion> <Node ID> <Sequence (16bit)> <Age (16bit)> <Data (48bit)> */
+        Sync, /* <Header> <BROADCAST_ID> <Command_Sync> <Host time (32bit)> */
     };
 
-    private void WriteBytesWithMasking(byte[] bytes) {
-        List<byte> array = new List<byte>(bytes);
-        int searchLocation = 0;
-        int searchLength = array.Count;
-        while (true) {
-            int ffIndex = array.IndexOf(PacketHeader, searchLocation, searchLength);
-            if (ffIndex < 0) {
-                break;
+    enum DMPStatus {
+        Waiting, /* Waiting for DMP firmware upload or Command_Resume_DMP */
+        Running,
+    };
+
+    /* COBS eliminating PacketHeader, see Protocol.h */
+    /* encoded must have (length + length / 253 + 1) bytes from offset, returns the encoded length */
+    private static int Encode(byte[] data, int length, byte[] encoded, int offset) {
+        int codeIndex = offset;
+        int outIndex = offset + 1;
+        for (int index = 0; index < length; ++index) {
+            if (data[index] == PacketHeader) {
+                encoded[codeIndex] = (byte)(outIndex - codeIndex);
+                codeIndex = outIndex++;
+                continue;
+            }
+            encoded[outIndex++] = data[index];
+            if (outIndex - codeIndex == 0xFE) {
+                /* Longest chunk, which is not followed by PacketHeader */
+                encoded[codeIndex] = 0xFE;
+                codeIndex = outIndex++;
             }
-            array.Insert(ffIndex + 1, 0x00);
-            searchLocation = ffIndex + 2;
-            searchLength = array.Count - searchLocation;
         }
-        serial.Write(array.ToArray(), 0, array.Count);
+        encoded[codeIndex] = (byte)(outIndex - codeIndex);
+        return outIndex - offset;
     }
 
-    private byte ReadByte() {
-        return (byte)serial.ReadByte();
+    /* CRC-16/CCITT-FALSE, crc starts from 0xFFFF */
+    private static int CRC16(int crc, byte[] data, int offset, int length) {
+        for (int index = offset; index < offset + length; ++index) {
+            crc ^= data[index] << 8;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc & 0xFFFF;
     }
 
-    private void ReadBytesWithUnmasking(byte[] bytes) {
-        for (int index = 0; index < bytes.Length; ++index) {
-            byte aByte = ReadByte();
-            if (aByte == PacketHeader) {
-                ReadByte();
+    /* LZSS of the DMP firmware, see Protocol.h */
+    private static byte[] Compress(byte[] data, int length) {
+        List<byte> compressed = new List<byte>(length);
+        int bitBuffer = 0;
+        int bitCount = 0;
+        void WriteBits(int value, int count) {
+            bitBuffer = (bitBuffer << count) | value;
+            bitCount += count;
+            while (bitCount >= 8) {
+                bitCount -= 8;
+                compressed.Add((byte)(bitBuffer >> bitCount));
             }
-            bytes[index] = aByte;
+        }
+
+        int position = 0;
+        while (position < length) {
+            int bestLength = 0;
+            int bestDistance = 0;
+            for (int distance = 1; distance <= Math.Min(DMPWindowLength, position); ++distance) {
+                int matchLength = 0;
+                while (matchLength < DMPMaxMatchLength && position + matchLength < length
+                       && data[position + matchLength - distance] == data[position + matchLength]) {
+                    ++matchLength;
+                }
+                if (matchLength > bestLength) {
+                    bestLength = matchLength;
+                    bestDistance = distance;
+                }
+            }
+            if (bestLength >= 2) {
+                WriteBits(0, 1);
+                WriteBits(bestDistance - 1, 8);
+                WriteBits(bestLength - 2, 4);
+                position += bestLength;
+            } else {
+                WriteBits(1, 1);
+                WriteBits(data[position], 8);
+                position += 1;
+            }
+        }
+        if (bitCount > 0) {
+            WriteBits(0, 8 - bitCount);
+        }
+        /* Node reads the stream in chunks of 16 bytes */
+        while (compressed.Count % 16 != 0) {
+            compressed.Add(0);
+        }
+        return compressed.ToArray();
+    }
+
+    /**
+     * Buffers shared by the trackers on a serial port, so that requests and replies allocate nothing.
+     * Callers of a serial port must be one thread at a time, as they are for the port itself.
+     */
+    private class Link {
+        public SerialPort Serial;
+        public PacketReader Reader;
+        public byte[] Request = new byte[MaxRequestLength]; /* Parameters are put after the command at 0 */
+        public byte[] TxPacket = new byte[2 * (2 + MaxRequestLength + MaxRequestLength / 253 + 1)]; /* Room for two packets written at once */
+        public int StreamingPeriod; /* In microseconds, requested by StartStreaming() */
+
+        public Link(SerialPort serial) {
+            Serial = serial;
+            Reader = new PacketReader(serial);
+        }
+    }
+
+    private static Link LinkOf(SerialPort serial) {
+        return links.GetValue(serial, createLink);
+    }
+
+    /* Parameters are put in link.Request from index 1 */
+    /* Encodes the packet into link.TxPacket from offset, returns the end of it */
+    private static int StagePacket(Link link, int offset, byte id, CommandID command, int parameterLength = 0) {
+        link.Request[0] = (byte)command;
+        link.TxPacket[offset] = PacketHeader;
+        link.TxPacket[offset + 1] = id;
+        return offset + 2 + Encode(link.Request, 1 + parameterLength, link.TxPacket, offset + 2);
+    }
+
+    private static void WritePacket(Link link, byte id, CommandID command, int parameterLength = 0) {
+        link.Serial.Write(link.TxPacket, 0, StagePacket(link, 0, id, command, parameterLength));
+    }
+
+    private void WritePacket(CommandID command, int parameterLength = 0) {
+        WritePacket(link, id, command, parameterLength);
+    }
+
+    /* Little endian, like BitConverter on the hosts but without allocation */
+    private static void PutBytes(byte[] buffer, int offset, ulong value, int length) {
+        for (int index = 0; index < length; ++index) {
+            buffer[offset + index] = (byte)(value >> (8 * index));
+        }
+    }
+
+    /* Decoded length of the reply, which may be unknown until its first bytes (0 for unknown commands) */
+    private static int ReplyLength(byte[] packet, int length) {
+        switch (packet[0]) {
+            case (byte)CommandID.Reply_Ack:
+            case (byte)CommandID.Reply_Compass_Accuracy:
+                return 2;
+            case (byte)CommandID.Reply_Quaternion:
+                return 17;
+            case (byte)CommandID.Reply_Node_Quaternion:
+                return 18;
+            case (byte)CommandID.Reply_Compact_Quaternion:
+                return 8;
+            case (byte)CommandID.Reply_DMP_Status:
+                return 4;
+            case (byte)CommandID.Reply_History:
+                if (length < 4) {
+                    return 4;
+                }
+                return packet[3] <= HistoryLength ? 4 + packet[3] * 6 : 0;
+            case (byte)CommandID.Reply_Stamped_Quaternion:
+                return 13;
+            case (byte)CommandID.Reply_Latched_Quaternion:
+                return 12;
+            default:
+                return 0;
         }
     }
 
-    private void ReadHeader() {
-        while (true) {
-            byte header = ReadByte();
-            if (header != PacketHeader) {
+    private enum ParserState {
+        WaitingForHeader,
+        WaitingForID,
+        Receiving,
+    }
+
+    /**
+     * Finds replies (<Header> <ID = 0> ...) in bytes read from the serial port, same as quiks_parse().
+     * Bytes are read as many as available at once, and a reply may be split across reads.
+     * A reply broken by another header is dropped, and parsing resumes from that header.
+     */
+    private class PacketReader {
+        public byte[] Packet = new byte[MaxReplyLength]; /* Decoded <Command> <Parameters> */
+        private SerialPort serial;
+        private byte[] buffer = new byte[ReceiveBufferLength];
+        private int position = 0;
+        private int end = 0;
+        private ParserState state = ParserState.WaitingForHeader;
+        private int length = 0;
+        private int bytesInChunk = 0;
+        private bool chunkEndsWithHeader = false;
+
+        public PacketReader(SerialPort _serial) {
+            serial = _serial;
+        }
+
+        /* Blocks until the next reply, throws TimeoutException as SerialPort.Read() */
+        /* Returns Packet, which is valid until the next call */
+        public byte[] ReadPacket() {
+            while (true) {
+                if (position == end) {
+                    Receive();
+                }
+                if (Parse()) {
+                    return Packet;
+                }
+            }
+        }
+
+        /* Reads a byte as it is, and drops the reply being parsed */
+        public byte ReadRawByte() {
+            if (position == end) {
+                Receive();
+            }
+            state = ParserState.WaitingForHeader;
+            return buffer[position++];
+        }
+
+        private void Receive() {
+            /* Blocks until the first byte comes */
+            end = serial.Read(buffer, 0, buffer.Length);
+            position = 0;
+        }
+
+        /* Consumes received bytes until a reply completes, returns false if not completed yet */
+        private bool Parse() {
+            while (position < end) {
+                byte aByte = buffer[position];
+                if (aByte == PacketHeader) {
+                    /* PacketHeader never appears in encoded data, so it always starts a packet */
+                    ++position;
+                    state = ParserState.WaitingForID;
+                    continue;
+                }
+                switch (state) {
+                    case ParserState.WaitingForID:
+                        ++position;
+                        if (aByte == 0) {
+                            state = ParserState.Receiving;
+                            length = 0;
+                            bytesInChunk = 0;
+                            chunkEndsWithHeader = false;
+                        } else {
+                            /* Requests from host are not for us */
+                            state = ParserState.WaitingForHeader;
+                        }
+                        continue;
+
+                    case ParserState.Receiving:
+                        if (bytesInChunk == 0) {
+                            ++position;
+                            bool shouldInsertHeader = chunkEndsWithHeader;
+                            bytesInChunk = aByte - 1;
+                            chunkEndsWithHeader = aByte != 0xFE;
+                            if (! shouldInsertHeader) {
+                                continue;
+                            }
+                            Packet[length++] = PacketHeader;
+                        } else {
+                            /* Data bytes of the chunk are copied at once, up to the end of the reply */
+                            int run = Math.Min(bytesInChunk, end - position);
+                            run = Math.Min(run, length == 0 ? 1 : ReplyLength(Packet, length) - length);
+                            int header = Array.IndexOf(buffer, PacketHeader, position, run);
+                            if (header >= 0) {
+                                run = header - position;
+                            }
+                            Buffer.BlockCopy(buffer, position, Packet, length, run);
+                            position += run;
+                            bytesInChunk -= run;
+                            length += run;
+                            if (run == 0) {
+                                continue;
+                            }
+                        }
+                        int expected = ReplyLength(Packet, length);
+                        if (length == expected) {
+                            state = ParserState.WaitingForHeader;
+                            return true;
+                        }
+                        if (expected == 0 || length >= Packet.Length) {
+                            state = ParserState.WaitingForHeader;
+                        }
+                        continue;
+
+                    default:
+                        ++position;
+                        continue;
+                }
+            }
+            return false;
+        }
+    }
+
+    /* Keeps the latest rotations with timestamps (us) to render them at any time */
+    /* Only the rendering thread touches it, rotations come through the pose of TrackerManager */
+    private class RotationBuffer {
+        private const int Length = 8;
+        private uint[] timestamps = new uint[Length];
+        private Quaternion[] rotations = new Quaternion[Length];
+        private int count = 0;
+        private int next = 0;
+
+        public void Add(uint timestamp, Quaternion rotation) {
+            if (count > 0 && (int)(timestamp - timestamps[(next + Length - 1) % Length]) <= 0) {
+                /* Same sample again, or older than the latest */
+                return;
+            }
+            timestamps[next] = timestamp;
+            rotations[next] = rotation;
+            next = (next + 1) % Length;
+            count = Math.Min(count + 1, Length);
+        }
+
+        /* Interpolates between the samples around the timestamp, or extrapolates up to maxExtrapolation (us) */
+        public bool Sample(uint timestamp, uint maxExtrapolation, out Quaternion rotation) {
+            rotation = Quaternion.identity;
+            if (count == 0) {
+                return false;
+            }
+            int oldest = (next + Length - count) % Length;
+            if (count == 1 || (int)(timestamp - timestamps[oldest]) <= 0) {
+                /* Before the oldest, or nothing to interpolate with */
+                rotation = rotations[oldest];
+                return true;
+            }
+            int newer = (next + Length - 1) % Length;
+            int older = (newer + Length - 1) % Length;
+            for (int index = 1; index < count - 1 && (int)(timestamp - timestamps[older]) < 0; ++index) {
+                newer = older;
+                older = (older + Length - 1) % Length;
+            }
+            int elapsed = (int)(timestamp - timestamps[older]);
+            if (elapsed > (int)(timestamps[newer] - timestamps[older])) {
+                /* After the latest */
+                elapsed = Math.Min(elapsed, (int)(timestamps[newer] - timestamps[older] + maxExtrapolation));
+            }
+            float t = (float)elapsed / (int)(timestamps[newer] - timestamps[older]);
+            rotation = Quaternion.SlerpUnclamped(rotations[older], rotations[newer], t);
+            return true;
+        }
+    }
+
+    private static Quaternion DecodeRotation(byte[] rxData, int offset) {
+        return new Quaternion(BitConverter.ToSingle(rxData, offset + 4),
+                              BitConverter.ToSingle(rxData, offset + 8),
+                              BitConverter.ToSingle(rxData, offset + 12),
+                              BitConverter.ToSingle(rxData, offset + 0));
+    }
+
+    /* See Command_Reply_Compact_Quaternion in Protocol.h */
+    private static Quaternion DecodeCompactRotation(byte[] rxData, int offset) {
+        ulong packed = 0;
+        for (int index = 0; index < 6; ++index) {
+            packed |= (ulong)rxData[offset + index] << (8 * index);
+        }
+        int largest = (int)(packed & 0b11);
+        float w = 0, x = 0, y = 0, z = 0;
+        float sum = 0;
+        int shift = 2;
+        for (int index = 0; index < 4; ++index) {
+            if (index == largest) {
                 continue;
             }
-            byte hostID = ReadByte();
-            if (hostID == 0) {
-                break;
+            float component = (float)(((packed >> shift) & 0x7FFF) / 32767.0 * Math.Sqrt(2) - Math.Sqrt(0.5));
+            sum += component * component;
+            shift += 15;
+            switch (index) {
+                case 0: w = component; break;
+                case 1: x = component; break;
+                case 2: y = component; break;
+                case 3: z = component; break;
             }
         }
+        float largestComponent = (float)Math.Sqrt(Math.Max(0, 1 - sum));
+        switch (largest) {
+            case 0: w = largestComponent; break;
+            case 1: x = largestComponent; break;
+            case 2: y = largestComponent; break;
+            case 3: z = largestComponent; break;
+        }
+        return new Quaternion(x, y, z, w);
     }
 
     public Tracker(SerialPort _serial, byte _id, Transform _bone) {
         serial = _serial;
+        link = LinkOf(serial);
         id = _id;
         bone = _bone;
-        byte[] pingPacket = new byte[] {PacketHeader, id, (byte)CommandID.Ping};
-        serial.Write(pingPacket, 0, pingPacket.Length);
-        byte[] ackPacket = new byte[4];
-        serial.Read(ackPacket, 0, ackPacket.Length);
+        byte[] readLatched = new byte[] {(byte)CommandID.Read_Latched_Quaternion};
+        latchedRequest = new byte[2 + readLatched.Length + 1];
+        latchedRequest[0] = PacketHeader;
+        latchedRequest[1] = id;
+        Encode(readLatched, readLatched.Length, latchedRequest, 2);
+        WritePacket(CommandID.Ping);
+        link.Reader.ReadPacket();
     }
 
+    /**
+     * Upload DMP firmware to every tracker waiting for it, and wait until they decode it.
+     * A tracker which could not keep up with the stream keeps waiting, so check trackers by ResumeDMP() after this.
+     */
     public static void Launch(SerialPort serial) {
-        serial.Write(DMPFirmware.data, 0, DMPFirmware.data.Length);
+        if (compressedDMPFirmware == null) {
+            compressedDMPFirmware = Compress(DMPFirmware.data, DMPFirmwareLength);
+        }
+        int length = compressedDMPFirmware.Length;
+        byte[] packet = new byte[2 + length + length / 253 + 1];
+        packet[0] = PacketHeader;
+        packet[1] = DMPUploadID;
+        length = Encode(compressedDMPFirmware, length, packet, 2);
+        serial.Write(packet, 0, 2 + length);
+        /* Trackers still decoding would take the next request as a part of the stream */
+        Thread.Sleep((2 + length) * 10 * 1000 / serial.BaudRate + AdapterLatency + DMPDecodeTime);
+    }
+
+    /**
+     * Enable DMP with the firmware left in the IMU, if it is the same as DMPFirmware.
+     * IMU keeps the firmware while powered, e.g. when only the host or the tracker restarted.
+     *
+     * @returns A boolean value which describes whether the tracker runs DMP without upload.
+     */
+    public bool ResumeDMP() {
+        WritePacket(CommandID.Read_DMP_Status);
+        byte[] rxData;
+        int timeout = serial.ReadTimeout;
+        serial.ReadTimeout = DMPReadBackTimeout;
+        try {
+            rxData = link.Reader.ReadPacket();
+        }
+        catch (TimeoutException) {
+            return false;
+        }
+        finally {
+            serial.ReadTimeout = timeout;
+        }
+        if (rxData[0] != (byte)CommandID.Reply_DMP_Status) {
+            return false;
+        }
+        if (rxData[1] == (byte)DMPStatus.Running) {
+            return true;
+        }
+        if (dmpFirmwareCRC < 0) {
+            /* Nodes leave out the chunks written after upload, as the firmware does not stay there */
+            int crc = 0xFFFF;
+            for (int offset = 0; offset < DMPFirmwareLength; offset += 16) {
+                if (Array.IndexOf(DMPVolatileChunks, offset / 16) < 0) {
+                    crc = CRC16(crc, DMPFirmware.data, offset, Math.Min(16, DMPFirmwareLength - offset));
+                }
+            }
+            dmpFirmwareCRC = crc;
+        }
+        if (BitConverter.ToUInt16(rxData, 2) != dmpFirmwareCRC) {
+            return false;
+        }
+        WritePacket(CommandID.Resume_DMP);
+        ReadAcknowledge();
+        return true;
     }
 
     private Quaternion ReadRotation() {
-        byte[] txPacket = new byte[] {PacketHeader, id, (byte)CommandID.Read_Quaternion};
-        serial.Write(txPacket, 0, txPacket.Length);
-        byte[] rxData = new byte[16];
+        WritePacket(CommandID.Read_Quaternion);
         try {
-            ReadHeader();
-            if (ReadByte() != (byte)CommandID.Reply_Quaternion) {
-                throw new Exception("Read rotation failed");
+            byte[] rxData = link.Reader.ReadPacket();
+            switch (rxData[0]) {
+                case (byte)CommandID.Reply_Quaternion:
+                    return DecodeRotation(rxData, 1);
+
+                case (byte)CommandID.Reply_Compact_Quaternion:
+                    return DecodeCompactRotation(rxData, 2);
+
+                default:
+                    throw new Exception("Read rotation failed");
             }
-            ReadBytesWithUnmasking(rxData);
         }
         catch (TimeoutException) {
             return ReadRotation();
         }
-        return new Quaternion(BitConverter.ToSingle(rxData, 4),
-                              BitConverter.ToSingle(rxData, 8),
-                              BitConverter.ToSingle(rxData, 12),
-                              BitConverter.ToSingle(rxData, 0));
+    }
+
+    /**
+     * Read every rotation sampled since the last call, oldest first.
+     * A tracker keeps the last HistoryLength samples, so polls may be late without losing them.
+     * Samples dropped before being read are counted in LostSamples.
+     */
+    public List<Quaternion> ReadHistory() {
+        List<Quaternion> rotations = new List<Quaternion>(HistoryLength);
+        ReadHistory(rotations);
+        return rotations;
+    }
+
+    /* Same as ReadHistory(), but the rotations replace the items of the list without allocation */
+    public void ReadHistory(List<Quaternion> rotations) {
+        PutBytes(link.Request, 1, (ushort)Math.Max(historySequence, 0), 2);
+        WritePacket(CommandID.Read_History, 2);
+        byte[] rxData = link.Reader.ReadPacket();
+        if (rxData[0] != (byte)CommandID.Reply_History) {
+            throw new Exception("Read history failed");
+        }
+        ushort sequence = BitConverter.ToUInt16(rxData, 1);
+        int count = rxData[3];
+        if (historySequence >= 0) {
+            lostSamples += (ushort)(sequence - historySequence);
+        }
+        historySequence = (ushort)(sequence + count);
+        rotations.Clear();
+        for (int sample = 0; sample < count; ++sample) {
+            rotations.Add(DecodeCompactRotation(rxData, 4 + sample * 6));
+        }
+        if (count > 0) {
+            UpdateRotation(HostTimestamp, rotations[count - 1]);
+        }
+    }
+
+    public int LostSamples {
+        get { return lostSamples; }
+    }
+
+    /**
+     * Read the latest rotation with its sequence and the time it was sampled.
+     * Same sequence as the last read means the tracker has no newer sample.
+     */
+    public void PrepareStampedRotation() {
+        WritePacket(CommandID.Read_Stamped_Quaternion);
+        byte[] rxData = link.Reader.ReadPacket();
+        if (rxData[0] != (byte)CommandID.Reply_Stamped_Quaternion) {
+            throw new Exception("Read stamped rotation failed");
+        }
+        sampleSequence = BitConverter.ToUInt16(rxData, 1);
+        sampleTimestamp = BitConverter.ToUInt32(rxData, 3);
+        UpdateRotation(sampleTimestamp, DecodeCompactRotation(rxData, 7));
+    }
+
+    /* Sequence of the rotation read by PrepareStampedRotation(), see Command_Read_History */
+    public ushort SampleSequence {
+        get { return sampleSequence; }
+    }
+
+    /* Time when the rotation was sampled, in seconds of HostTime once SynchronizeClocks() is called */
+    public double SampleTime {
+        get { return sampleTimestamp / TimestampClock; }
+    }
+
+    /* Raw timestamp in microseconds, see Command_Reply_Stamped_Quaternion */
+    public uint SampleTimestamp {
+        get { return sampleTimestamp; }
+    }
+
+    /* Seconds from one timestamp to another, correct within 71 minutes */
+    public static double SampleInterval(uint fromTimestamp, uint toTimestamp) {
+        return (uint)(toTimestamp - fromTimestamp) / TimestampClock;
+    }
+
+    /* Clock shared with trackers by SynchronizeClocks(), in microseconds (wraps around every 71 minutes) */
+    public static uint HostTimestamp {
+        get { return (uint)(ulong)(hostClock.ElapsedTicks * TimestampClock / System.Diagnostics.Stopwatch.Frequency); }
+    }
+
+    /**
+     * Send a sync beacon, with which all trackers follow HostTimestamp.
+     * Call this periodically (e.g. every second) so that trackers track the drift of their clocks.
+     * Latency of the serial port is not compensated, but it is common to all trackers.
+     */
+    public static void SynchronizeClocks(SerialPort serial) {
+        Link link = LinkOf(serial);
+        PutBytes(link.Request, 1, HostTimestamp, 4);
+        WritePacket(link, BroadcastID, CommandID.Sync, 4);
+    }
+
+    /* Slot should fit the longest reply of trackers */
+    private static byte SlotLength(List<Tracker> trackers) {
+        byte slotLength = CompactQuaternionSlotLength;
+        foreach (var tracker in trackers) {
+            if (tracker.format == Format.Float) {
+                slotLength = NodeQuaternionSlotLength;
+            }
+        }
+        return slotLength;
+    }
+
+    /* Microseconds of a slot on the bus, 10 bits per byte */
+    private static double SlotDuration(SerialPort serial, byte slotLength) {
+        return slotLength * 10 * 1e6 / serial.BaudRate + BroadcastGuardUS;
+    }
+
+    /**
+     * Read rotations of all trackers with one broadcast request.
+     * Each tracker replies in its own time slot, so the bus turns around only once.
+     * Trackers which did not reply in time keep their previous rotation.
+     *
+     * @returns The number of trackers which replied.
+     *
+     * @note
+     * Only trackers with ID less than 64 can be addressed.
+     */
+    public static int PrepareRotations(SerialPort serial, List<Tracker> trackers) {
+        Link link = LinkOf(serial);
+        byte slotLength = SlotLength(trackers);
+        PutBytes(link.Request, 1, IDBitmap(trackers), 8);
+        link.Request[9] = slotLength;
+        WritePacket(link, BroadcastID, CommandID.Read_All_Quaternions, 9);
+        /* The request itself takes about one slot */
+        double window = (trackers.Count + 1) * SlotDuration(serial, slotLength);
+        return ReadNodeRotations(link, trackers, window / 1000 + AdapterLatency);
+    }
+
+    /**
+     * Let all trackers keep their rotations at the same moment, and then read them one by one.
+     * A tracker which did not reply keeps the previous rotation.
+     *
+     * @note
+     * RS485 is half duplex, so only one request is outstanding at a time; another one would collide with the reply.
+     * Instead, the latch goes out in the same write as the first request, each request is encoded beforehand,
+     * and it is written as soon as the previous reply is framed. That reply is decoded while the next one is on the wire.
+     * Each tracker is waited for LatchedReplyTimeout at most, and a tracker missing replies is then
+     * skipped for polls doubling up to 2^MaxSkippedPollsShift - 1, not to delay the others every time.
+     */
+    public static void PrepareLatchedRotations(SerialPort serial, List<Tracker> trackers) {
+        Link link = LinkOf(serial);
+        int length = StagePacket(link, 0, BroadcastID, CommandID.Latch);
+        uint latchTimestamp = HostTimestamp;
+        Tracker replied = null; /* Its reply stays in link.Reader.Packet until the next one is read */
+        int timeout = serial.ReadTimeout;
+        serial.ReadTimeout = LatchedReplyTimeout;
+        try {
+            foreach (var tracker in trackers) {
+                if (tracker.pollsToSkip > 0) {
+                    --tracker.pollsToSkip;
+                    continue;
+                }
+                Buffer.BlockCopy(tracker.latchedRequest, 0, link.TxPacket, length, tracker.latchedRequest.Length);
+                serial.Write(link.TxPacket, 0, length + tracker.latchedRequest.Length);
+                length = 0;
+                if (replied != null) {
+                    replied.DecodeLatchedRotation(link.Reader.Packet, latchTimestamp);
+                    replied = null;
+                }
+                try {
+                    tracker.ReadLatchedReply();
+                    tracker.missedReplies = 0;
+                    replied = tracker;
+                }
+                catch (TimeoutException) {
+                    tracker.missedReplies = Math.Min(tracker.missedReplies + 1, MaxSkippedPollsShift);
+                    tracker.pollsToSkip = (1 << tracker.missedReplies) - 1;
+                }
+            }
+            if (replied != null) {
+                replied.DecodeLatchedRotation(link.Reader.Packet, latchTimestamp);
+            }
+            if (length > 0) {
+                /* Every tracker is skipped this time */
+                serial.Write(link.TxPacket, 0, length);
+            }
+        }
+        finally {
+            serial.ReadTimeout = timeout;
+        }
+    }
+
+    /* Leaves the reply in link.Reader.Packet */
+    private void ReadLatchedReply() {
+        byte[] rxData;
+        do {
+            rxData = link.Reader.ReadPacket();
+            if (rxData[0] != (byte)CommandID.Reply_Latched_Quaternion) {
+                throw new Exception("Read latched rotation failed");
+            }
+            /* Late replies of the trackers before, which timed out, are thrown away */
+        } while (rxData[1] != id);
+    }
+
+    private void DecodeLatchedRotation(byte[] rxData, uint latchTimestamp) {
+        sampleSequence = BitConverter.ToUInt16(rxData, 2);
+        latchAge = BitConverter.ToUInt16(rxData, 4);
+        UpdateRotation(latchTimestamp - (uint)latchAge, DecodeCompactRotation(rxData, 6));
+    }
+
+    /* Seconds from the sample to the latch, of the rotation read by PrepareLatchedRotations() */
+    public double LatchAge {
+        get { return latchAge / 1e6; }
+    }
+
+    private static ulong IDBitmap(List<Tracker> trackers) {
+        ulong idBitmap = 0;
+        foreach (var tracker in trackers) {
+            idBitmap |= 1UL << tracker.id;
+        }
+        return idBitmap;
+    }
+
+    /* Returns ID of the tracker which replied, or 0 if the packet is not a rotation */
+    private static byte ReadNodeRotation(Link link, List<Tracker> trackers) {
+        byte[] rxData = link.Reader.ReadPacket();
+        bool isCompact;
+        switch (rxData[0]) {
+            case (byte)CommandID.Reply_Node_Quaternion:
+                isCompact = false;
+                break;
+
+            case (byte)CommandID.Reply_Compact_Quaternion:
+                isCompact = true;
+                break;
+
+            default:
+                return 0;
+        }
+        foreach (var tracker in trackers) {
+            if (tracker.id == rxData[1]) {
+                tracker.UpdateRotation(HostTimestamp, isCompact ? DecodeCompactRotation(rxData, 2) : DecodeRotation(rxData, 2));
+                return tracker.id;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Read replies in time slots for window milliseconds at most, returns the number of trackers which replied.
+     * A tracker missing its slot does not make the others wait for ReadTimeout.
+     */
+    private static int ReadNodeRotations(Link link, List<Tracker> trackers, double window) {
+        double deadline = hostClock.Elapsed.TotalMilliseconds + window;
+        int timeout = link.Serial.ReadTimeout;
+        int received = 0;
+        try {
+            while (received < trackers.Count) {
+                double remaining = deadline - hostClock.Elapsed.TotalMilliseconds;
+                if (remaining <= 0) {
+                    break;
+                }
+                link.Serial.ReadTimeout = (int)Math.Ceiling(remaining);
+                if (ReadNodeRotation(link, trackers) != 0) {
+                    ++received;
+                }
+            }
+        }
+        catch (TimeoutException) {
+        }
+        finally {
+            link.Serial.ReadTimeout = timeout;
+        }
+        return received;
+    }
+
+    /**
+     * Let all trackers send their rotations periodically without request.
+     *
+     * @param period Period of sending in microseconds, which is extended to fit all the trackers.
+     */
+    public static void StartStreaming(SerialPort serial, List<Tracker> trackers, int period) {
+        Link link = LinkOf(serial);
+        PutBytes(link.Request, 1, IDBitmap(trackers), 8);
+        link.Request[9] = SlotLength(trackers);
+        PutBytes(link.Request, 10, (ushort)period, 2);
+        WritePacket(link, BroadcastID, CommandID.Start_Streaming, 11);
+        link.StreamingPeriod = period;
+    }
+
+    /**
+     * Receive rotations sent by streaming trackers for one period.
+     *
+     * @returns The number of trackers which sent their rotations.
+     */
+    public static int ReadStreamedRotations(SerialPort serial, List<Tracker> trackers) {
+        Link link = LinkOf(serial);
+        /* Trackers extend the period to their slots and the host slot */
+        double period = Math.Max(link.StreamingPeriod, (trackers.Count + 1) * SlotDuration(serial, SlotLength(trackers)));
+        return ReadNodeRotations(link, trackers, period / 1000 + AdapterLatency);
+    }
+
+    /**
+     * Stop streaming of all trackers.
+     * Stop request is sent in the host slot, right after the tracker of the largest ID replied.
+     */
+    public static void StopStreaming(SerialPort serial, List<Tracker> trackers) {
+        byte lastID = 0;
+        foreach (var tracker in trackers) {
+            lastID = Math.Max(lastID, tracker.id);
+        }
+        Link link = LinkOf(serial);
+        for (int retry = 0; retry < 10; ++retry) {
+            try {
+                while (ReadNodeRotation(link, trackers) != lastID) ;
+            }
+            catch (TimeoutException) {
+                /* Already stopped, or the last tracker is missing */
+            }
+            WritePacket(link, BroadcastID, CommandID.Stop_Streaming);
+            try {
+                /* Bus gets silent if all trackers stopped */
+                for (int count = 0; count < 64; ++count) {
+                    link.Reader.ReadRawByte();
+                }
+            }
+            catch (TimeoutException) {
+                return;
+            }
+        }
+        throw new Exception("Trackers did not stop streaming");
     }
 
     private void ReadAcknowledge() {
-        ReadHeader();
-        byte[] rxPacket = new byte[2];
-        serial.Read(rxPacket, 0, rxPacket.Length);
-        if (! (rxPacket[0] == (byte)CommandID.Reply_Ack && rxPacket[1] == 1)) {
+        byte[] rxData = link.Reader.ReadPacket();
+        if (! (rxData[0] == (byte)CommandID.Reply_Ack && rxData[1] == 1)) {
             throw new Exception("Slave did not send acknowledge");
         }
     }
 
     public void SetChipOffset() {
-        byte[] txPacket = new byte[] {PacketHeader, id, (byte)CommandID.Set_Chip_Offset};
-        serial.Write(txPacket, 0, txPacket.Length);
+        WritePacket(CommandID.Set_Chip_Offset);
         ReadAcknowledge();
     }
 
     public void SetUnityOffset() {
         Quaternion offset = bone.rotation;
-        byte[] txHead = new byte[] {PacketHeader, id, (byte)CommandID.Set_Unity_Offset};
-        serial.Write(txHead, 0, txHead.Length);
-        WriteBytesWithMasking(BitConverter.GetBytes((int)(offset.w * Math.Pow(2, 30))));
-        WriteBytesWithMasking(BitConverter.GetBytes((int)(offset.x * Math.Pow(2, 30))));
-        WriteBytesWithMasking(BitConverter.GetBytes((int)(offset.y * Math.Pow(2, 30))));
-        WriteBytesWithMasking(BitConverter.GetBytes((int)(offset.z * Math.Pow(2, 30))));
+        PutBytes(link.Request, 1, (uint)(int)(offset.w * Math.Pow(2, 30)), 4);
+        PutBytes(link.Request, 5, (uint)(int)(offset.x * Math.Pow(2, 30)), 4);
+        PutBytes(link.Request, 9, (uint)(int)(offset.y * Math.Pow(2, 30)), 4);
+        PutBytes(link.Request, 13, (uint)(int)(offset.z * Math.Pow(2, 30)), 4);
+        WritePacket(CommandID.Set_Unity_Offset, 16);
         ReadAcknowledge();
     }
 
     public void PrepareRotation() {
-        quat = ReadRotation();
+        UpdateRotation(HostTimestamp, ReadRotation());
     }
 
+    /**
+     * Assign the rotation of the latest pose taken by TrackerManager.SetRotations().
+     * Rotations read by the methods of Tracker are taken after TrackerManager.PublishRotations().
+     */
     public void SetRotation() {
-        bone.rotation = quat;
+        bone.rotation = poseRotation;
+    }
+
+    /* Rotations are timestamped when received, or with Command_Reply_Stamped_Quaternion if read so */
+    private void UpdateRotation(uint timestamp, Quaternion rotation) {
+        quat = rotation;
+        quatTimestamp = timestamp;
+        hasRotation = true;
+    }
+
+    /* Latest rotation for TrackerManager to publish as a part of the pose, false if nothing is read yet */
+    public bool GetLatestRotation(out uint timestamp, out Quaternion rotation) {
+        timestamp = quatTimestamp;
+        rotation = quat;
+        return hasRotation;
+    }
+
+    /* Called by TrackerManager from the rendering thread with the rotation of the newest pose */
+    public void TakeRotation(uint timestamp, Quaternion rotation) {
+        poseRotation = rotation;
+        rotationBuffer.Add(timestamp, rotation);
+    }
+
+    /**
+     * Set the rotation at InterpolationDelay before now, interpolated between the rotations read.
+     * Unlike SetRotation(), motion stays smooth even if rotations arrive with jitter or slower than frames.
+     * Stamped rotations should be read after SynchronizeClocks(), so that they are in HostTimestamp.
+     */
+    public void SetInterpolatedRotation() {
+        SetInterpolatedRotation(HostTimestamp - (uint)(InterpolationDelay * TimestampClock));
+    }
+
+    /* Set the rotation at the timestamp (see HostTimestamp) */
+    public void SetInterpolatedRotation(uint renderTimestamp) {
+        Quaternion rotation;
+        if (rotationBuffer.Sample(renderTimestamp, (uint)(MaxExtrapolation * TimestampClock), out rotation)) {
+            bone.rotation = rotation;
+        }
     }
 
     public bool CheckIfCalibrated() {
         if (isCalibrated) {
             return true;
         }
-        byte[] txPacket = new byte[] {PacketHeader, id, (byte)CommandID.Read_Compass_Accuracy};
-        serial.Write(txPacket, 0, txPacket.Length);
+        WritePacket(CommandID.Read_Compass_Accuracy);
         try {
-            ReadHeader();
-            byte[] rxPacket = new byte[2];
-            serial.Read(rxPacket, 0, rxPacket.Length);
-            if (rxPacket[0] != (byte)CommandID.Reply_Compass_Accuracy) {
+            byte[] rxData = link.Reader.ReadPacket();
+            if (rxData[0] != (byte)CommandID.Reply_Compass_Accuracy) {
                 return false;
             }
-            if (rxPacket[1] >= 3) {
+            if (rxData[1] >= 3) {
                 isCalibrated = true;
                 Debug.LogFormat("Calibration done {0}", bone);
             }
@@ -181,14 +1016,44 @@ public class Tracker {
     }
 
     public void ChangeID(byte newID) {
-        byte[] txPacket = new byte[] {PacketHeader, id, (byte)CommandID.Set_ID, newID};
-        serial.Write(txPacket, 0, txPacket.Length);
+        link.Request[1] = newID;
+        WritePacket(CommandID.Set_ID, 1);
+        ReadAcknowledge();
+    }
+
+    /**
+     * Change the format of rotations sent by the tracker.
+     * Compact format makes packets less than half, which allows more trackers in one broadcast.
+     */
+    public void SetFormat(Format newFormat) {
+        link.Request[1] = (byte)newFormat;
+        WritePacket(CommandID.Set_Format, 1);
+        ReadAcknowledge();
+        format = newFormat;
+    }
+
+    /**
+     * Let the tracker skip the 2 seconds waiting for firmware update on power-up.
+     * The setting is kept only after Flash(), and programming a new firmware disables it.
+     */
+    public void SetFastBoot(bool isEnabled) {
+        link.Request[1] = (byte)(isEnabled ? 1 : 0);
+        WritePacket(CommandID.Set_Fast_Boot, 1);
+        ReadAcknowledge();
+    }
+
+    /**
+     * Change the output rate of the DMP. Higher rates keep up with fast motions.
+     * The setting is kept only after Flash().
+     */
+    public void SetRate(Rate newRate) {
+        link.Request[1] = (byte)newRate;
+        WritePacket(CommandID.Set_Rate, 1);
         ReadAcknowledge();
     }
 
     public void Flash() {
-        byte[] txPacket = new byte[] {PacketHeader, id, (byte)CommandID.Flash};
-        serial.Write(txPacket, 0, txPacket.Length);
+        WritePacket(CommandID.Flash);
         ReadAcknowledge();
     }
 }
@@ -20,15 +20,70 @@ using System;
 using System.IO.Ports;
 using System.Collections;
 using System.Collections.Generic;
+using System.Threading;
 
 /**
  * The TrackerManager class manages multiple trackers.
  * In most cases, you only need to access to this class.
  */
 public class TrackerManager {
+    private const int MaxDMPUploads = 3;
     private Animator anim;
     private SerialPort serial;
     private List<Tracker> trackers = new List<Tracker>();
+    private PoseBuffer poses = new PoseBuffer(0);
+
+    /* Rotations of all trackers at one moment, a tracker not read yet is not valid */
+    private class Pose {
+        public bool[] IsValid;
+        public uint[] Timestamps;
+        public Quaternion[] Rotations;
+
+        public Pose(int count) {
+            IsValid = new bool[count];
+            Timestamps = new uint[count];
+            Rotations = new Quaternion[count];
+        }
+    }
+
+    /**
+     * Triple buffer of poses between one reading thread and one rendering thread without locks.
+     * Reading thread fills Back and publishes it, then rendering thread takes the newest one as Front.
+     * Neither waits for the other, and Front never mixes two poses.
+     */
+    private class PoseBuffer {
+        private const int IsNewer = 4; /* Flag in shared, which is newer than front */
+        private Pose[] poses;
+        private int back = 0; /* Owned by reading thread */
+        private int shared = 1; /* Exchanged between the two */
+        private int front = 2; /* Owned by rendering thread */
+
+        public PoseBuffer(int count) {
+            poses = new Pose[] {new Pose(count), new Pose(count), new Pose(count)};
+        }
+
+        public Pose Back {
+            get { return poses[back]; }
+        }
+
+        public Pose Front {
+            get { return poses[front]; }
+        }
+
+        /* Exchange publishes the writes to Back before it */
+        public void Publish() {
+            back = Interlocked.Exchange(ref shared, back | IsNewer) & ~IsNewer;
+        }
+
+        /* Returns false if nothing is published since the last take */
+        public bool Take() {
+            if ((Volatile.Read(ref shared) & IsNewer) == 0) {
+                return false;
+            }
+            front = Interlocked.Exchange(ref shared, front) & ~IsNewer;
+            return true;
+        }
+    }
 
     /**
      * Initialize a manager instance.
@@ -49,10 +104,14 @@ public class TrackerManager {
      * @param bone A HumanBodyBones constant which specifies the bone that tracker will control.
      *
      * @returns A boolean value which describes whether the operation is succeeded.
+     *
+     * @note
+     * Do not call this method while reading rotations.
      */
     public bool AddTracker(HumanBodyBones bone) {
         try {
             trackers.Add(new Tracker(serial, (byte)((byte)bone + 1), anim.GetBoneTransform(bone)));
+            poses = new PoseBuffer(trackers.Count);
             Debug.LogFormat("Add tracker: {0}", bone);
             return true;
         }
@@ -66,11 +125,30 @@ public class TrackerManager {
      * You must call this method before start tracking.
      *
      * @note
-     * This method uploads DMP firmware to all trackers.
-     * Even if you do not add some tracker, those trackers will receive the firmware.
+     * Trackers still holding DMP firmware in their IMU resume without upload.
+     * If any other tracker is added, DMP firmware is uploaded to all trackers waiting for it,
+     * even to those you do not add.
+     * Upload is repeated for trackers which dropped it, up to MaxDMPUploads times.
+     *
+     * @note
+     * This method raises an exception if the operation is failed.
      */
     public void Launch() {
-        Tracker.Launch(serial);
+        for (int upload = 0; ; ++upload) {
+            bool isUploadRequired = false;
+            foreach (var tracker in trackers) {
+                if (! tracker.ResumeDMP()) {
+                    isUploadRequired = true;
+                }
+            }
+            if (! isUploadRequired) {
+                return;
+            }
+            if (upload == MaxDMPUploads) {
+                throw new Exception("DMP firmware upload failed");
+            }
+            Tracker.Launch(serial);
+        }
     }
 
     /**
@@ -111,27 +189,140 @@ public class TrackerManager {
         }
     }
 
+    /**
+     * Change the format of rotations sent by all trackers.
+     * You should call this method before PrepareRotations() or StartStreaming().
+     *
+     * @note
+     * This method raises an exception if the operation is failed.
+     */
+    public void SetFormats(Tracker.Format format) {
+        foreach (var tracker in trackers) {
+            tracker.SetFormat(format);
+        }
+    }
+
     /**
      * Communicate with sensors to obtain rotations and put them into the buffer.
      * You should call this method from a background thread,
      * and then the main thread should call SetRotations().
      *
      * @note
-     * This method raises an exception if the operation is failed.
+     * All the trackers are read by one broadcast request.
+     * A tracker which missed its time slot keeps the previous rotation.
      */
     public void PrepareRotations() {
-        foreach (var tracker in trackers) {
-            tracker.PrepareRotation();
+        Tracker.PrepareRotations(serial, trackers);
+        PublishRotations();
+    }
+
+    /**
+     * Publish the latest rotations of all trackers as one pose for SetRotations().
+     * Methods of this class reading rotations call this, so you only call it after those of Tracker
+     * (e.g. Tracker.PrepareStampedRotation()) from the same thread.
+     */
+    public void PublishRotations() {
+        Pose pose = poses.Back;
+        for (int index = 0; index < trackers.Count; ++index) {
+            pose.IsValid[index] = trackers[index].GetLatestRotation(out pose.Timestamps[index], out pose.Rotations[index]);
         }
+        poses.Publish();
+    }
+
+    /* Returns the newest pose published, which stays the same until the next call */
+    private Pose TakePose() {
+        if (poses.Take()) {
+            Pose pose = poses.Front;
+            for (int index = 0; index < trackers.Count; ++index) {
+                if (pose.IsValid[index]) {
+                    trackers[index].TakeRotation(pose.Timestamps[index], pose.Rotations[index]);
+                }
+            }
+        }
+        return poses.Front;
+    }
+
+    /**
+     * Let the clocks of all trackers follow Tracker.HostTimestamp.
+     * You should call this method about every second from the background thread,
+     * between requests to trackers (not while streaming).
+     */
+    public void SynchronizeClocks() {
+        Tracker.SynchronizeClocks(serial);
+    }
+
+    /**
+     * Same as PrepareRotations(), but all the rotations are of the same moment.
+     * Trackers are read one by one after a broadcast latch, which takes longer than PrepareRotations().
+     */
+    public void PrepareLatchedRotations() {
+        Tracker.PrepareLatchedRotations(serial, trackers);
+        PublishRotations();
+    }
+
+    /**
+     * Let all trackers send their rotations by themselves.
+     * Then you should call ReadStreamedRotations() repeatedly from a background thread
+     * instead of PrepareRotations().
+     *
+     * @param period Period of sending in microseconds.
+     *               The default value matches the output rate of DMP (75 Hz).
+     *
+     * @note
+     * Do not call other methods than ReadStreamedRotations() and StopStreaming() while streaming,
+     * or the requests collide with the trackers sending.
+     */
+    public void StartStreaming(int period = 13333) {
+        Tracker.StartStreaming(serial, trackers, period);
+    }
+
+    /**
+     * Receive rotations sent by streaming trackers and put them into the buffer.
+     * This method blocks until all the trackers sent or timed out.
+     */
+    public void ReadStreamedRotations() {
+        Tracker.ReadStreamedRotations(serial, trackers);
+        PublishRotations();
+    }
+
+    /**
+     * Stop streaming started by StartStreaming().
+     *
+     * @note
+     * This method raises an exception if the operation is failed.
+     */
+    public void StopStreaming() {
+        Tracker.StopStreaming(serial, trackers);
     }
 
     /**
      * Assign all the rotations of added trackers to the bones.
      * You call this method periodically to achive tracking.
+     *
+     * @note
+     * The rotations are of the newest pose published by the reading thread,
+     * so all the bones are of the same read without waiting for it.
      */
     public void SetRotations() {
+        Pose pose = TakePose();
+        for (int index = 0; index < trackers.Count; ++index) {
+            if (pose.IsValid[index]) {
+                trackers[index].SetRotation();
+            }
+        }
+    }
+
+    /**
+     * Same as SetRotations(), but the rotations are interpolated to a little before now.
+     * Call this every frame for smooth motion regardless of jitter of reading.
+     *
+     * @param delay Seconds of latency traded for smoothness, longer than the reading interval.
+     */
+    public void SetInterpolatedRotations(double delay = 0.03) {
+        TakePose();
         foreach (var tracker in trackers) {
-            tracker.SetRotation();
+            tracker.InterpolationDelay = delay;
+            tracker.SetInterpolatedRotation();
         }
     }
 